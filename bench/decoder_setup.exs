@@ -0,0 +1,39 @@
+# Compares the latency of opening a decoder and decoding its first packet
+# with and without a Membrane.LibAV.DecoderPool, as paid by each of the
+# short lived decoders of an HLS playlist. The output conversion adds the
+# resampler setup to the cost of a new decoder.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+{:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+:ok = LibAV.demuxer_add_data(ctx, File.read!(path))
+:ok = LibAV.demuxer_add_data(ctx, nil)
+{:ok, streams} = LibAV.demuxer_streams(ctx)
+{:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+stream = Enum.find(streams, &(&1.codec_type == :audio))
+packet = Enum.find(packets, &(&1.stream_index == stream.stream_index))
+{:ok, pool} = LibAV.DecoderPool.new()
+
+configs = %{
+  "native format" => %{time_base: stream.time_base},
+  "s16 48 kHz stereo" => %{
+    time_base: stream.time_base,
+    output_sample_format: :s16,
+    output_sample_rate: 48_000,
+    output_channels: 2
+  }
+}
+
+jobs =
+  for {name, opts} <- configs,
+      {label, opts} <- [{"new", opts}, {"pooled", Map.put(opts, :decoder_pool, pool)}],
+      into: %{} do
+    {"#{name} (#{label})", fn -> Bench.decoder_setup(stream, packet, opts) end}
+  end
+
+Benchee.run(jobs, time: 5, memory_time: 1)
+
+IO.inspect(LibAV.DecoderPool.stats(pool), label: "decoder pool")
@@ -0,0 +1,45 @@
+# Measures demuxing and decoding through the NIF API across input chunk
+# sizes and probe sizes, the Elixir counterpart of the native
+# c_src/bench/demux_decode harness (`make -C c_src bench-run`). Comparing
+# the two tells the cost of the NIF boundary apart from the one of libav.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+chunk_sizes = [4 * 1024, 64 * 1024, 1024 * 1024]
+probe_sizes = [2 * 1024, 64 * 1024, 1024 * 1024]
+bytes = File.stat!(path).size
+
+inputs =
+  for chunk_size <- chunk_sizes do
+    {"#{div(chunk_size, 1024)} KiB chunks", Bench.chunks(path, chunk_size)}
+  end
+
+jobs =
+  for probe_size <- probe_sizes, into: %{} do
+    {"demux+decode, #{div(probe_size, 1024)} KiB probe",
+     fn chunks -> Bench.demux_decode(chunks, probe_size: probe_size) end}
+  end
+
+# Decoding the packets of each demuxer batch in a single call amortizes
+# the cost of the NIF boundary. Regrouping the samples in fixed chunks
+# natively costs a copy through the sample fifo.
+jobs =
+  Map.merge(jobs, %{
+    "demux+decode, batched" => fn chunks -> Bench.demux_decode(chunks, batch_decode: true) end,
+    "demux+decode, 20 ms chunks" => fn chunks ->
+      Bench.demux_decode(chunks, batch_decode: true, chunk_duration: 20_000)
+    end,
+    "demux" => fn chunks -> Bench.demux(chunks) end
+  })
+
+suite =
+  Benchee.run(
+    jobs,
+    inputs: inputs,
+    time: 5,
+    memory_time: 1
+  )
+
+Bench.print_throughput(suite, bytes)
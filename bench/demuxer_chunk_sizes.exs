@@ -0,0 +1,22 @@
+# Measures demuxer_add_data + demuxer_read_packet throughput when the input
+# arrives in chunks of different sizes. The Ioq references the chunks and
+# libav reads them in place, hence throughput should only degrade with
+# small chunks by the cost of the calls themselves.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+chunk_sizes = [1024, 4 * 1024, 64 * 1024, 1024 * 1024]
+bytes = path |> Bench.chunks(64 * 1024) |> Bench.demux()
+
+suite =
+  Benchee.run(
+    %{
+      "demux" => fn chunks -> Bench.demux(chunks) end
+    },
+    inputs: Enum.map(chunk_sizes, &{"#{div(&1, 1024)} KiB chunks", Bench.chunks(path, &1)}),
+    time: 5
+  )
+
+Bench.print_throughput(suite, bytes)
@@ -0,0 +1,28 @@
+# Compares reading packets one NIF call at a time with reading them in
+# batches through demuxer_read_packets/3, and with taking the packets parsed
+# by the read-ahead thread.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+chunks = Bench.chunks(path, 64 * 1024)
+packets = Bench.count_packets(chunks)
+
+suite =
+  Benchee.run(
+    %{
+      "per packet" => fn -> Bench.demux(chunks, zero_copy: true) end,
+      "batch of 16" => fn -> Bench.demux(chunks, zero_copy: true, batch: 16) end,
+      "batch of 256" => fn -> Bench.demux(chunks, zero_copy: true, batch: 256) end,
+      "read ahead" => fn -> Bench.demux(chunks, zero_copy: true, read_ahead: true) end
+    },
+    time: 5
+  )
+
+IO.puts("\nPackets/s")
+
+for scenario <- suite.scenarios do
+  packets_s = scenario.run_time_data.statistics.ips * packets
+  IO.puts("  #{String.pad_trailing(scenario.name, 30)} #{round(packets_s)}")
+end
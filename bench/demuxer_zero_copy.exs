@@ -0,0 +1,21 @@
+# Compares the packet export paths of the demuxer: copying each payload in
+# a new binary versus wrapping the libav buffer in a resource binary.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+chunks = Bench.chunks(path, 64 * 1024)
+bytes = Bench.demux(chunks)
+
+suite =
+  Benchee.run(
+    %{
+      "copy" => fn -> Bench.demux(chunks, zero_copy: false) end,
+      "zero_copy" => fn -> Bench.demux(chunks, zero_copy: true) end
+    },
+    time: 5,
+    memory_time: 1
+  )
+
+Bench.print_throughput(suite, bytes)
@@ -0,0 +1,38 @@
+# Compares encoding PCM to AAC with Membrane.LibAV.Encoder and with the
+# Membrane.AAC.FDK.Encoder element it replaces. Both run in a pipeline fed
+# by a testing source, so that process hops and copies are accounted for.
+# The bare NIF path tells the cost of the pipeline apart.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+import Membrane.ChildrenSpec
+
+alias Membrane.LibAV.Bench
+
+seconds = String.to_integer(System.get_env("BENCH_SECONDS", "60"))
+{payloads, format} = Bench.sine_pcm(seconds)
+bytes = Enum.reduce(payloads, 0, &(byte_size(&1) + &2))
+
+encoders = %{
+  "libav aac" => %Membrane.LibAV.Encoder{codec: "aac", bit_rate: 128_000},
+  "fdk aac" => %Membrane.AAC.FDK.Encoder{aot: :mpeg4_lc, bitrate: 128_000}
+}
+
+jobs =
+  Map.new(encoders, fn {name, encoder} ->
+    spec = fn ->
+      child(:source, %Membrane.Testing.Source{output: payloads, stream_format: format})
+      |> child(:encoder, encoder)
+      |> child(:sink, Membrane.Testing.Sink)
+    end
+
+    {"#{name} (pipeline)", fn -> Bench.run_pipeline(spec.()) end}
+  end)
+
+suite =
+  Benchee.run(
+    Map.put(jobs, "libav aac (nif)", fn -> Bench.encode(payloads, format, "aac") end),
+    time: 10,
+    memory_time: 1
+  )
+
+Bench.print_throughput(suite, bytes)
@@ -0,0 +1,31 @@
+# Compares decoding several tracks one after the other on the calling
+# process with decoding them in parallel through a multi decoder. The audio
+# track of the input is decoded BENCH_TRACKS times to stand for the tracks
+# of a multi-language file.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+tracks = String.to_integer(System.get_env("BENCH_TRACKS", "4"))
+{:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+:ok = LibAV.demuxer_add_data(ctx, File.read!(path))
+:ok = LibAV.demuxer_add_data(ctx, nil)
+{:ok, streams} = LibAV.demuxer_streams(ctx)
+{:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+stream = Enum.find(streams, &(&1.codec_type == :audio))
+packets = Enum.filter(packets, &(&1.stream_index == stream.stream_index))
+{:ok, pool} = LibAV.WorkerPool.new()
+
+Benchee.run(
+  %{
+    "#{tracks} tracks, serial" => fn -> Bench.serial_decode(stream, packets, tracks) end,
+    "#{tracks} tracks, multi decoder" => fn ->
+      Bench.multi_decode(stream, packets, tracks, pool)
+    end
+  },
+  time: 5
+)
+
+IO.inspect(LibAV.WorkerPool.stats(pool), label: "worker pool")
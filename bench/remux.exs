@@ -0,0 +1,25 @@
+# Compares remuxing the input to other containers with demuxing and
+# decoding it, which is the least a transcode costs before encoding.
+Code.require_file("support/bench_helper.exs", __DIR__)
+
+alias Membrane.LibAV.Bench
+
+path = System.get_env("BENCH_INPUT", "test/data/safari.mp4")
+chunks = Bench.chunks(path, 64 * 1024)
+bytes = File.stat!(path).size
+
+suite =
+  Benchee.run(
+    %{
+      "remux mpegts" => fn -> Bench.remux(chunks, "mpegts") end,
+      "remux matroska" => fn -> Bench.remux(chunks, "matroska") end,
+      "remux fragmented mp4" => fn ->
+        Bench.remux(chunks, "mp4", %{"movflags" => "frag_keyframe+empty_moov"})
+      end,
+      "demux+decode" => fn -> Bench.demux_decode(chunks) end
+    },
+    time: 5,
+    memory_time: 1
+  )
+
+Bench.print_throughput(suite, bytes)
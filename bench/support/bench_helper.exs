@@ -0,0 +1,349 @@
+defmodule Membrane.LibAV.Bench do
+  @moduledoc false
+  # Helpers shared by the benchmarks, which drive the NIFs directly to keep
+  # the pipeline machinery out of the measurements.
+  # Run the benchmarks with `mix run bench/<name>.exs`.
+
+  alias Membrane.LibAV
+
+  def chunks(path, chunk_size) do
+    path
+    |> File.stream!([], chunk_size)
+    |> Enum.to_list()
+  end
+
+  # Demuxes the chunks and returns the total payload size of the packets.
+  # Options:
+  # * probe_size: initial probe size of the demuxer.
+  # * zero_copy: whether the packet payloads are copied.
+  # * batch: when set, packets are read in batches of this size through
+  #   demuxer_read_packets/3, one by one otherwise.
+  # * read_ahead: when true, packets are parsed by the read-ahead thread of
+  #   the demuxer and taken after each chunk.
+  def demux(chunks, opts \\ []) do
+    probe_size = Keyword.get(opts, :probe_size, 2048)
+    nif_opts = Map.new(Keyword.take(opts, [:zero_copy]))
+    {:ok, ctx} = LibAV.demuxer_alloc_context(probe_size, nif_opts)
+
+    if Keyword.get(opts, :read_ahead, false) do
+      demux_ahead(ctx, chunks)
+    else
+      demux_inline(ctx, chunks, Keyword.get(opts, :batch))
+    end
+  end
+
+  defp demux_inline(ctx, chunks, batch) do
+    bytes =
+      Enum.reduce(chunks, 0, fn chunk, bytes ->
+        :ok = LibAV.demuxer_add_data(ctx, chunk)
+        if LibAV.demuxer_is_ready(ctx), do: read_available(ctx, batch, bytes), else: bytes
+      end)
+
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {:ok, _streams} = LibAV.demuxer_streams(ctx)
+    read_available(ctx, batch, bytes)
+  end
+
+  defp read_available(ctx, nil, bytes) do
+    case LibAV.demuxer_read_packet(ctx) do
+      {:ok, packet} -> read_available(ctx, nil, bytes + byte_size(packet.data))
+      {:demand, _size} -> bytes
+      :eof -> bytes
+    end
+  end
+
+  defp read_available(ctx, batch, bytes) do
+    case LibAV.demuxer_read_packets(ctx, batch, 64 * 1024 * 1024) do
+      {:ok, packets} -> read_available(ctx, batch, bytes + payload_size(packets))
+      {:demand, _size, packets} -> bytes + payload_size(packets)
+      {:eof, packets} -> bytes + payload_size(packets)
+    end
+  end
+
+  defp demux_ahead(ctx, chunks) do
+    tag = make_ref()
+
+    {started?, bytes} =
+      Enum.reduce(chunks, {false, 0}, fn chunk, {started?, bytes} ->
+        :ok = LibAV.demuxer_add_data(ctx, chunk)
+
+        cond do
+          started? ->
+            {true, bytes + take_ahead(ctx, tag)}
+
+          LibAV.demuxer_is_ready(ctx) ->
+            :ok = LibAV.demuxer_start_read_ahead(ctx, tag)
+            {true, bytes}
+
+          true ->
+            {false, bytes}
+        end
+      end)
+
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+
+    unless started? do
+      {:ok, _streams} = LibAV.demuxer_streams(ctx)
+      :ok = LibAV.demuxer_start_read_ahead(ctx, tag)
+    end
+
+    drain_ahead(ctx, tag, bytes)
+  end
+
+  # Takes what is available without waiting, flushing the notification.
+  defp take_ahead(ctx, tag) do
+    receive do
+      {:libav_demuxer, ^tag} -> :ok
+    after
+      0 -> :ok
+    end
+
+    {:ok, packets} = LibAV.demuxer_take_packets(ctx)
+    payload_size(packets)
+  end
+
+  defp drain_ahead(ctx, tag, bytes) do
+    receive do
+      {:libav_demuxer, ^tag} ->
+        case LibAV.demuxer_take_packets(ctx) do
+          {:ok, packets} -> drain_ahead(ctx, tag, bytes + payload_size(packets))
+          {:eof, packets} -> bytes + payload_size(packets)
+        end
+    end
+  end
+
+  defp payload_size(packets) do
+    Enum.reduce(packets, 0, &(byte_size(&1.data) + &2))
+  end
+
+  # Demuxes the chunks and decodes the first audio stream, returning the
+  # number of frames. The decoder is opened as soon as the streams are
+  # known, then packets are decoded as they come: one by one, or with one
+  # call per batch read from the demuxer when batch_decode is set. With
+  # chunk_duration, in microseconds, the frames are chunks of that duration.
+  def demux_decode(chunks, opts \\ []) do
+    probe_size = Keyword.get(opts, :probe_size, 2048)
+    batch = Keyword.get(opts, :batch_decode, false)
+    decoder_opts = Map.new(Keyword.take(opts, [:chunk_duration]))
+    {:ok, ctx} = LibAV.demuxer_alloc_context(probe_size, %{})
+
+    state =
+      Enum.reduce(chunks, nil, fn chunk, state ->
+        :ok = LibAV.demuxer_add_data(ctx, chunk)
+
+        if LibAV.demuxer_is_ready(ctx),
+          do: decode_available(ctx, state || decoder_opts, batch),
+          else: state
+      end)
+
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {decoder, _index, frames} = decode_available(ctx, state || decoder_opts, batch)
+
+    {:eof, rest} = LibAV.decoder_add_data(decoder, nil)
+    frames + length(rest)
+  end
+
+  defp decode_available(ctx, decoder_opts, batch) when is_map(decoder_opts) do
+    {:ok, streams} = LibAV.demuxer_streams(ctx)
+    stream = Enum.find(streams, &(&1.codec_type == :audio))
+    decoder_opts = Map.put(decoder_opts, :time_base, stream.time_base)
+
+    {:ok, decoder} =
+      LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, decoder_opts)
+
+    decode_available(ctx, {decoder, stream.stream_index, 0}, batch)
+  end
+
+  defp decode_available(ctx, {decoder, index, frames}, batch) do
+    case LibAV.demuxer_read_packets(ctx, 256, 4 * 1024 * 1024) do
+      {:ok, packets} ->
+        state = {decoder, index, frames + decode(decoder, index, packets, batch)}
+        decode_available(ctx, state, batch)
+
+      {:demand, _size, packets} ->
+        {decoder, index, frames + decode(decoder, index, packets, batch)}
+
+      {:eof, packets} ->
+        {decoder, index, frames + decode(decoder, index, packets, batch)}
+    end
+  end
+
+  defp decode(decoder, index, packets, true) do
+    packets = Enum.filter(packets, &(&1.stream_index == index))
+    {:ok, decoded} = LibAV.decoder_add_packets(decoder, packets)
+    length(decoded)
+  end
+
+  defp decode(decoder, index, packets, false) do
+    packets
+    |> Enum.filter(&(&1.stream_index == index))
+    |> Enum.reduce(0, fn packet, frames ->
+      {:ok, decoded} = LibAV.decoder_add_data(decoder, packet)
+      frames + length(decoded)
+    end)
+  end
+
+  # Opens a decoder for the stream and decodes its first packet, the
+  # latency a new element adds before its first frame. The context is
+  # collected before returning, which gives it back to the decoder pool
+  # found in opts, if any.
+  def decoder_setup(stream, packet, opts) do
+    :ok = open_and_decode(stream, packet, opts)
+    :erlang.garbage_collect()
+    :ok
+  end
+
+  defp open_and_decode(stream, packet, opts) do
+    {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, opts)
+    {:ok, _frames} = LibAV.decoder_add_data(ctx, packet)
+    :ok
+  end
+
+  # Decodes the packets of the stream once per track, one track after the
+  # other on the calling process, returning the number of frames.
+  def serial_decode(stream, packets, tracks) do
+    for _track <- 1..tracks, reduce: 0 do
+      frames ->
+        {:ok, decoder} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+        {:ok, decoded} = LibAV.decoder_add_packets(decoder, packets)
+        {:eof, rest} = LibAV.decoder_add_data(decoder, nil)
+        frames + length(decoded) + length(rest)
+    end
+  end
+
+  # Same as serial_decode/3, with the tracks decoded in parallel on the
+  # pool through a multi decoder, as the streams of a multi-language file.
+  def multi_decode(stream, packets, tracks, pool) do
+    {:ok, multi} = LibAV.multi_decoder_alloc(pool)
+
+    for track <- 1..tracks do
+      {:ok, decoder} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+      :ok = LibAV.multi_decoder_add_stream(multi, track, decoder)
+    end
+
+    entries = for packet <- packets ++ [nil], track <- 1..tracks, do: {track, packet}
+    :ok = LibAV.multi_decoder_add_packets(multi, entries)
+
+    Enum.reduce(1..tracks, 0, fn track, frames -> frames + receive_track(track, 0) end)
+  end
+
+  defp receive_track(track, frames) do
+    receive do
+      {:libav_decoder, ^track, {:ok, decoded}} -> receive_track(track, frames + length(decoded))
+      {:libav_decoder, ^track, {:eof, decoded}} -> frames + length(decoded)
+    end
+  end
+
+  # Demuxes the chunks and writes every stream in the given format,
+  # returning the size of the output.
+  def remux(chunks, format, options \\ %{}) do
+    {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+
+    Enum.each(chunks, &LibAV.demuxer_add_data(ctx, &1))
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {:ok, streams} = LibAV.demuxer_streams(ctx)
+    {:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000_000, 1_000_000_000_000)
+
+    {:ok, muxer} = LibAV.muxer_alloc_context(format, %{options: options})
+
+    for stream <- streams do
+      {:ok, _index} = LibAV.muxer_add_stream(muxer, stream.codec_params, stream.time_base)
+    end
+
+    {:ok, header} = LibAV.muxer_write_header(muxer)
+    {:ok, body} = LibAV.muxer_write_packets(muxer, packets)
+    {:ok, trailer} = LibAV.muxer_write_trailer(muxer)
+
+    byte_size(header) + byte_size(body) + byte_size(trailer)
+  end
+
+  # Counts the packets produced by demuxing the chunks.
+  def count_packets(chunks) do
+    {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+
+    Enum.each(chunks, &LibAV.demuxer_add_data(ctx, &1))
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {:ok, _streams} = LibAV.demuxer_streams(ctx)
+    {:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000_000, 1_000_000_000_000)
+
+    length(packets)
+  end
+
+  # Returns seconds of a 440 Hz mono tone as 20 ms payloads of native
+  # s16 samples, with their stream format.
+  def sine_pcm(seconds, sample_rate \\ 48_000) do
+    samples =
+      for i <- 0..(seconds * sample_rate - 1), into: <<>> do
+        value = round(:math.sin(2 * :math.pi() * 440 * i / sample_rate) * 10_000)
+        <<value::signed-native-16>>
+      end
+
+    payload_size = div(sample_rate, 50) * 2
+    payloads = for <<payload::binary-size(payload_size) <- samples>>, do: payload
+
+    sample_format =
+      case System.endianness() do
+        :little -> :s16le
+        :big -> :s16be
+      end
+
+    format = %Membrane.RawAudio{
+      sample_format: sample_format,
+      sample_rate: sample_rate,
+      channels: 1
+    }
+
+    {payloads, format}
+  end
+
+  # Encodes the payloads through the NIF API and returns the number of
+  # packets.
+  def encode(payloads, format, codec) do
+    {:ok, ctx} =
+      LibAV.encoder_alloc_context(codec, %{
+        sample_format: Membrane.LibAV.Format.sample_format!(format.sample_format),
+        sample_rate: format.sample_rate,
+        channels: format.channels
+      })
+
+    packets =
+      Enum.reduce(payloads, 0, fn payload, count ->
+        {:ok, packets} = LibAV.encoder_add_data(ctx, %{data: payload, pts: nil})
+        count + length(packets)
+      end)
+
+    {:eof, rest} = LibAV.encoder_add_data(ctx, nil)
+    packets + length(rest)
+  end
+
+  # Runs the pipeline until its :sink child receives the end of stream.
+  def run_pipeline(spec) do
+    {:ok, _supervisor, pid} = Membrane.Testing.Pipeline.start_link(spec: spec)
+
+    receive do
+      {Membrane.Testing.Pipeline, ^pid, {:handle_element_end_of_stream, {:sink, :input}}} ->
+        :ok
+    after
+      60_000 -> raise "pipeline did not finish"
+    end
+
+    Membrane.Pipeline.terminate(pid)
+  end
+
+  # Prints the throughput of each scenario, given the bytes processed
+  # by a single run.
+  def print_throughput(suite, bytes) do
+    IO.puts("\nThroughput")
+
+    for scenario <- suite.scenarios do
+      name =
+        if is_binary(scenario.input_name),
+          do: "#{scenario.name} (#{scenario.input_name})",
+          else: scenario.name
+
+      mb_s = scenario.run_time_data.statistics.ips * bytes / 1_000_000
+      IO.puts("  #{String.pad_trailing(name, 40)} #{Float.round(mb_s, 2)} MB/s")
+    end
+  end
+end
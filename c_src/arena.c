@@ -0,0 +1,145 @@
+#include "arena.h"
+#include <string.h>
+
+// Header of the blocks allocated from an arena, which links them so that
+// arena_destroy can free whatever is left.
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;
+  struct ArenaBlock *next;
+  size_t size;
+} ArenaBlock;
+
+// Keeps the data following the header aligned for any type.
+#define BLOCK_HEADER_SIZE ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+#define BLOCK_DATA(block) ((char *)(block) + BLOCK_HEADER_SIZE)
+#define DATA_BLOCK(ptr) ((ArenaBlock *)((char *)(ptr)-BLOCK_HEADER_SIZE))
+
+void arena_init(Arena *arena, size_t limit) {
+  memset(arena, 0, sizeof(Arena));
+  arena->limit = limit;
+}
+
+void arena_destroy(Arena *arena) {
+  ArenaBlock *block, *next;
+
+  for (block = arena->blocks; block; block = next) {
+    next = block->next;
+    enif_free(block);
+  }
+  arena->blocks = NULL;
+}
+
+int arena_fits(Arena *arena, size_t size) {
+  return !arena->limit ||
+         __atomic_load_n(&arena->current, __ATOMIC_RELAXED) + size <=
+             arena->limit;
+}
+
+// Raises the peak to current, unless another thread raised it further.
+void update_peak(Arena *arena, size_t current) {
+  size_t peak = __atomic_load_n(&arena->peak, __ATOMIC_RELAXED);
+
+  while (current > peak &&
+         !__atomic_compare_exchange_n(&arena->peak, &peak, current, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+int arena_reserve(Arena *arena, size_t size) {
+  size_t current;
+
+  current = __atomic_add_fetch(&arena->current, size, __ATOMIC_RELAXED);
+  if (arena->limit && current > arena->limit) {
+    __atomic_sub_fetch(&arena->current, size, __ATOMIC_RELAXED);
+    return AVERROR_MEMORY_LIMIT;
+  }
+
+  update_peak(arena, current);
+  return 0;
+}
+
+void arena_charge(Arena *arena, size_t size) {
+  update_peak(arena,
+              __atomic_add_fetch(&arena->current, size, __ATOMIC_RELAXED));
+}
+
+void arena_release(Arena *arena, size_t size) {
+  __atomic_sub_fetch(&arena->current, size, __ATOMIC_RELAXED);
+}
+
+// Puts block in place of old in the list, or at its head when old is NULL.
+void link_block(Arena *arena, ArenaBlock *block, ArenaBlock *old) {
+  if (!old) {
+    block->prev = NULL;
+    block->next = arena->blocks;
+  }
+
+  if (block->next)
+    block->next->prev = block;
+  if (block->prev)
+    block->prev->next = block;
+  else
+    arena->blocks = block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  ArenaBlock *block;
+
+  if (arena_reserve(arena, BLOCK_HEADER_SIZE + size))
+    return NULL;
+
+  if (!(block = (ArenaBlock *)enif_alloc(BLOCK_HEADER_SIZE + size))) {
+    arena_release(arena, BLOCK_HEADER_SIZE + size);
+    return NULL;
+  }
+
+  memset(BLOCK_DATA(block), 0, size);
+  block->size = size;
+  link_block(arena, block, NULL);
+
+  return BLOCK_DATA(block);
+}
+
+void *arena_realloc(Arena *arena, void *ptr, size_t size) {
+  ArenaBlock *block, *old;
+
+  if (!ptr)
+    return arena_alloc(arena, size);
+
+  old = DATA_BLOCK(ptr);
+  if (size > old->size && arena_reserve(arena, size - old->size))
+    return NULL;
+
+  if (!(block = (ArenaBlock *)enif_realloc(old, BLOCK_HEADER_SIZE + size))) {
+    if (size > old->size)
+      arena_release(arena, size - old->size);
+    return NULL;
+  }
+
+  if (size < block->size)
+    arena_release(arena, block->size - size);
+  block->size = size;
+  // The neighbours still point to the old address.
+  link_block(arena, block, old);
+
+  return BLOCK_DATA(block);
+}
+
+void arena_free(Arena *arena, void *ptr) {
+  ArenaBlock *block;
+
+  if (!ptr)
+    return;
+
+  block = DATA_BLOCK(ptr);
+  if (block->next)
+    block->next->prev = block->prev;
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    arena->blocks = block->next;
+
+  arena_release(arena, BLOCK_HEADER_SIZE + block->size);
+  enif_free(block);
+}
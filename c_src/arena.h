@@ -0,0 +1,61 @@
+#ifndef LIBAV_ARENA_H
+#define LIBAV_ARENA_H
+
+// Memory accounting of a native context. Its own structures are allocated
+// from its arena with enif_alloc, which makes them visible to
+// erlang:memory/0, while the buffers allocated elsewhere on its behalf are
+// charged with arena_reserve. An arena can be capped, in which case the
+// allocations and reservations past the limit fail.
+#include <erl_nif.h>
+#include <libavutil/error.h>
+#include <stddef.h>
+
+// Returned when the limit of an arena would be exceeded.
+#define AVERROR_MEMORY_LIMIT FFERRTAG('M', 'L', 'I', 'M')
+
+struct ArenaBlock;
+
+typedef struct {
+  // Bytes charged to the arena, and the most it ever held. Reservations
+  // update them atomically, as the threads of a WorkerPool charge the
+  // contexts they decode.
+  size_t current;
+  size_t peak;
+  // 0 when the arena is not capped.
+  size_t limit;
+
+  // The blocks that are not freed yet. Unlike reservations, allocating and
+  // freeing blocks is left to the thread owning the context.
+  struct ArenaBlock *blocks;
+} Arena;
+
+void arena_init(Arena *arena, size_t limit);
+
+// Frees the blocks still allocated from the arena.
+void arena_destroy(Arena *arena);
+
+// Tells whether size more bytes can be charged to the arena.
+int arena_fits(Arena *arena, size_t size);
+
+// Charges size bytes to the arena. Returns 0, or AVERROR_MEMORY_LIMIT when
+// the limit would be exceeded, in which case nothing is charged.
+int arena_reserve(Arena *arena, size_t size);
+
+// Charges size bytes regardless of the limit, for memory that was already
+// allocated by someone else, e.g. libav.
+void arena_charge(Arena *arena, size_t size);
+
+void arena_release(Arena *arena, size_t size);
+
+// Allocates size zeroed bytes from the arena, charging them along with the
+// bookkeeping of the block. Returns NULL past the limit.
+void *arena_alloc(Arena *arena, size_t size);
+
+// Resizes a block allocated from the arena, or allocates one when ptr is
+// NULL. The bytes added are not initialized. Returns NULL past the limit,
+// the block is then left untouched.
+void *arena_realloc(Arena *arena, void *ptr, size_t size);
+
+void arena_free(Arena *arena, void *ptr);
+
+#endif
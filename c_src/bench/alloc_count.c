@@ -0,0 +1,51 @@
+#include "alloc_count.h"
+#include <errno.h>
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+int alloc_counting = 0;
+AllocCount alloc_count;
+
+static void count_alloc(size_t size) {
+  if (alloc_counting) {
+    alloc_count.allocs++;
+    alloc_count.bytes += size;
+  }
+}
+
+void *malloc(size_t size) {
+  count_alloc(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  count_alloc(nmemb * size);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  count_alloc(size);
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  count_alloc(size);
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count_alloc(size);
+  return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr) {
+  if (alloc_counting && ptr)
+    alloc_count.frees++;
+  __libc_free(ptr);
+}
@@ -0,0 +1,15 @@
+#ifndef LIBAV_BENCH_ALLOC_COUNT_H
+#define LIBAV_BENCH_ALLOC_COUNT_H
+
+// Counts the heap allocations made while counting is enabled, by
+// interposing the glibc allocator.
+typedef struct {
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long bytes;
+} AllocCount;
+
+extern int alloc_counting;
+extern AllocCount alloc_count;
+
+#endif
@@ -0,0 +1,115 @@
+// Counts the heap allocations performed by the decoder in steady state.
+//
+// Usage: decoder_allocs <input>
+//
+// The input is demuxed with libavformat and its best audio stream decoded
+// with the same core used by the NIF. Frames are exported the way the NIF
+// does, i.e. by taking over their first buffer, which is released right
+// away as if the binary was garbage collected. Only the allocations made
+// while decoding are counted, after a warm up. A long input gives stable
+// numbers, e.g.
+//
+//   ffmpeg -f lavfi -i sine=duration=600 -c:a aac long.aac
+#include "alloc_count.h"
+#include "decoder.h"
+#include <libavformat/avformat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define WARMUP_PACKETS 64
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  AVFormatContext *fmt_ctx = NULL;
+  AVPacket *packet;
+  AVFrame *frame;
+  AVStream *stream;
+  Decoder dec;
+  DecoderConfig config;
+  unsigned long packets = 0, frames = 0, bytes = 0;
+  double elapsed = 0, start;
+  int index, ret;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <input>\n", argv[0]);
+    return 1;
+  }
+
+  if ((ret = avformat_open_input(&fmt_ctx, argv[1], NULL, NULL)) < 0 ||
+      (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+      (ret = index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                         NULL, 0)) < 0) {
+    fprintf(stderr, "%s: %s\n", argv[1], av_err2str(ret));
+    return 1;
+  }
+
+  stream = fmt_ctx->streams[index];
+  decoder_config_init(&config);
+  config.time_base = stream->time_base;
+  config.thread_count = 1;
+
+  if ((ret = decoder_open(&dec, stream->codecpar->codec_id, stream->codecpar,
+                          &config, NULL)) < 0) {
+    fprintf(stderr, "decoder: %s\n", av_err2str(ret));
+    return 1;
+  }
+
+  packet = av_packet_alloc();
+  while (av_read_frame(fmt_ctx, packet) >= 0) {
+    if (packet->stream_index != index) {
+      av_packet_unref(packet);
+      continue;
+    }
+
+    alloc_counting = packets >= WARMUP_PACKETS;
+    start = now();
+
+    decoder_send_packet(&dec, packet->data, packet->size, packet->pts,
+                        packet->dts);
+    while (decoder_receive_frame(&dec, &frame) == 0) {
+      // Export the frame like make_frame_map does.
+      AVBufferRef *ref = frame->buf[0];
+      frame->buf[0] = NULL;
+      av_buffer_unref(&ref);
+
+      if (alloc_counting)
+        frames++;
+    }
+
+    if (alloc_counting) {
+      elapsed += now() - start;
+      bytes += packet->size;
+    }
+    alloc_counting = 0;
+
+    packets++;
+    av_packet_unref(packet);
+  }
+
+  packets = packets > WARMUP_PACKETS ? packets - WARMUP_PACKETS : 0;
+  if (!packets) {
+    fprintf(stderr, "%s: not enough packets\n", argv[1]);
+    return 1;
+  }
+
+  printf("codec:            %s\n", avcodec_get_name(dec.codec_ctx->codec_id));
+  printf("packets:          %lu\n", packets);
+  printf("frames:           %lu\n", frames);
+  printf("frames/s:         %.0f\n", frames / elapsed);
+  printf("input MB/s:       %.2f\n", bytes / elapsed / 1e6);
+  printf("allocs/packet:    %.2f\n", (double)alloc_count.allocs / packets);
+  printf("frees/packet:     %.2f\n", (double)alloc_count.frees / packets);
+  printf("alloc B/packet:   %.0f\n", (double)alloc_count.bytes / packets);
+
+  av_packet_free(&packet);
+  decoder_close(&dec);
+  avformat_close_input(&fmt_ctx);
+
+  return 0;
+}
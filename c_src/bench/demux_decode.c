@@ -0,0 +1,251 @@
+// Measures the demux and decode throughput of the NIF core, outside of the
+// BEAM.
+//
+// Usage: demux_decode <input>...
+//
+// Each input is loaded in memory and fed to the demuxer in chunks, the way
+// the Membrane element does with demuxer_add_data, for every combination
+// of chunk and probe size. Its best audio stream is decoded along the way.
+// Inputs are also demuxed in file mode, as demuxer_open_file does. Every
+// run happens in a child process, so that its peak RSS can be reported.
+#include "alloc_count.h"
+#include "decoder.h"
+#include "demuxer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const size_t CHUNK_SIZES[] = {1024, 4 * 1024, 64 * 1024, 1024 * 1024};
+static const u_long PROBE_SIZES[] = {2 * 1024, 64 * 1024, 1024 * 1024};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+  double elapsed;
+  unsigned long packets;
+  unsigned long frames;
+} Result;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int load_file(const char *path, uint8_t **data, size_t *size) {
+  FILE *file;
+  long len;
+
+  if (!(file = fopen(path, "rb")))
+    return AVERROR(errno);
+
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  *data = malloc(len);
+  *size = fread(*data, 1, len, file);
+  fclose(file);
+
+  return *size == len ? 0 : AVERROR(EIO);
+}
+
+void feed(DemuxerContext *ctx, const uint8_t *data, size_t size,
+          size_t chunk_size, size_t *offset) {
+  ErlNifBinary bin;
+
+  bin.data = (unsigned char *)data + *offset;
+  bin.size = size - *offset < chunk_size ? size - *offset : chunk_size;
+  // Charged like queue_enq does, dequeuing releases the bytes.
+  arena_charge(ctx->queue->arena, bin.size);
+  enif_ioq_enq_binary(ctx->queue->q, &bin, 0);
+  *offset += bin.size;
+}
+
+// Opens a decoder for the best audio stream, if any. Returns its index.
+int open_decoder(DemuxerContext *ctx, Decoder *dec) {
+  DecoderConfig config;
+  AVStream *stream;
+  int index;
+
+  if ((index = av_find_best_stream(ctx->fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1,
+                                   NULL, 0)) < 0)
+    return -1;
+
+  stream = ctx->fmt_ctx->streams[index];
+  decoder_config_init(&config);
+  config.time_base = stream->time_base;
+
+  if (decoder_open(dec, stream->codecpar->codec_id, stream->codecpar, &config,
+                   NULL) < 0)
+    return -1;
+
+  return index;
+}
+
+// Receives the pending frames, exporting them like make_frame_map does.
+void receive_frames(Decoder *dec, Result *res) {
+  AVFrame *frame;
+
+  while (decoder_receive_frame(dec, &frame) == 0) {
+    AVBufferRef *ref = frame->buf[0];
+    frame->buf[0] = NULL;
+    av_buffer_unref(&ref);
+    res->frames++;
+  }
+}
+
+// Demuxes and decodes data, or the file at path when chunk_size is 0.
+int run(const char *path, const uint8_t *data, size_t size, size_t chunk_size,
+        u_long probe_size, Result *res) {
+  DemuxerContext *ctx;
+  ProbeOptions opts = {0};
+  Decoder dec;
+  size_t offset = 0;
+  double start;
+  int audio = -1, ret;
+
+  start = now();
+
+  if (chunk_size) {
+    ctx = demuxer_context_alloc(probe_size, &opts, 0);
+  } else if ((ret = demuxer_context_open_file(&ctx, path, &opts, 0)) < 0) {
+    goto done;
+  } else {
+    audio = open_decoder(ctx, &dec);
+  }
+
+  for (;;) {
+    if (!ctx->has_header) {
+      if (offset < size)
+        feed(ctx, data, size, chunk_size, &offset);
+      else
+        ctx->mode = CTX_MODE_DRAIN;
+
+      // The NIF only attempts to read the header once the queue is full.
+      if (ctx->mode != CTX_MODE_DRAIN && !queue_is_filled(ctx->queue))
+        continue;
+      if ((ret = demuxer_read_header(ctx)) == AVERROR(EAGAIN))
+        continue;
+      if (ret < 0)
+        goto done;
+
+      audio = open_decoder(ctx, &dec);
+      continue;
+    }
+
+    if ((ret = demuxer_next_packet(ctx)) > 0) {
+      if (offset < size)
+        feed(ctx, data, size, chunk_size, &offset);
+      else
+        ctx->mode = CTX_MODE_DRAIN;
+      continue;
+    }
+    if (ret < 0)
+      break;
+
+    res->packets++;
+    if (ctx->packet->stream_index == audio) {
+      decoder_send_packet(&dec, ctx->packet->data, ctx->packet->size,
+                          ctx->packet->pts, ctx->packet->dts);
+      receive_frames(&dec, res);
+    }
+    av_packet_unref(ctx->packet);
+  }
+
+  if (ret == AVERROR_EOF)
+    ret = 0;
+
+  if (audio >= 0) {
+    decoder_send_packet(&dec, NULL, 0, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+    receive_frames(&dec, res);
+    decoder_close(&dec);
+  }
+
+done:
+  demuxer_context_free(ctx);
+  res->elapsed = now() - start;
+  return ret;
+}
+
+void report(const char *path, size_t chunk_size, u_long probe_size) {
+  struct rusage usage;
+  Result res = {0};
+  uint8_t *data = NULL;
+  size_t size = 0;
+  char chunk[16], probe[16];
+  int ret;
+
+  if (chunk_size && (ret = load_file(path, &data, &size)) < 0) {
+    fprintf(stderr, "%s: %s\n", path, av_err2str(ret));
+    exit(1);
+  }
+
+  alloc_counting = 1;
+  ret = run(path, data, size, chunk_size, probe_size, &res);
+  alloc_counting = 0;
+
+  if (ret < 0) {
+    fprintf(stderr, "%s: %s\n", path, av_err2str(ret));
+    exit(1);
+  }
+
+  if (!chunk_size) {
+    FILE *file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  if (chunk_size) {
+    snprintf(chunk, sizeof(chunk), "%zuK", chunk_size / 1024);
+    snprintf(probe, sizeof(probe), "%luK", probe_size / 1024);
+  } else {
+    snprintf(chunk, sizeof(chunk), "file");
+    snprintf(probe, sizeof(probe), "-");
+  }
+
+  printf("%-28.28s %6s %6s %9.2f %10.0f %10.0f %10lu %10ld\n", path, chunk,
+         probe, size / res.elapsed / 1e6, res.packets / res.elapsed,
+         res.frames / res.elapsed, alloc_count.allocs, usage.ru_maxrss);
+  free(data);
+}
+
+// Runs report in a child process, which has a fresh peak RSS.
+void spawn_report(const char *path, size_t chunk_size, u_long probe_size) {
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    report(path, chunk_size, probe_size);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  waitpid(pid, &status, 0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <input>...\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-28s %6s %6s %9s %10s %10s %10s %10s\n", "input", "chunk", "probe",
+         "MB/s", "packets/s", "frames/s", "allocs", "RSS KiB");
+
+  for (int i = 1; i < argc; i++) {
+    for (int c = 0; c < LEN(CHUNK_SIZES); c++)
+      for (int p = 0; p < LEN(PROBE_SIZES); p++)
+        spawn_report(argv[i], CHUNK_SIZES[c], PROBE_SIZES[p]);
+    spawn_report(argv[i], 0, 0);
+  }
+
+  return 0;
+}
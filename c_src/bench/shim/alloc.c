@@ -0,0 +1,10 @@
+#include "erl_nif.h"
+#include <stdlib.h>
+
+// Backed by the C allocator, so that the allocations of the arenas are
+// counted by alloc_count like any other.
+void *enif_alloc(size_t size) { return malloc(size); }
+
+void *enif_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+
+void enif_free(void *ptr) { free(ptr); }
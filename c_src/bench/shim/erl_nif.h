@@ -0,0 +1,35 @@
+#ifndef LIBAV_BENCH_ERL_NIF_H
+#define LIBAV_BENCH_ERL_NIF_H
+
+// Stand-in for the erl_nif.h of ERTS, used by the native benchmarks. It
+// only provides the ErlNifIOQueue and allocator APIs the demuxing and
+// decoding cores depend on.
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef struct iovec SysIOVec;
+
+typedef struct {
+  size_t size;
+  unsigned char *data;
+} ErlNifBinary;
+
+typedef enum { ERL_NIF_IOQ_NORMAL = 1 } ErlNifIOQueueOpts;
+
+typedef struct ErlNifIOQueue ErlNifIOQueue;
+
+ErlNifIOQueue *enif_ioq_create(ErlNifIOQueueOpts opts);
+void enif_ioq_destroy(ErlNifIOQueue *q);
+size_t enif_ioq_size(ErlNifIOQueue *q);
+SysIOVec *enif_ioq_peek(ErlNifIOQueue *q, int *iovlen);
+int enif_ioq_deq(ErlNifIOQueue *q, size_t count, size_t *size);
+
+// Unlike in ERTS, the queue does not reference the binary: its data must
+// outlive the queue.
+int enif_ioq_enq_binary(ErlNifIOQueue *q, ErlNifBinary *bin, size_t skip);
+
+void *enif_alloc(size_t size);
+void *enif_realloc(void *ptr, size_t size);
+void enif_free(void *ptr);
+
+#endif
@@ -0,0 +1,81 @@
+#include "erl_nif.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A growable array of vectors, of which the ones in [head, tail) are
+// queued.
+struct ErlNifIOQueue {
+  SysIOVec *iov;
+  int head;
+  int tail;
+  int capacity;
+  size_t size;
+};
+
+ErlNifIOQueue *enif_ioq_create(ErlNifIOQueueOpts opts) {
+  return calloc(1, sizeof(ErlNifIOQueue));
+}
+
+void enif_ioq_destroy(ErlNifIOQueue *q) {
+  free(q->iov);
+  free(q);
+}
+
+size_t enif_ioq_size(ErlNifIOQueue *q) { return q->size; }
+
+SysIOVec *enif_ioq_peek(ErlNifIOQueue *q, int *iovlen) {
+  *iovlen = q->tail - q->head;
+  return q->iov + q->head;
+}
+
+int enif_ioq_deq(ErlNifIOQueue *q, size_t count, size_t *size) {
+  SysIOVec *iov;
+
+  if (count > q->size)
+    return 0;
+
+  q->size -= count;
+  while (count > 0) {
+    iov = &q->iov[q->head];
+
+    if (count < iov->iov_len) {
+      iov->iov_base = (char *)iov->iov_base + count;
+      iov->iov_len -= count;
+      break;
+    }
+
+    count -= iov->iov_len;
+    q->head++;
+  }
+
+  if (q->head == q->tail)
+    q->head = q->tail = 0;
+  if (size)
+    *size = q->size;
+
+  return 1;
+}
+
+int enif_ioq_enq_binary(ErlNifIOQueue *q, ErlNifBinary *bin, size_t skip) {
+  if (bin->size <= skip)
+    return 1;
+
+  if (q->tail == q->capacity) {
+    if (q->head > 0) {
+      memmove(q->iov, q->iov + q->head,
+              (q->tail - q->head) * sizeof(SysIOVec));
+      q->tail -= q->head;
+      q->head = 0;
+    } else {
+      q->capacity = q->capacity ? q->capacity * 2 : 16;
+      q->iov = realloc(q->iov, q->capacity * sizeof(SysIOVec));
+    }
+  }
+
+  q->iov[q->tail].iov_base = bin->data + skip;
+  q->iov[q->tail].iov_len = bin->size - skip;
+  q->tail++;
+  q->size += bin->size - skip;
+
+  return 1;
+}
@@ -0,0 +1,160 @@
+// Measures the video decoding throughput of the NIF core, outside of the
+// BEAM.
+//
+// Usage: video_decode <input>...
+//
+// The best video stream of each input is decoded with one thread, then
+// with frame threading on every core, as produced by the codec and
+// converted by the scaler. Pictures are exported the way make_frame_map
+// does: the ones packed in their first buffer are taken over, the others
+// copied. `make bench-run` generates H.264 and MPEG-4 clips with the ffmpeg
+// CLI.
+#include "decoder.h"
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  int thread_count;
+  int thread_type;
+  enum AVPixelFormat pixel_format;
+  // Divides the size of the pictures, 0 keeps it.
+  int scale_down;
+} Job;
+
+static const Job JOBS[] = {
+    {"1 thread", 1, 0, AV_PIX_FMT_NONE, 0},
+    {"frame threads", 0, FF_THREAD_FRAME, AV_PIX_FMT_NONE, 0},
+    {"frame threads, rgba", 0, FF_THREAD_FRAME, AV_PIX_FMT_RGBA, 0},
+    {"frame threads, 1/2 size", 0, FF_THREAD_FRAME, AV_PIX_FMT_NONE, 2},
+};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+  double elapsed;
+  unsigned long frames;
+  // Pictures exported without copying.
+  unsigned long exported;
+  unsigned long bytes_out;
+} Result;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Receives the pending pictures, exporting them like make_picture_data.
+void receive_pictures(Decoder *dec, Result *res) {
+  AVFrame *frame;
+  uint8_t *copy;
+  int size;
+
+  while (decoder_receive_frame(dec, &frame) == 0) {
+    if ((size = decoder_picture_size(frame))) {
+      AVBufferRef *ref = frame->buf[0];
+      frame->buf[0] = NULL;
+      av_buffer_unref(&ref);
+      res->exported++;
+    } else {
+      size = av_image_get_buffer_size(frame->format, frame->width,
+                                      frame->height, 1);
+      copy = malloc(size);
+      av_image_copy_to_buffer(copy, size, (const uint8_t *const *)frame->data,
+                              frame->linesize, frame->format, frame->width,
+                              frame->height, 1);
+      free(copy);
+    }
+
+    res->frames++;
+    res->bytes_out += size;
+  }
+}
+
+int run(const char *path, const Job *job, Result *res) {
+  AVFormatContext *fmt_ctx = NULL;
+  AVStream *stream;
+  AVPacket *packet;
+  Decoder dec;
+  DecoderConfig config;
+  double start;
+  int index, ret;
+
+  if ((ret = avformat_open_input(&fmt_ctx, path, NULL, NULL)) < 0 ||
+      (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0 ||
+      (ret = index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                         NULL, 0)) < 0)
+    goto done;
+
+  stream = fmt_ctx->streams[index];
+  decoder_config_init(&config);
+  config.time_base = stream->time_base;
+  config.thread_count = job->thread_count;
+  config.thread_type = job->thread_type;
+  config.pixel_format = job->pixel_format;
+  if (job->scale_down) {
+    config.width = stream->codecpar->width / job->scale_down;
+    config.height = stream->codecpar->height / job->scale_down;
+  }
+
+  if ((ret = decoder_open(&dec, stream->codecpar->codec_id, stream->codecpar,
+                          &config, NULL)) < 0)
+    goto done;
+
+  packet = av_packet_alloc();
+  start = now();
+
+  while (av_read_frame(fmt_ctx, packet) >= 0) {
+    if (packet->stream_index == index) {
+      decoder_send_packet(&dec, packet->data, packet->size, packet->pts,
+                          packet->dts);
+      receive_pictures(&dec, res);
+    }
+    av_packet_unref(packet);
+  }
+
+  decoder_send_packet(&dec, NULL, 0, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+  receive_pictures(&dec, res);
+
+  res->elapsed = now() - start;
+  av_packet_free(&packet);
+  decoder_close(&dec);
+  ret = 0;
+
+done:
+  avformat_close_input(&fmt_ctx);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <input>...\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-28s %-24s %10s %9s %9s\n", "input", "job", "frames/s", "MB/s",
+         "exported");
+
+  for (int i = 1; i < argc; i++) {
+    for (int j = 0; j < LEN(JOBS); j++) {
+      Result res = {0};
+      int ret;
+
+      if ((ret = run(argv[i], &JOBS[j], &res)) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[i], av_err2str(ret));
+        return 1;
+      }
+
+      printf("%-28.28s %-24s %10.0f %9.2f %8.0f%%\n", argv[i], JOBS[j].name,
+             res.frames / res.elapsed, res.bytes_out / res.elapsed / 1e6,
+             res.frames ? 100.0 * res.exported / res.frames : 0);
+    }
+  }
+
+  return 0;
+}
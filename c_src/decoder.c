@@ -0,0 +1,607 @@
+#include "decoder.h"
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/imgutils.h>
+#include <string.h>
+
+static AVBufferRef *output_pool_alloc(void *opaque, size_t size) {
+  OutputPool *pool = (OutputPool *)opaque;
+  AVBufferRef *buf;
+
+  if (arena_reserve(pool->arena, size))
+    return NULL;
+  if (!(buf = av_buffer_alloc(size))) {
+    arena_release(pool->arena, size);
+    return NULL;
+  }
+
+  pool->charge += size;
+  return buf;
+}
+
+// Releases the charge of the pool, whose outstanding buffers are freed
+// once released: the pool goes away with the last of them.
+static void output_pool_uninit(OutputPool *pool) {
+  av_buffer_pool_uninit(&pool->pool);
+  if (pool->charge)
+    arena_release(pool->arena, pool->charge);
+  pool->charge = 0;
+  pool->buffer_size = 0;
+}
+
+// Replaces the pool by one of buffers of size bytes.
+static int output_pool_init(OutputPool *pool, Arena *arena, int size) {
+  output_pool_uninit(pool);
+  pool->arena = arena;
+  if (!(pool->pool = av_buffer_pool_init2(size, pool, output_pool_alloc,
+                                          NULL)))
+    return AVERROR(ENOMEM);
+  pool->buffer_size = size;
+
+  return 0;
+}
+
+static int output_pool_get(OutputPool *pool, AVBufferRef **buf) {
+  if ((*buf = av_buffer_pool_get(pool->pool)))
+    return 0;
+
+  return arena_fits(pool->arena, pool->buffer_size) ? AVERROR(ENOMEM)
+                                                    : AVERROR_MEMORY_LIMIT;
+}
+
+int alloc_resampler(Decoder *dec) {
+  AVCodecContext *codec_ctx;
+  int ret;
+
+  codec_ctx = dec->codec_ctx;
+
+  if ((ret = swr_alloc_set_opts2(
+           &(dec->resampler_ctx), &dec->output_ch_layout,
+           dec->output_sample_format, dec->output_sample_rate,
+           &codec_ctx->ch_layout, codec_ctx->sample_fmt,
+           codec_ctx->sample_rate, 0, NULL)) < 0)
+    return ret;
+
+  return swr_init(dec->resampler_ctx);
+}
+
+// Allocates the fifo regrouping the output samples when chunks are
+// requested, once the output format is known.
+int open_chunking(Decoder *dec, const DecoderConfig *config) {
+  int size, ret;
+
+  dec->chunk_samples =
+      config->chunk_samples
+          ? config->chunk_samples
+          : av_rescale(config->chunk_duration, dec->output_sample_rate,
+                       AV_TIME_BASE);
+  if (!config->chunk_samples && !config->chunk_duration)
+    return 0;
+
+  // Chunks are made of packed samples, one plane.
+  if (dec->codec_ctx->codec_type != AVMEDIA_TYPE_AUDIO ||
+      dec->chunk_samples <= 0 ||
+      av_sample_fmt_is_planar(dec->output_sample_format))
+    return AVERROR(EINVAL);
+
+  size = av_samples_get_buffer_size(NULL, dec->output_ch_layout.nb_channels,
+                                    dec->chunk_samples,
+                                    dec->output_sample_format, 1);
+  if (size < 0)
+    return size;
+
+  if ((ret = arena_reserve(&dec->arena, size)))
+    return ret;
+
+  if (!(dec->fifo = av_audio_fifo_alloc(dec->output_sample_format,
+                                        dec->output_ch_layout.nb_channels,
+                                        dec->chunk_samples)) ||
+      !(dec->chunk_frame = av_frame_alloc()))
+    return AVERROR(ENOMEM);
+
+  if ((ret = output_pool_init(&dec->chunk_pool, &dec->arena, size)) < 0)
+    return ret;
+
+  dec->fifo_pts = AV_NOPTS_VALUE;
+  return 0;
+}
+
+// Sets the output video format from the configuration. Unset fields keep
+// following the pictures of the codec, which may only be known once they
+// are decoded and can change mid-stream. The scaler is allocated with the
+// first picture that is not in the output format.
+int open_video_output(Decoder *dec, const DecoderConfig *config) {
+  if (config->chunk_samples || config->chunk_duration || config->width < 0 ||
+      config->height < 0)
+    return AVERROR(EINVAL);
+
+  dec->output_pixel_format = config->pixel_format;
+  dec->output_width = config->width;
+  dec->output_height = config->height;
+
+  return 0;
+}
+
+// Resolves the output audio format from the configuration and the format
+// of the codec, allocating a resampler when they differ.
+int open_output(Decoder *dec, const DecoderConfig *config) {
+  AVCodecContext *codec_ctx;
+  int ret;
+
+  codec_ctx = dec->codec_ctx;
+
+  if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+    return open_video_output(dec, config);
+
+  dec->output_sample_format =
+      config->sample_format != AV_SAMPLE_FMT_NONE
+          ? config->sample_format
+          : av_get_packed_sample_fmt(codec_ctx->sample_fmt);
+  dec->output_sample_rate =
+      config->sample_rate ? config->sample_rate : codec_ctx->sample_rate;
+
+  // Keep the channel layout of the codec unless remixing is requested.
+  if (config->channels &&
+      config->channels != codec_ctx->ch_layout.nb_channels)
+    av_channel_layout_default(&dec->output_ch_layout, config->channels);
+  else if ((ret = av_channel_layout_copy(&dec->output_ch_layout,
+                                         &codec_ctx->ch_layout)) < 0)
+    return ret;
+
+  if ((ret = open_chunking(dec, config)) < 0)
+    return ret;
+
+  if (codec_ctx->codec_type != AVMEDIA_TYPE_AUDIO ||
+      (dec->output_sample_format == codec_ctx->sample_fmt &&
+       dec->output_sample_rate == codec_ctx->sample_rate &&
+       !av_channel_layout_compare(&dec->output_ch_layout,
+                                  &codec_ctx->ch_layout)))
+    return 0;
+
+  return alloc_resampler(dec);
+}
+
+void decoder_config_init(DecoderConfig *config) {
+  memset(config, 0, sizeof(DecoderConfig));
+  config->time_base = (AVRational){0, 1};
+  config->sample_format = AV_SAMPLE_FMT_NONE;
+  config->pixel_format = AV_PIX_FMT_NONE;
+}
+
+int decoder_open(Decoder *dec, enum AVCodecID codec_id,
+                 const AVCodecParameters *params, const DecoderConfig *config,
+                 AVDictionary **options) {
+  const AVCodec *codec;
+  int ret;
+
+  memset(dec, 0, sizeof(Decoder));
+  arena_init(&dec->arena, config->memory_limit);
+  dec->next_pts = AV_NOPTS_VALUE;
+
+  if (!(codec = avcodec_find_decoder(codec_id)))
+    return AVERROR_DECODER_NOT_FOUND;
+
+  if (!(dec->codec_ctx = avcodec_alloc_context3(codec)))
+    return AVERROR(ENOMEM);
+
+  if ((ret = avcodec_parameters_to_context(dec->codec_ctx, params)) < 0)
+    goto fail;
+
+  dec->codec_ctx->pkt_timebase = config->time_base;
+  dec->codec_ctx->thread_count = config->thread_count;
+  if (config->thread_type)
+    dec->codec_ctx->thread_type = config->thread_type;
+
+  if ((ret = avcodec_open2(dec->codec_ctx, codec, options)) < 0)
+    goto fail;
+
+  if ((ret = open_output(dec, config)) < 0)
+    goto fail;
+
+  dec->packet = av_packet_alloc();
+  dec->frame = av_frame_alloc();
+  dec->out_frame = av_frame_alloc();
+  if (!dec->packet || !dec->frame || !dec->out_frame) {
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  decoder_close(dec);
+  return ret;
+}
+
+void decoder_close(Decoder *dec) {
+  avcodec_free_context(&dec->codec_ctx);
+  if (dec->resampler_ctx)
+    swr_free(&dec->resampler_ctx);
+  sws_freeContext(dec->scaler_ctx);
+  dec->scaler_ctx = NULL;
+
+  av_packet_free(&dec->packet);
+  av_frame_free(&dec->frame);
+  av_frame_free(&dec->out_frame);
+  av_channel_layout_uninit(&dec->output_ch_layout);
+  output_pool_uninit(&dec->output_pool);
+
+  if (dec->fifo)
+    av_audio_fifo_free(dec->fifo);
+  dec->fifo = NULL;
+  av_frame_free(&dec->chunk_frame);
+  output_pool_uninit(&dec->chunk_pool);
+  arena_destroy(&dec->arena);
+}
+
+int decoder_reset(Decoder *dec) {
+  avcodec_flush_buffers(dec->codec_ctx);
+  dec->flushed = 0;
+  dec->drained = 0;
+  dec->next_pts = AV_NOPTS_VALUE;
+
+  if (dec->fifo) {
+    av_audio_fifo_reset(dec->fifo);
+    dec->fifo_pts = AV_NOPTS_VALUE;
+    dec->fifo_offset = 0;
+  }
+
+  // Reinitializing the resampler discards the samples it holds.
+  return dec->resampler_ctx ? swr_init(dec->resampler_ctx) : 0;
+}
+
+int decoder_send_packet(Decoder *dec, uint8_t *data, int size, int64_t pts,
+                        int64_t dts) {
+  int ret;
+
+  // This is a "drain" packet, i.e. NULL.
+  if (!data)
+    return avcodec_send_packet(dec->codec_ctx, NULL);
+
+  dec->packet->data = data;
+  dec->packet->size = size;
+  dec->packet->pts = pts;
+  dec->packet->dts = dts;
+
+  ret = avcodec_send_packet(dec->codec_ctx, dec->packet);
+  av_packet_unref(dec->packet);
+
+  dec->stats.packets++;
+  dec->stats.bytes_in += size;
+  if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    dec->stats.errors++;
+
+  return ret;
+}
+
+// Takes a buffer of at least size bytes from the decoder's pool, which is
+// replaced by one of larger buffers when needed.
+int get_output_buffer(Decoder *dec, int size, AVBufferRef **buf) {
+  int ret;
+
+  if (size > dec->output_pool.buffer_size &&
+      (ret = output_pool_init(&dec->output_pool, &dec->arena, size)) < 0)
+    return ret;
+
+  return output_pool_get(&dec->output_pool, buf);
+}
+
+// Converts in to the output format, writing the samples in a buffer
+// obtained from the decoder's pool. A NULL input flushes the samples
+// buffered by the resampler. The output may hold no samples at all.
+int resample_frame(Decoder *dec, AVFrame *in, AVFrame *out) {
+  const uint8_t **in_data = NULL;
+  int in_samples = 0;
+  int size, ret;
+
+  if (in) {
+    in_data = (const uint8_t **)in->extended_data;
+    in_samples = in->nb_samples;
+  }
+
+  out->format = dec->output_sample_format;
+  out->sample_rate = dec->output_sample_rate;
+  if ((ret = av_channel_layout_copy(&out->ch_layout, &dec->output_ch_layout)) <
+      0)
+    return ret;
+
+  // An upper bound of the samples produced, resampler delay included.
+  if ((out->nb_samples = swr_get_out_samples(dec->resampler_ctx, in_samples)) <=
+      0)
+    return out->nb_samples;
+
+  size = av_samples_get_buffer_size(NULL, out->ch_layout.nb_channels,
+                                    out->nb_samples, out->format, 1);
+  if ((ret = get_output_buffer(dec, size, &out->buf[0])) < 0)
+    return ret;
+
+  av_samples_fill_arrays(out->data, out->linesize, out->buf[0]->data,
+                         out->ch_layout.nb_channels, out->nb_samples,
+                         out->format, 1);
+  out->extended_data = out->data;
+
+  if ((ret = swr_convert(dec->resampler_ctx, out->extended_data,
+                         out->nb_samples, in_data, in_samples)) < 0)
+    return ret;
+
+  out->nb_samples = ret;
+  return 0;
+}
+
+// Converts the picture in to the output format, writing it in a buffer
+// obtained from the decoder's pool. Lines and planes are not padded, so
+// that the picture can be exported without copying it.
+int scale_picture(Decoder *dec, AVFrame *in, AVFrame *out) {
+  int size, ret;
+
+  out->format = dec->output_pixel_format != AV_PIX_FMT_NONE
+                    ? dec->output_pixel_format
+                    : in->format;
+  out->width = dec->output_width ? dec->output_width : in->width;
+  out->height = dec->output_height ? dec->output_height : in->height;
+
+  // The context is only rebuilt when the input pictures change.
+  if (!(dec->scaler_ctx = sws_getCachedContext(
+            dec->scaler_ctx, in->width, in->height, in->format, out->width,
+            out->height, out->format, SWS_BICUBIC, NULL, NULL, NULL)))
+    return AVERROR(EINVAL);
+
+  if ((size = av_image_get_buffer_size(out->format, out->width, out->height,
+                                       1)) < 0)
+    return size;
+  if ((ret = get_output_buffer(dec, size, &out->buf[0])) < 0)
+    return ret;
+
+  if ((ret = av_image_fill_arrays(out->data, out->linesize, out->buf[0]->data,
+                                  out->format, out->width, out->height, 1)) <
+      0)
+    return ret;
+  out->extended_data = out->data;
+
+  if ((ret = sws_scale(dec->scaler_ctx, (const uint8_t *const *)in->data,
+                       in->linesize, 0, in->height, out->data,
+                       out->linesize)) < 0)
+    return ret;
+
+  return 0;
+}
+
+// Returns the picture in the output format, converting it when it is not.
+int convert_picture(Decoder *dec, AVFrame *in, AVFrame **frame) {
+  AVFrame *out = dec->out_frame;
+  int ret;
+
+  if ((dec->output_pixel_format == AV_PIX_FMT_NONE ||
+       in->format == dec->output_pixel_format) &&
+      (!dec->output_width || in->width == dec->output_width) &&
+      (!dec->output_height || in->height == dec->output_height)) {
+    *frame = in;
+    return 0;
+  }
+
+  ret = scale_picture(dec, in, out);
+  out->pts = in->pts;
+  out->best_effort_timestamp = in->best_effort_timestamp;
+  av_frame_unref(in);
+  if (ret < 0)
+    return ret;
+
+  *frame = out;
+  return 0;
+}
+
+// Returns the duration of nb_samples in the packet time base, or 0 when
+// the time base is not known.
+int64_t samples_duration(Decoder *dec, int64_t nb_samples, int sample_rate) {
+  AVRational time_base = dec->codec_ctx->pkt_timebase;
+
+  if (!time_base.num || !time_base.den || !sample_rate)
+    return 0;
+
+  return av_rescale_q(nb_samples, (AVRational){1, sample_rate}, time_base);
+}
+
+// Returns the samples left in the resampler once the codec is drained.
+int flush_resampler(Decoder *dec, AVFrame **frame) {
+  AVFrame *out = dec->out_frame;
+  int ret;
+
+  dec->flushed = 1;
+
+  if ((ret = resample_frame(dec, NULL, out)) < 0)
+    return ret;
+  if (out->nb_samples == 0)
+    return AVERROR_EOF;
+
+  // The flushed samples are the tail of the last decoded frame.
+  out->pts = dec->next_pts;
+  if (out->pts != AV_NOPTS_VALUE)
+    out->pts -= samples_duration(dec, out->nb_samples, out->sample_rate);
+  out->best_effort_timestamp = out->pts;
+
+  *frame = out;
+  return 0;
+}
+
+int receive_frame(Decoder *dec, AVFrame **frame) {
+  AVFrame *in = dec->frame;
+  AVFrame *out = dec->out_frame;
+  int64_t pts, delay;
+  int ret;
+
+  do {
+    // Reset the frames to reuse them for the next decode round.
+    av_frame_unref(in);
+    av_frame_unref(out);
+
+    ret = avcodec_receive_frame(dec->codec_ctx, in);
+
+    if (ret == AVERROR_EOF && dec->resampler_ctx && !dec->flushed)
+      return flush_resampler(dec, frame);
+    if (ret < 0)
+      return ret;
+
+    pts = in->pts != AV_NOPTS_VALUE ? in->pts : in->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE)
+      dec->next_pts =
+          pts + samples_duration(dec, in->nb_samples, in->sample_rate);
+
+    if (dec->codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+      return convert_picture(dec, in, frame);
+
+    if (!dec->resampler_ctx) {
+      *frame = in;
+      return 0;
+    }
+
+    // The resampler outputs the samples it held back from the previous
+    // frames first.
+    delay = samples_duration(
+        dec, swr_get_delay(dec->resampler_ctx, dec->output_sample_rate),
+        dec->output_sample_rate);
+
+    ret = resample_frame(dec, in, out);
+    out->pts = in->pts != AV_NOPTS_VALUE ? in->pts - delay : AV_NOPTS_VALUE;
+    out->best_effort_timestamp =
+        in->best_effort_timestamp != AV_NOPTS_VALUE
+            ? in->best_effort_timestamp - delay
+            : AV_NOPTS_VALUE;
+    av_frame_unref(in);
+    if (ret < 0)
+      return ret;
+
+    // The resampler may buffer all of the samples of a frame.
+  } while (out->nb_samples == 0);
+
+  *frame = out;
+  return 0;
+}
+
+// Grows the fifo to hold nb_samples more, charging the growth to the arena.
+// The fifo would otherwise double its allocation on its own.
+int fifo_make_room(Decoder *dec, int nb_samples) {
+  int size, space, ret;
+  size_t sample_size;
+
+  size = av_audio_fifo_size(dec->fifo);
+  space = av_audio_fifo_space(dec->fifo);
+  if (space >= nb_samples)
+    return 0;
+
+  sample_size = av_get_bytes_per_sample(dec->output_sample_format) *
+                dec->output_ch_layout.nb_channels;
+  if ((ret = arena_reserve(&dec->arena, (nb_samples - space) * sample_size)))
+    return ret;
+
+  if ((ret = av_audio_fifo_realloc(dec->fifo, size + nb_samples)) < 0) {
+    arena_release(&dec->arena, (nb_samples - space) * sample_size);
+    return ret;
+  }
+
+  return 0;
+}
+
+// Fills the fifo with decoded frames until it holds a chunk, then moves the
+// chunk to dec->chunk_frame. The samples left once the decoder is drained
+// make a last, shorter chunk.
+int receive_chunk(Decoder *dec, AVFrame **frame) {
+  AVFrame *decoded, *out = dec->chunk_frame;
+  int nb_samples, ret;
+
+  while (!dec->drained && av_audio_fifo_size(dec->fifo) < dec->chunk_samples) {
+    if ((ret = receive_frame(dec, &decoded)) == AVERROR_EOF) {
+      dec->drained = 1;
+      break;
+    }
+    if (ret < 0)
+      return ret;
+
+    // Samples are contiguous: timestamps only matter when the fifo starts
+    // over.
+    if (!av_audio_fifo_size(dec->fifo)) {
+      dec->fifo_pts = decoded->pts != AV_NOPTS_VALUE
+                          ? decoded->pts
+                          : decoded->best_effort_timestamp;
+      dec->fifo_offset = 0;
+    }
+
+    if ((ret = fifo_make_room(dec, decoded->nb_samples)) >= 0)
+      ret = av_audio_fifo_write(dec->fifo, (void **)decoded->extended_data,
+                                decoded->nb_samples);
+    av_frame_unref(decoded);
+    if (ret < 0)
+      return ret;
+  }
+
+  if (!(nb_samples = FFMIN(av_audio_fifo_size(dec->fifo), dec->chunk_samples)))
+    return dec->drained ? AVERROR_EOF : AVERROR(EAGAIN);
+
+  av_frame_unref(out);
+  out->format = dec->output_sample_format;
+  out->sample_rate = dec->output_sample_rate;
+  out->nb_samples = nb_samples;
+  if ((ret = av_channel_layout_copy(&out->ch_layout, &dec->output_ch_layout)) <
+      0)
+    return ret;
+
+  if ((ret = output_pool_get(&dec->chunk_pool, &out->buf[0])) < 0)
+    return ret;
+  av_samples_fill_arrays(out->data, out->linesize, out->buf[0]->data,
+                         out->ch_layout.nb_channels, nb_samples, out->format,
+                         1);
+  out->extended_data = out->data;
+
+  if ((ret = av_audio_fifo_read(dec->fifo, (void **)out->extended_data,
+                                nb_samples)) < 0)
+    return ret;
+
+  // Interpolated from the first sample rather than accumulated, which
+  // would drift with the rounding of each chunk.
+  out->pts = dec->fifo_pts;
+  if (out->pts != AV_NOPTS_VALUE)
+    out->pts +=
+        samples_duration(dec, dec->fifo_offset, dec->output_sample_rate);
+  out->best_effort_timestamp = out->pts;
+  dec->fifo_offset += nb_samples;
+
+  *frame = out;
+  return 0;
+}
+
+int decoder_receive_frame(Decoder *dec, AVFrame **frame) {
+  int ret;
+
+  ret = dec->fifo ? receive_chunk(dec, frame) : receive_frame(dec, frame);
+  if (ret == 0)
+    dec->stats.frames++;
+  else if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    dec->stats.errors++;
+
+  return ret;
+}
+
+int decoder_picture_size(const AVFrame *frame) {
+  AVBufferRef *ref = frame->buf[0];
+  uint8_t *data[4];
+  int linesize[4], size;
+
+  if (!ref || frame->format < 0 ||
+      (size = av_image_get_buffer_size(frame->format, frame->width,
+                                       frame->height, 1)) <= 0)
+    return 0;
+
+  // The layout of the planes when packed one after the other.
+  if (av_image_fill_arrays(data, linesize, frame->data[0], frame->format,
+                           frame->width, frame->height, 1) < 0)
+    return 0;
+
+  for (int i = 0; i < 4 && data[i]; i++)
+    if (data[i] != frame->data[i] || linesize[i] != frame->linesize[i])
+      return 0;
+
+  if (frame->data[0] < ref->data ||
+      frame->data[0] + size > ref->data + ref->size)
+    return 0;
+
+  return size;
+}
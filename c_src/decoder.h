@@ -0,0 +1,159 @@
+#ifndef LIBAV_DECODER_H
+#define LIBAV_DECODER_H
+
+#include "arena.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/buffer.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+#include <sys/types.h>
+
+// How a decoder is opened. The defaults set by decoder_config_init keep
+// the format produced by the codec, except that planar samples are always
+// converted to the packed layout.
+typedef struct {
+  // Time base of the packet timestamps, used to compute the timestamps of
+  // the samples flushed out of the resampler.
+  AVRational time_base;
+  // 0 lets libav pick one thread per core, a thread_type of 0 keeps the
+  // libav default.
+  int thread_count;
+  int thread_type;
+  // The output audio format.
+  enum AVSampleFormat sample_format;
+  int sample_rate;
+  int channels;
+  // When either is set, audio is output in chunks of exactly chunk_samples,
+  // or chunk_duration in AV_TIME_BASE units at the output sample rate,
+  // instead of the frames produced by the codec. The last chunk can be
+  // shorter.
+  int chunk_samples;
+  int64_t chunk_duration;
+  // The output video format. Fields left unset, AV_PIX_FMT_NONE or 0, keep
+  // the ones of each picture.
+  enum AVPixelFormat pixel_format;
+  int width;
+  int height;
+  // Caps the memory charged to the arena of the decoder, 0 for no limit.
+  size_t memory_limit;
+} DecoderConfig;
+
+// A pool of output buffers. libav only frees the buffers of a pool once it
+// is uninitialized: each one is charged to the arena of the decoder until
+// then, buffers still referenced by exported frames included.
+typedef struct {
+  AVBufferPool *pool;
+  Arena *arena;
+  int buffer_size;
+  size_t charge;
+} OutputPool;
+
+// Runtime counters of a decoder.
+typedef struct {
+  u_long packets;
+  u_long bytes_in;
+  u_long frames;
+  // Packets or frames the codec failed to decode.
+  u_long errors;
+  // Time spent decoding, in nanoseconds. Maintained by the callers.
+  int64_t decode_time;
+} DecoderStats;
+
+// The decoding core, free of any NIF dependency so that it can be
+// exercised by the native benchmarks as well.
+typedef struct {
+  AVCodecContext *codec_ctx;
+  SwrContext *resampler_ctx;
+  // Converts the pictures that are not in the output format, allocated
+  // with the first of them.
+  struct SwsContext *scaler_ctx;
+
+  // The format of the decoded audio frames.
+  enum AVSampleFormat output_sample_format;
+  int output_sample_rate;
+  AVChannelLayout output_ch_layout;
+
+  // The format of the decoded pictures. Unknown fields, AV_PIX_FMT_NONE or
+  // 0, follow the pictures of the codec.
+  enum AVPixelFormat output_pixel_format;
+  int output_width;
+  int output_height;
+
+  // Set once the samples buffered by the resampler have been flushed.
+  int flushed;
+  // Set once the codec returned its last frame.
+  int drained;
+  // The expected timestamp of the sample following the last decoded one.
+  int64_t next_pts;
+
+  // Reused by every decoding round: steady-state decoding does not
+  // allocate packets or frames.
+  AVPacket *packet;
+  AVFrame *frame;
+  AVFrame *out_frame;
+
+  // Output buffers of the resampler or of the scaler. A buffer goes back to
+  // the pool once every reference to it is gone, exported binaries
+  // included.
+  OutputPool output_pool;
+
+  // Samples waiting to be regrouped in chunks, NULL unless chunking. The
+  // chunks are written in buffers of chunk_pool, exported as they are.
+  AVAudioFifo *fifo;
+  int chunk_samples;
+  OutputPool chunk_pool;
+  AVFrame *chunk_frame;
+  // Timestamp of the sample the fifo started over with, and the samples
+  // read since: chunk timestamps are interpolated from them.
+  int64_t fifo_pts;
+  int64_t fifo_offset;
+
+  // Accounts the samples held by the fifo and the buffers of the output
+  // pools. The callers charge what they allocate for the decoder, the
+  // codec and the frames it decodes are not accounted.
+  Arena arena;
+
+  DecoderStats stats;
+} Decoder;
+
+void decoder_config_init(DecoderConfig *config);
+
+// Opens a decoder for the codec described by params. Options not consumed
+// by the codec are left in options.
+int decoder_open(Decoder *dec, enum AVCodecID codec_id,
+                 const AVCodecParameters *params, const DecoderConfig *config,
+                 AVDictionary **options);
+
+void decoder_close(Decoder *dec);
+
+// Drops every packet and sample buffered by the decoder, which can then
+// be fed again, e.g. with the packets following a seek.
+int decoder_reset(Decoder *dec);
+
+// Sends size bytes to the decoder, or puts it in drain mode when data is
+// NULL. The data is not referenced after the call returns.
+int decoder_send_packet(Decoder *dec, uint8_t *data, int size, int64_t pts,
+                        int64_t dts);
+
+// Receives the next decoded frame, converted to the output format with
+// the resampler or the scaler. Once the decoder is drained, the samples
+// still buffered by the resampler are returned in a last frame before
+// AVERROR_EOF. When chunking, frames are chunks and the samples that do not
+// fill one are held until more come or the decoder is drained, or
+// AVERROR_MEMORY_LIMIT is returned when they do not fit in the arena. The
+// frame belongs to the decoder and is valid until the next call: callers
+// can take over its buffers but must not free it.
+int decoder_receive_frame(Decoder *dec, AVFrame **frame);
+
+// Returns the size of a decoded picture when its planes follow each other
+// in its first buffer without padding, as the pictures of the scaler do,
+// in which case it can be exported as it is. Returns 0 when it has to be
+// copied.
+int decoder_picture_size(const AVFrame *frame);
+
+#endif
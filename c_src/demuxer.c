@@ -0,0 +1,727 @@
+#include "demuxer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+u_long queue_len(Ioq *q) { return enif_ioq_size(q->q); }
+int queue_is_filled(Ioq *q) { return queue_len(q) >= q->size; }
+int queue_freespace(Ioq *q) {
+  return queue_is_filled(q) ? 0 : q->size - queue_len(q);
+}
+
+// Grows the queue to size bytes, provided that the data it still misses
+// fits in the arena.
+int queue_grow(Ioq *q, u_long size) {
+  if (size > queue_len(q) && !arena_fits(q->arena, size - queue_len(q)))
+    return AVERROR_MEMORY_LIMIT;
+
+  q->size = size;
+  q->grows++;
+  return 0;
+}
+
+// Consumes the bytes read so far, releasing the binaries that
+// were fully read.
+void queue_deq(Ioq *q) {
+  enif_ioq_deq(q->q, q->pos, NULL);
+  arena_release(q->arena, q->pos);
+  q->pos = 0;
+}
+
+// Copies up to size bytes found offset bytes after the head of the queue,
+// without consuming them. Returns the amount of bytes copied.
+u_long queue_peek(Ioq *q, u_long offset, void *dst, u_long size) {
+  SysIOVec *iov;
+  int iovlen;
+  u_long copied, chunk;
+
+  iov = enif_ioq_peek(q->q, &iovlen);
+  copied = 0;
+
+  for (int i = 0; i < iovlen && copied < size; i++) {
+    if (offset >= iov[i].iov_len) {
+      offset -= iov[i].iov_len;
+      continue;
+    }
+
+    chunk = iov[i].iov_len - offset;
+    if (chunk > size - copied)
+      chunk = size - copied;
+
+    memcpy(dst + copied, iov[i].iov_base + offset, chunk);
+    copied += chunk;
+    offset = 0;
+  }
+
+  return copied;
+}
+
+int queue_read(Ioq *q, void *dst, int buf_size) {
+  u_long size;
+
+  size = queue_peek(q, q->pos, dst, buf_size);
+  if (size == 0)
+    return AVERROR_EOF;
+
+  q->pos += size;
+  q->bytes_copied += size;
+
+  if (q->mode == QUEUE_MODE_SHIFT)
+    queue_deq(q);
+
+  return size;
+}
+
+int file_source_open(Arena *arena, const char *path, FileSource **file) {
+  struct stat st;
+  void *data;
+  int fd, errnum;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return AVERROR(errno);
+
+  if (fstat(fd, &st) < 0) {
+    errnum = AVERROR(errno);
+    close(fd);
+    return errnum;
+  }
+
+  if (!(*file = (FileSource *)arena_alloc(arena, sizeof(FileSource)))) {
+    close(fd);
+    return AVERROR_MEMORY_LIMIT;
+  }
+  (*file)->fd = fd;
+  (*file)->size = st.st_size;
+
+  // Pages are loaded on access and can be reclaimed by the kernel at any
+  // time, memory is bounded by the page cache. Inputs that cannot be mapped
+  // are read with pread.
+  if (st.st_size > 0 &&
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+          MAP_FAILED) {
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    (*file)->data = data;
+  }
+
+  return 0;
+}
+
+void file_source_close(Arena *arena, FileSource *file) {
+  if (file->data)
+    munmap(file->data, file->size);
+  close(file->fd);
+  arena_free(arena, file);
+}
+
+int read_ioq(void *opaque, uint8_t *buf, int buf_size) {
+  return queue_read((Ioq *)opaque, buf, buf_size);
+}
+
+int read_file(void *opaque, uint8_t *buf, int buf_size) {
+  FileSource *file = (FileSource *)opaque;
+  ssize_t size;
+
+  if (file->pos >= file->size)
+    return AVERROR_EOF;
+  if (buf_size > file->size - file->pos)
+    buf_size = file->size - file->pos;
+
+  if (file->data) {
+    memcpy(buf, file->data + file->pos, buf_size);
+    size = buf_size;
+  } else if ((size = pread(file->fd, buf, buf_size, file->pos)) <= 0) {
+    return size ? AVERROR(errno) : AVERROR_EOF;
+  }
+
+  file->pos += size;
+  file->bytes_read += size;
+  return size;
+}
+
+int64_t seek_file(void *opaque, int64_t offset, int whence) {
+  FileSource *file = (FileSource *)opaque;
+
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return file->size;
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += file->pos;
+    break;
+  case SEEK_END:
+    offset += file->size;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if (offset < 0 || offset > file->size)
+    return AVERROR(EINVAL);
+
+  return file->pos = offset;
+}
+
+uint32_t read_be32(const uint8_t *b) {
+  return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 |
+         (uint32_t)b[3];
+}
+
+// Walks the top level boxes of an ISO BMFF (mp4, mov) input and returns the
+// amount of bytes needed to parse its header, i.e., the end of the moov box,
+// or the end of the next box header if moov was not found yet. Returns 0
+// when it cannot be told.
+u_long isobmff_header_size(Ioq *q) {
+  uint8_t header[16];
+  u_long offset, len;
+  uint64_t size;
+
+  len = queue_len(q);
+  offset = 0;
+
+  while (offset + 8 <= len) {
+    queue_peek(q, offset, header, sizeof(header));
+    size = read_be32(header);
+
+    if (size == 1) {
+      // 64 bit box size.
+      if (offset + 16 > len)
+        return offset + 16;
+      size = (uint64_t)read_be32(header + 8) << 32 | read_be32(header + 12);
+    }
+
+    // The box extends to the end of the input, or is corrupted.
+    if (size < 8)
+      return 0;
+
+    if (!memcmp(header + 4, "moov", 4))
+      return offset + size;
+
+    offset += size;
+  }
+
+  return offset + 8;
+}
+
+// Makes sure the probe buffer can hold size bytes plus the padding
+// required by the probing functions, charging its growth to arena.
+int probe_ensure_buffer(Arena *arena, Probe *probe, int size) {
+  unsigned char *buffer;
+  int errnum;
+
+  size += AVPROBE_PADDING_SIZE;
+  if (probe->buffer_size >= size)
+    return 0;
+
+  if ((errnum = arena_reserve(arena, size - probe->buffer_size)))
+    return errnum;
+
+  if (!(buffer = av_realloc(probe->buffer, size))) {
+    arena_release(arena, size - probe->buffer_size);
+    return AVERROR(ENOMEM);
+  }
+
+  probe->buffer = buffer;
+  probe->buffer_size = size;
+
+  return 0;
+}
+
+// Detects the input format from the bytes queued so far. When the input is
+// over, any positive score is accepted.
+int probe_input_format(DemuxerContext *ctx) {
+  Probe *probe = &ctx->probe;
+  AVProbeData pd = {0};
+  u_long len;
+  int score, errnum;
+
+  len = queue_len(ctx->queue);
+  if (len > MAX_FORMAT_PROBE_SIZE)
+    len = MAX_FORMAT_PROBE_SIZE;
+  if (probe->opts.max_probe_size && len > probe->opts.max_probe_size)
+    len = probe->opts.max_probe_size;
+  if ((errnum = probe_ensure_buffer(&ctx->arena, probe, len)))
+    return errnum;
+
+  queue_peek(ctx->queue, 0, probe->buffer, len);
+  memset(probe->buffer + len, 0, AVPROBE_PADDING_SIZE);
+
+  pd.filename = "";
+  pd.buf = probe->buffer;
+  pd.buf_size = len;
+
+  probe->format = av_probe_input_format3(&pd, 1, &score);
+  probe->score = score;
+
+  if (score < AVPROBE_SCORE_RETRY && ctx->mode != CTX_MODE_DRAIN)
+    probe->format = NULL;
+
+  return 0;
+}
+
+// Applies the probing limits to a newly allocated format context.
+void apply_probe_options(AVFormatContext *fmt_ctx, const ProbeOptions *opts) {
+  if (opts->max_probe_size)
+    fmt_ctx->probesize = opts->max_probe_size;
+  if (opts->max_analyze_duration > 0)
+    fmt_ctx->max_analyze_duration = opts->max_analyze_duration;
+}
+
+// The libav demuxer of ISO BMFF inputs, i.e. "mov,mp4,m4a,3gp,3g2,mj2".
+const AVInputFormat *isobmff_format(void) {
+  return av_find_input_format("mov");
+}
+
+// Opens the format context of the queue. libav cannot resume parsing a
+// header it did not find: on failure the AVIO context is freed, so that
+// the input can be opened again from the start once more data is queued.
+int open_input(DemuxerContext *ctx) {
+  Probe *probe = &ctx->probe;
+  Ioq *queue = ctx->queue;
+  AVFormatContext *fmt_ctx;
+  int buffer_size, errnum;
+
+  if ((errnum = probe_ensure_buffer(&ctx->arena, probe, queue->size)))
+    return errnum;
+  buffer_size = probe->buffer_size;
+
+  // Context that reads from queue and takes over the probe buffer as its
+  // own. It is freed with the demuxer context, libav might replace the
+  // buffer meanwhile.
+  ctx->io_ctx = avio_alloc_context(probe->buffer, probe->buffer_size, 0,
+                                   queue, &read_ioq, NULL, NULL);
+  if (!ctx->io_ctx)
+    return AVERROR(ENOMEM);
+  ctx->io_ctx->seekable = 0;
+  probe->buffer = NULL;
+  probe->buffer_size = 0;
+
+  if (!(fmt_ctx = avformat_alloc_context())) {
+    errnum = AVERROR(ENOMEM);
+    goto fail;
+  }
+  fmt_ctx->pb = ctx->io_ctx;
+  fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  apply_probe_options(fmt_ctx, &probe->opts);
+  fmt_ctx->probesize = queue->size;
+
+  // fmt_ctx is freed on failure.
+  if ((errnum = avformat_open_input(&fmt_ctx, NULL, probe->format, NULL)))
+    goto fail;
+
+  ctx->fmt_ctx = fmt_ctx;
+  return 0;
+
+fail:
+  // The buffer is still charged as the probe one.
+  av_freep(&ctx->io_ctx->buffer);
+  avio_context_free(&ctx->io_ctx);
+  arena_release(&ctx->arena, buffer_size);
+  return errnum;
+}
+
+// Returns 0 once the header is read, AVERROR(EAGAIN) when more data is
+// needed before continuing, another error otherwise. Probing is
+// incremental: the format is detected from the bytes queued so far, then
+// the format context is opened once the header is expected to be queued,
+// i.e., up to the end of the moov box for ISO BMFF inputs and the whole
+// queue otherwise. That same context then reads the stream information as
+// more data comes in. The queue is grown to the amount of data required by
+// the next step, which is known exactly for ISO BMFF inputs and doubled
+// otherwise, up to opts.max_probe_size. A header larger than the queue
+// makes the input be opened again, from the start, once the queue has
+// grown. Errors that more data would not fix are returned by every later
+// call.
+int demuxer_read_header(DemuxerContext *ctx) {
+  Probe *probe = &ctx->probe;
+  Ioq *queue = ctx->queue;
+  u_long max_size = probe->opts.max_probe_size;
+  u_long needed, pos;
+  int eos, errnum;
+
+  if (ctx->header_error)
+    return ctx->header_error;
+
+  eos = ctx->mode == CTX_MODE_DRAIN;
+  pos = queue->pos;
+
+  if (!ctx->fmt_ctx) {
+    if (!probe->format && (errnum = probe_input_format(ctx)))
+      return errnum;
+
+    if (!probe->format && !eos) {
+      errnum = 0;
+      goto grow;
+    }
+
+    // Do not attempt to parse the header before the moov box is there.
+    if (!eos && probe->format == isobmff_format() &&
+        (needed = isobmff_header_size(queue)) > queue_len(queue)) {
+      if (max_size && needed > max_size)
+        return AVERROR_INVALIDDATA;
+      if (needed > queue->size && (errnum = queue_grow(queue, needed)))
+        return errnum;
+      return AVERROR(EAGAIN);
+    }
+
+    probe->attempts++;
+    errnum = open_input(ctx);
+    probe->bytes_probed += queue->pos - pos;
+    if (errnum == AVERROR_MEMORY_LIMIT || errnum == AVERROR(ENOMEM))
+      return ctx->header_error = errnum;
+    if (errnum) {
+      // The next attempt reads the header from the start.
+      queue->pos = pos;
+      goto grow;
+    }
+    pos = queue->pos;
+  } else {
+    probe->attempts++;
+    // The queue ran dry during the previous attempt.
+    ctx->io_ctx->eof_reached = 0;
+  }
+
+  errnum = probe->opts.skip_stream_info
+               ? 0
+               : avformat_find_stream_info(ctx->fmt_ctx, NULL);
+  probe->bytes_probed += queue->pos - pos;
+  if (errnum < 0)
+    goto grow;
+
+  ctx->has_header = 1;
+
+  // From now on, the queue will not grow but rather override data
+  // read by the io_ctx. Dequeue every information read by the
+  queue_deq(ctx->queue);
+  ctx->queue->mode = QUEUE_MODE_SHIFT;
+
+  return 0;
+
+grow:
+  // The header could not be found within the bytes we may read. An unknown
+  // format is probed again with a lower score once the input is over.
+  if (eos || (max_size && queue->size >= max_size))
+    return errnum ? (ctx->header_error = errnum) : AVERROR_INVALIDDATA;
+
+  needed = queue->size * 2;
+  if (max_size && needed > max_size)
+    needed = max_size;
+  if ((errnum = queue_grow(queue, needed)))
+    return errnum;
+  return AVERROR(EAGAIN);
+}
+
+// Initializes the probe state. A forced format is not probed.
+void probe_init(Probe *probe, const ProbeOptions *opts) {
+  probe->opts = *opts;
+  probe->format = opts->format;
+  if (opts->format)
+    probe->score = AVPROBE_SCORE_MAX;
+}
+
+// Allocates a blank context, charged to its own arena. Returns NULL when
+// it does not fit within memory_limit.
+DemuxerContext *context_alloc(size_t memory_limit) {
+  DemuxerContext *ctx;
+  Arena arena;
+
+  arena_init(&arena, memory_limit);
+  if (arena_reserve(&arena, sizeof(DemuxerContext)))
+    return NULL;
+
+  ctx = (DemuxerContext *)enif_alloc(sizeof(DemuxerContext));
+  memset(ctx, 0, sizeof(DemuxerContext));
+  ctx->arena = arena;
+  ctx->packet = av_packet_alloc();
+
+  return ctx;
+}
+
+DemuxerContext *demuxer_context_alloc(u_long probe_size,
+                                      const ProbeOptions *opts,
+                                      size_t memory_limit) {
+  DemuxerContext *ctx;
+  Ioq *queue;
+
+  if (!(ctx = context_alloc(memory_limit)))
+    return NULL;
+
+  if (!(queue = (Ioq *)arena_alloc(&ctx->arena, sizeof(Ioq)))) {
+    demuxer_context_free(ctx);
+    return NULL;
+  }
+  queue->q = enif_ioq_create(ERL_NIF_IOQ_NORMAL);
+  queue->arena = &ctx->arena;
+  queue->mode = QUEUE_MODE_GROW;
+  queue->size = probe_size;
+  if (opts->max_probe_size && queue->size > opts->max_probe_size)
+    queue->size = opts->max_probe_size;
+
+  ctx->queue = queue;
+  ctx->mode = CTX_MODE_BUF;
+  probe_init(&ctx->probe, opts);
+
+  return ctx;
+}
+
+int demuxer_context_open_file(DemuxerContext **ctx, const char *path,
+                              const ProbeOptions *opts, size_t memory_limit) {
+  AVIOContext *io_ctx;
+  AVFormatContext *fmt_ctx;
+  int errnum;
+
+  if (!(*ctx = context_alloc(memory_limit)))
+    return AVERROR_MEMORY_LIMIT;
+
+  // The whole input is available and seekable.
+  (*ctx)->mode = CTX_MODE_DRAIN;
+  probe_init(&(*ctx)->probe, opts);
+
+  if ((errnum = file_source_open(&(*ctx)->arena, path, &(*ctx)->file)) ||
+      (errnum = arena_reserve(&(*ctx)->arena, FILE_IO_BUFFER_SIZE)))
+    return errnum;
+
+  io_ctx = avio_alloc_context(av_malloc(FILE_IO_BUFFER_SIZE),
+                              FILE_IO_BUFFER_SIZE, 0, (*ctx)->file,
+                              &read_file, NULL, &seek_file);
+  io_ctx->seekable = AVIO_SEEKABLE_NORMAL;
+  (*ctx)->io_ctx = io_ctx;
+
+  fmt_ctx = avformat_alloc_context();
+  fmt_ctx->pb = io_ctx;
+  fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  apply_probe_options(fmt_ctx, opts);
+
+  // The path is only used as a hint by the format probe.
+  if ((errnum = avformat_open_input(&fmt_ctx, path, opts->format, NULL)))
+    return errnum;
+  (*ctx)->fmt_ctx = fmt_ctx;
+
+  if (!opts->skip_stream_info &&
+      (errnum = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    return errnum;
+
+  (*ctx)->has_header = 1;
+  (*ctx)->probe.format = fmt_ctx->iformat;
+  (*ctx)->probe.attempts = 1;
+  (*ctx)->probe.bytes_probed = (*ctx)->file->bytes_read;
+
+  return 0;
+}
+
+void demuxer_context_free(DemuxerContext *ctx) {
+  if (ctx->queue) {
+    enif_ioq_destroy(ctx->queue->q);
+    arena_free(&ctx->arena, ctx->queue);
+  }
+  avformat_close_input(&ctx->fmt_ctx);
+  if (ctx->io_ctx)
+    av_freep(&ctx->io_ctx->buffer);
+  avio_context_free(&ctx->io_ctx);
+  if (ctx->file)
+    file_source_close(&ctx->arena, ctx->file);
+  av_free(ctx->probe.buffer);
+  av_packet_free(&ctx->packet);
+  arena_free(&ctx->arena, ctx->index.entries);
+  arena_free(&ctx->arena, ctx->index.last_pts);
+  arena_destroy(&ctx->arena);
+  enif_free(ctx);
+}
+
+// Tells whether a keyframe at ts is far enough from the last indexed one
+// of its stream to be indexed too.
+int keyframe_is_due(int64_t last, int64_t ts, AVRational time_base) {
+  return last == AV_NOPTS_VALUE ||
+         av_compare_ts(ts - last, time_base, KEYFRAME_INDEX_INTERVAL,
+                       (AVRational){1, 1}) >= 0;
+}
+
+// Records the packet if it is a keyframe due for indexing. The index is
+// only a hint for seeking: keyframes that do not fit in the arena are not
+// recorded.
+void index_add(Arena *arena, KeyframeIndex *index, AVPacket *packet,
+               AVStream *stream) {
+  int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  int i = packet->stream_index;
+  int capacity;
+  void *grown;
+
+  if (!(packet->flags & AV_PKT_FLAG_KEY) || packet->pos < 0 ||
+      ts == AV_NOPTS_VALUE)
+    return;
+
+  // Streams can appear after the header has been read.
+  if (i >= index->nb_streams) {
+    if (!(grown = arena_realloc(arena, index->last_pts,
+                                (i + 1) * sizeof(int64_t))))
+      return;
+    index->last_pts = (int64_t *)grown;
+    for (; index->nb_streams <= i; index->nb_streams++)
+      index->last_pts[index->nb_streams] = AV_NOPTS_VALUE;
+  }
+
+  // Keyframes before the last entry were indexed before a backward seek.
+  if (index->last_pts[i] != AV_NOPTS_VALUE && ts <= index->last_pts[i])
+    return;
+  if (!keyframe_is_due(index->last_pts[i], ts, stream->time_base))
+    return;
+
+  if (index->count == index->capacity) {
+    capacity = index->capacity ? index->capacity * 2 : 64;
+    if (!(grown = arena_realloc(arena, index->entries,
+                                capacity * sizeof(Keyframe))))
+      return;
+    index->entries = (Keyframe *)grown;
+    index->capacity = capacity;
+  }
+
+  index->entries[index->count++] = (Keyframe){
+      .pts = ts, .dts = packet->dts, .pos = packet->pos, .stream_index = i};
+  index->last_pts[i] = ts;
+}
+
+// Returns the last indexed keyframe of the stream at or before pts.
+Keyframe *index_lookup(KeyframeIndex *index, int stream_index, int64_t pts) {
+  Keyframe *found = NULL;
+
+  for (int i = 0; i < index->count; i++) {
+    Keyframe *kf = &index->entries[i];
+    if (kf->stream_index != stream_index)
+      continue;
+    if (kf->pts > pts)
+      break;
+    found = kf;
+  }
+
+  return found;
+}
+
+// Doubles the capacity of an array of keyframes allocated from the arena,
+// which is left untouched on failure.
+int grow_keyframes(Arena *arena, Keyframe **kfs, int *capacity) {
+  int size = *capacity ? *capacity * 2 : 64;
+  Keyframe *grown;
+
+  if (!(grown = (Keyframe *)arena_realloc(arena, *kfs,
+                                          size * sizeof(Keyframe))))
+    return AVERROR_MEMORY_LIMIT;
+
+  *kfs = grown;
+  *capacity = size;
+  return 0;
+}
+
+int demuxer_collect_keyframes(DemuxerContext *ctx, int stream_index,
+                              Keyframe **kfs) {
+  AVStream *stream;
+  const AVIndexEntry *entry;
+  int64_t last = AV_NOPTS_VALUE;
+  int count = 0, capacity = 0, errnum;
+
+  if (!ctx->has_header || stream_index < 0 ||
+      stream_index >= (int)ctx->fmt_ctx->nb_streams)
+    return AVERROR(EINVAL);
+
+  *kfs = NULL;
+  stream = ctx->fmt_ctx->streams[stream_index];
+
+  if (avformat_index_get_entries_count(stream) > 0) {
+    for (int i = 0; (entry = avformat_index_get_entry(stream, i)); i++) {
+      if (!(entry->flags & AVINDEX_KEYFRAME) ||
+          !keyframe_is_due(last, entry->timestamp, stream->time_base))
+        continue;
+
+      if (count == capacity &&
+          (errnum = grow_keyframes(&ctx->arena, kfs, &capacity)))
+        goto fail;
+
+      // The container only tells when decoding can start.
+      (*kfs)[count++] = (Keyframe){.pts = entry->timestamp,
+                                   .dts = entry->timestamp,
+                                   .pos = entry->pos,
+                                   .stream_index = stream_index};
+      last = entry->timestamp;
+    }
+
+    return count;
+  }
+
+  for (int i = 0; i < ctx->index.count; i++) {
+    if (ctx->index.entries[i].stream_index != stream_index)
+      continue;
+
+    if (count == capacity &&
+        (errnum = grow_keyframes(&ctx->arena, kfs, &capacity)))
+      goto fail;
+    (*kfs)[count++] = ctx->index.entries[i];
+  }
+
+  return count;
+
+fail:
+  arena_free(&ctx->arena, *kfs);
+  *kfs = NULL;
+  return errnum;
+}
+
+int demuxer_seek_keyframe(DemuxerContext *ctx, int stream_index,
+                          int64_t pts) {
+  Keyframe *kf;
+  int errnum;
+
+  // Data coming from the queue is gone once read.
+  if (!ctx->file)
+    return AVERROR(ESPIPE);
+  if (stream_index < 0 || stream_index >= (int)ctx->fmt_ctx->nb_streams)
+    return AVERROR(EINVAL);
+
+  av_packet_unref(ctx->packet);
+
+  // libav relies on the container index, or on the one it builds itself
+  // for the formats that have none.
+  if ((errnum = av_seek_frame(ctx->fmt_ctx, stream_index, pts,
+                              AVSEEK_FLAG_BACKWARD)) >= 0)
+    return 0;
+
+  // Formats that cannot seek by timestamp can still resume reading at the
+  // position of a keyframe seen before.
+  if (!(kf = index_lookup(&ctx->index, stream_index, pts)))
+    return errnum;
+
+  return av_seek_frame(ctx->fmt_ctx, stream_index, kf->pos, AVSEEK_FLAG_BYTE);
+}
+
+// Reads the next packet in ctx->packet. Returns 0 on success, the amount
+// of bytes to be added to the queue before reading can continue, or a
+// negative libav error.
+int demuxer_next_packet(DemuxerContext *ctx) {
+  int errnum, freespace;
+
+  for (;;) {
+    if (ctx->queue && ctx->mode == CTX_MODE_BUF &&
+        (freespace = queue_freespace(ctx->queue)) > 0)
+      return freespace;
+
+    if ((errnum = av_read_frame(ctx->fmt_ctx, ctx->packet)) < 0)
+      return errnum;
+
+    // Not every demuxer honours AVStream.discard.
+    if (ctx->fmt_ctx->streams[ctx->packet->stream_index]->discard <
+        AVDISCARD_ALL) {
+      ctx->stats.packets++;
+      ctx->stats.packet_bytes += ctx->packet->size;
+      index_add(&ctx->arena, &ctx->index, ctx->packet,
+                ctx->fmt_ctx->streams[ctx->packet->stream_index]);
+      return 0;
+    }
+
+    av_packet_unref(ctx->packet);
+  }
+}
@@ -0,0 +1,232 @@
+#ifndef LIBAV_DEMUXER_H
+#define LIBAV_DEMUXER_H
+
+// The demuxing core. It only depends on the ErlNifIOQueue API of erl_nif,
+// which the native benchmarks replace with a shim.
+#include "arena.h"
+#include <erl_nif.h>
+#include <libavcodec/packet.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bytes inspected at most to detect the input format, as libav does.
+#define MAX_FORMAT_PROBE_SIZE (1 << 20)
+// Size of the AVIO buffer used when demuxing files.
+#define FILE_IO_BUFFER_SIZE (1 << 15)
+// Minimum distance in seconds between two indexed keyframes of a stream.
+#define KEYFRAME_INDEX_INTERVAL 1
+
+typedef enum { QUEUE_MODE_SHIFT, QUEUE_MODE_GROW } QUEUE_MODE;
+
+// Input queue of the demuxer. It does not copy the binaries coming from
+// membrane but keeps a reference to them in an ErlNifIOQueue, so that each
+// input byte is copied only once, by read_ioq, straight into the AVIO
+// buffer.
+typedef struct {
+  ErlNifIOQueue *q;
+  // The arena of the context, charged with the bytes referenced by the
+  // queue until they are dequeued.
+  Arena *arena;
+  // The amount of bytes the queue is willing to hold. Enqueued binaries
+  // are never split, hence it might be exceeded.
+  u_long size;
+
+  // Bytes read from the head of the queue. Reads only consume the queue
+  // in QUEUE_MODE_SHIFT, while in QUEUE_MODE_GROW they are kept
+  // until queue_deq is called.
+  u_long pos;
+
+  // Used to differentiate wether the queue is removing
+  // the bytes each time they're read or it is growing to
+  // accomodate more. The latter is used when probing the
+  // input to find the header.
+  QUEUE_MODE mode;
+
+  // Metrics.
+  u_long high_water;
+  u_long grows;
+  // Bytes copied out of the queue, into the AVIO buffer.
+  u_long bytes_copied;
+} Ioq;
+
+typedef enum { CTX_MODE_DRAIN, CTX_MODE_BUF } CTX_MODE;
+
+// Settings of the header probing. Zero values keep the defaults.
+typedef struct {
+  // The format of the input, which is then not probed.
+  const AVInputFormat *format;
+  // Bytes read at most to find the header. The queue does not grow
+  // beyond it.
+  u_long max_probe_size;
+  // Duration of the input analyzed at most to find the stream parameters,
+  // in AV_TIME_BASE units.
+  int64_t max_analyze_duration;
+  // Skips avformat_find_stream_info: streams are described by the header
+  // alone, which is faster but might leave some parameters unset.
+  int skip_stream_info;
+} ProbeOptions;
+
+// State of the header probing, kept across attempts.
+typedef struct {
+  ProbeOptions opts;
+
+  // Detected once, or forced by opts, then passed to avformat_open_input
+  // so that libav does not probe the input again.
+  const AVInputFormat *format;
+  int score;
+
+  // Scratch space used to detect the format, which grows with the queue
+  // until it becomes the AVIO buffer of the format context. Its size is
+  // charged to the arena of the context.
+  unsigned char *buffer;
+  int buffer_size;
+
+  // Metrics.
+  int attempts;
+  u_long bytes_probed;
+} Probe;
+
+// A local file, mapped in memory when possible and read with pread
+// otherwise. Unlike the Ioq, it lets libav seek anywhere in the input,
+// e.g. to a moov box stored at the end of the file.
+typedef struct {
+  int fd;
+  uint8_t *data;
+  int64_t size;
+  int64_t pos;
+  // Bytes read so far, seeks excluded.
+  int64_t bytes_read;
+} FileSource;
+
+// Runtime counters of a demuxer context.
+typedef struct {
+  u_long bytes_in;
+  u_long packets;
+  u_long packet_bytes;
+  // Time spent in the NIFs, in nanoseconds.
+  int64_t nif_time;
+  // Monotonic time of the first input byte, 0 until then.
+  int64_t first_data_at;
+  // Time elapsed from the first input byte to the header being read, and
+  // the NIF time spent until then, in nanoseconds. 0 until the header is
+  // read.
+  int64_t time_to_header;
+  int64_t header_nif_time;
+} DemuxerStats;
+
+// A keyframe seen while demuxing. Timestamps are in the time base of the
+// stream, pos is the byte offset of the packet in the input.
+typedef struct {
+  int64_t pts;
+  int64_t dts;
+  int64_t pos;
+  int stream_index;
+} Keyframe;
+
+// Keyframes recorded while demuxing, in input order. At most one entry per
+// KEYFRAME_INDEX_INTERVAL is kept for each stream, which keeps the index
+// compact for codecs where every packet is a keyframe.
+typedef struct {
+  Keyframe *entries;
+  int count;
+  int capacity;
+  // Timestamp of the last entry of each stream, AV_NOPTS_VALUE if none.
+  int64_t *last_pts;
+  int nb_streams;
+} KeyframeIndex;
+
+// Packets parsed ahead on a native thread, owned by the NIFs.
+struct ReadAhead;
+
+typedef struct {
+  // Accounts the memory of the context. The context, its queue, file,
+  // index and AVIO buffer are charged to it, the allocations made by libav
+  // within avformat are not.
+  Arena arena;
+
+  // Used to write binary data coming from membrane and as source for the
+  // AVFormatContext. NULL when demuxing a file.
+  Ioq *queue;
+  // The input of file contexts, NULL otherwise.
+  FileSource *file;
+  // The context responsible for reading data from the queue. It is
+  // configured to use the read_packet function as source.
+  AVIOContext *io_ctx;
+  // The actual libAV demuxer.
+  AVFormatContext *fmt_ctx;
+
+  // Reused by every read.
+  AVPacket *packet;
+
+  CTX_MODE mode;
+
+  int has_header;
+  // An error reading the header which more data would not fix, returned
+  // by every later attempt.
+  int header_error;
+  Probe probe;
+  DemuxerStats stats;
+  KeyframeIndex index;
+
+  // When set, packet payloads are exported as binaries pointing directly
+  // into the libav buffers instead of being copied.
+  int zero_copy;
+
+  // An error met by a batch read which returned the packets read before
+  // it, reported by the next read.
+  int read_error;
+
+  // Set once packets are read ahead on a native thread. The context is then
+  // shared with that thread and every access goes through its lock.
+  struct ReadAhead *read_ahead;
+} DemuxerContext;
+
+u_long queue_len(Ioq *q);
+int queue_is_filled(Ioq *q);
+int queue_freespace(Ioq *q);
+void queue_deq(Ioq *q);
+
+// Allocates a context reading from a queue which initially holds up to
+// probe_size bytes, or opts->max_probe_size if lower. The memory of the
+// context is capped to memory_limit bytes unless it is 0. Returns NULL when
+// the context itself does not fit.
+DemuxerContext *demuxer_context_alloc(u_long probe_size,
+                                      const ProbeOptions *opts,
+                                      size_t memory_limit);
+
+// Allocates a context reading from the file at path, whose header is read
+// right away. *ctx is NULL when the context does not fit within
+// memory_limit, otherwise it is set even on failure and must be freed.
+int demuxer_context_open_file(DemuxerContext **ctx, const char *path,
+                              const ProbeOptions *opts, size_t memory_limit);
+
+void demuxer_context_free(DemuxerContext *ctx);
+
+// Attempts to read the header with the data available in the queue.
+// Returns 0 once the header is read, AVERROR(EAGAIN) when more data is
+// needed, or a negative libav error, e.g. when the header was not found
+// within opts.max_probe_size bytes or AVERROR_MEMORY_LIMIT when it does
+// not fit within the memory limit of the context.
+int demuxer_read_header(DemuxerContext *ctx);
+
+// Reads the next packet in ctx->packet. Returns 0 on success, the amount
+// of bytes to be added to the queue before reading can continue, or a
+// negative libav error.
+int demuxer_next_packet(DemuxerContext *ctx);
+
+// Collects the keyframes of the stream in an array allocated from the
+// arena of the context, which the caller frees with arena_free. They are
+// taken from the container index when it has one and from the keyframes
+// seen so far otherwise, at most one per KEYFRAME_INDEX_INTERVAL. Returns
+// their number or a negative libav error.
+int demuxer_collect_keyframes(DemuxerContext *ctx, int stream_index,
+                              Keyframe **kfs);
+
+// Moves the file input to the last keyframe of the stream at or before pts,
+// expressed in the stream time base. Returns 0 on success, AVERROR(ESPIPE)
+// for non file contexts or a negative libav error.
+int demuxer_seek_keyframe(DemuxerContext *ctx, int stream_index, int64_t pts);
+
+#endif
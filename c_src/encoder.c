@@ -0,0 +1,359 @@
+#include "encoder.h"
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mathematics.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Prefers the input sample format when the codec supports it.
+static enum AVSampleFormat pick_sample_format(const AVCodec *codec,
+                                              enum AVSampleFormat input) {
+  const enum AVSampleFormat *fmt;
+
+  if (!codec->sample_fmts)
+    return input;
+
+  for (fmt = codec->sample_fmts; *fmt != AV_SAMPLE_FMT_NONE; fmt++)
+    if (*fmt == input)
+      return input;
+
+  return codec->sample_fmts[0];
+}
+
+// Picks the supported sample rate closest to the input one.
+static int pick_sample_rate(const AVCodec *codec, int input) {
+  const int *rate;
+  int best;
+
+  if (!codec->supported_samplerates)
+    return input;
+
+  best = codec->supported_samplerates[0];
+  for (rate = codec->supported_samplerates; *rate; rate++)
+    if (abs(*rate - input) < abs(best - input))
+      best = *rate;
+
+  return best;
+}
+
+static int open_audio(Encoder *enc, const EncoderConfig *config) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+  AVChannelLayout input_layout;
+  int ret;
+
+  if (config->sample_format == AV_SAMPLE_FMT_NONE ||
+      av_sample_fmt_is_planar(config->sample_format) ||
+      config->sample_rate <= 0 || config->channels <= 0)
+    return AVERROR(EINVAL);
+
+  codec_ctx->sample_fmt =
+      pick_sample_format(codec_ctx->codec, config->sample_format);
+  codec_ctx->sample_rate =
+      pick_sample_rate(codec_ctx->codec, config->sample_rate);
+  codec_ctx->time_base = (AVRational){1, codec_ctx->sample_rate};
+  av_channel_layout_default(&codec_ctx->ch_layout, config->channels);
+
+  enc->input_sample_size =
+      av_get_bytes_per_sample(config->sample_format) * config->channels;
+
+  if (codec_ctx->sample_fmt == config->sample_format &&
+      codec_ctx->sample_rate == config->sample_rate)
+    return 0;
+
+  av_channel_layout_default(&input_layout, config->channels);
+  if ((ret = swr_alloc_set_opts2(&enc->resampler_ctx, &codec_ctx->ch_layout,
+                                 codec_ctx->sample_fmt,
+                                 codec_ctx->sample_rate, &input_layout,
+                                 config->sample_format, config->sample_rate,
+                                 0, NULL)) < 0)
+    return ret;
+
+  return swr_init(enc->resampler_ctx);
+}
+
+static int open_video(Encoder *enc, const EncoderConfig *config) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+
+  // Encoders cannot represent timestamps in an arbitrary time base, the
+  // one of the codec follows the frame rate.
+  if (config->pixel_format == AV_PIX_FMT_NONE || config->width <= 0 ||
+      config->height <= 0 || config->framerate.num <= 0 ||
+      config->framerate.den <= 0)
+    return AVERROR(EINVAL);
+
+  codec_ctx->pix_fmt = config->pixel_format;
+  codec_ctx->width = config->width;
+  codec_ctx->height = config->height;
+  codec_ctx->framerate = config->framerate;
+  codec_ctx->time_base = av_inv_q(config->framerate);
+
+  return 0;
+}
+
+void encoder_config_init(EncoderConfig *config) {
+  memset(config, 0, sizeof(EncoderConfig));
+  config->time_base = (AVRational){0, 1};
+  config->sample_format = AV_SAMPLE_FMT_NONE;
+  config->pixel_format = AV_PIX_FMT_NONE;
+}
+
+int encoder_open(Encoder *enc, const char *codec_name,
+                 const EncoderConfig *config, AVDictionary **options) {
+  const AVCodec *codec;
+  AVCodecContext *codec_ctx;
+  int ret;
+
+  memset(enc, 0, sizeof(Encoder));
+  enc->next_pts = 0;
+  enc->input_time_base = config->time_base;
+
+  if (!(codec = avcodec_find_encoder_by_name(codec_name)))
+    return AVERROR_ENCODER_NOT_FOUND;
+
+  if (!(enc->codec_ctx = codec_ctx = avcodec_alloc_context3(codec)))
+    return AVERROR(ENOMEM);
+
+  codec_ctx->thread_count = config->thread_count;
+  if (config->thread_type)
+    codec_ctx->thread_type = config->thread_type;
+  if (config->bit_rate)
+    codec_ctx->bit_rate = config->bit_rate;
+  if (config->global_header)
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  // Some native encoders, e.g. opus, are still flagged experimental.
+  codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+  switch (codec->type) {
+  case AVMEDIA_TYPE_AUDIO:
+    ret = open_audio(enc, config);
+    break;
+  case AVMEDIA_TYPE_VIDEO:
+    ret = open_video(enc, config);
+    break;
+  default:
+    ret = AVERROR(EINVAL);
+  }
+  if (ret < 0)
+    goto fail;
+
+  if ((ret = avcodec_open2(codec_ctx, codec, options)) < 0)
+    goto fail;
+
+  if (codec->type == AVMEDIA_TYPE_AUDIO &&
+      !(enc->fifo = av_audio_fifo_alloc(
+            codec_ctx->sample_fmt, codec_ctx->ch_layout.nb_channels,
+            codec_ctx->frame_size ? codec_ctx->frame_size : 1024))) {
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  enc->packet = av_packet_alloc();
+  enc->frame = av_frame_alloc();
+  enc->convert_frame = av_frame_alloc();
+  if (!enc->packet || !enc->frame || !enc->convert_frame) {
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  encoder_close(enc);
+  return ret;
+}
+
+void encoder_close(Encoder *enc) {
+  avcodec_free_context(&enc->codec_ctx);
+  if (enc->resampler_ctx)
+    swr_free(&enc->resampler_ctx);
+  if (enc->fifo)
+    av_audio_fifo_free(enc->fifo);
+  enc->fifo = NULL;
+
+  av_packet_free(&enc->packet);
+  av_frame_free(&enc->frame);
+  av_frame_free(&enc->convert_frame);
+}
+
+// Converts the input samples to the codec format and queues them. A NULL
+// input flushes the samples buffered by the resampler.
+static int write_samples(Encoder *enc, const uint8_t *data, int nb_samples) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+  AVFrame *out = enc->convert_frame;
+  const uint8_t *in[1] = {data};
+  int out_samples, ret;
+
+  if (!enc->resampler_ctx) {
+    if (!data)
+      return 0;
+    ret = av_audio_fifo_write(enc->fifo, (void **)in, nb_samples);
+    return ret < 0 ? ret : 0;
+  }
+
+  if ((out_samples = swr_get_out_samples(enc->resampler_ctx, nb_samples)) <=
+      0)
+    return out_samples;
+
+  // The conversion buffer only grows.
+  if (out_samples > out->nb_samples) {
+    av_frame_unref(out);
+    out->format = codec_ctx->sample_fmt;
+    out->nb_samples = out_samples;
+    if ((ret = av_channel_layout_copy(&out->ch_layout,
+                                      &codec_ctx->ch_layout)) < 0 ||
+        (ret = av_frame_get_buffer(out, 0)) < 0)
+      return ret;
+  }
+
+  if ((ret = swr_convert(enc->resampler_ctx, out->extended_data, out_samples,
+                         data ? in : NULL, data ? nb_samples : 0)) < 0)
+    return ret;
+
+  ret = av_audio_fifo_write(enc->fifo, (void **)out->extended_data, ret);
+  return ret < 0 ? ret : 0;
+}
+
+// Points enc->frame at the picture. The frame holds no reference on the
+// data, which avcodec_send_frame copies then.
+static int fill_picture(Encoder *enc, const uint8_t *data, int size,
+                        int64_t pts) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+  AVFrame *frame = enc->frame;
+  int ret;
+
+  if (enc->frame_pending)
+    return AVERROR(EAGAIN);
+
+  if (size < av_image_get_buffer_size(codec_ctx->pix_fmt, codec_ctx->width,
+                                      codec_ctx->height, 1))
+    return AVERROR(EINVAL);
+
+  frame->format = codec_ctx->pix_fmt;
+  frame->width = codec_ctx->width;
+  frame->height = codec_ctx->height;
+  if ((ret = av_image_fill_arrays(frame->data, frame->linesize, data,
+                                  codec_ctx->pix_fmt, codec_ctx->width,
+                                  codec_ctx->height, 1)) < 0)
+    return ret;
+
+  frame->pts = pts;
+  enc->frame_pending = 1;
+  return 0;
+}
+
+int encoder_send_frame(Encoder *enc, const uint8_t *data, int size,
+                       int64_t pts) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+
+  if (!data) {
+    enc->draining = 1;
+    return codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO
+               ? write_samples(enc, NULL, 0)
+               : 0;
+  }
+
+  enc->stats.frames++;
+  enc->stats.bytes_in += size;
+
+  if (pts != AV_NOPTS_VALUE && enc->input_time_base.num)
+    pts = av_rescale_q(pts, enc->input_time_base, codec_ctx->time_base);
+
+  if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+    return fill_picture(enc, data, size, pts);
+
+  // Samples are contiguous: timestamps only matter when the queue starts
+  // over.
+  if (pts != AV_NOPTS_VALUE && !av_audio_fifo_size(enc->fifo))
+    enc->next_pts = pts;
+
+  return write_samples(enc, data, size / enc->input_sample_size);
+}
+
+// Moves the next frame worth of queued samples to enc->frame. The last
+// frame can be shorter, or padded with silence for the codecs that do not
+// accept it.
+static int fill_audio_frame(Encoder *enc) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+  AVFrame *frame = enc->frame;
+  int available, frame_size, nb_samples, ret;
+
+  available = av_audio_fifo_size(enc->fifo);
+  frame_size = codec_ctx->frame_size && !(codec_ctx->codec->capabilities &
+                                          AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+                   ? codec_ctx->frame_size
+                   : available;
+
+  if (enc->frame_pending || !available ||
+      (available < frame_size && !enc->draining))
+    return 0;
+
+  nb_samples = FFMIN(available, frame_size);
+
+  frame->format = codec_ctx->sample_fmt;
+  frame->sample_rate = codec_ctx->sample_rate;
+  frame->nb_samples =
+      codec_ctx->codec->capabilities & AV_CODEC_CAP_SMALL_LAST_FRAME
+          ? nb_samples
+          : frame_size;
+  if ((ret = av_channel_layout_copy(&frame->ch_layout,
+                                    &codec_ctx->ch_layout)) < 0 ||
+      (ret = av_frame_get_buffer(frame, 0)) < 0)
+    return ret;
+
+  if (nb_samples < frame->nb_samples)
+    av_samples_set_silence(frame->extended_data, nb_samples,
+                           frame->nb_samples - nb_samples,
+                           codec_ctx->ch_layout.nb_channels,
+                           codec_ctx->sample_fmt);
+
+  if ((ret = av_audio_fifo_read(enc->fifo, (void **)frame->extended_data,
+                                nb_samples)) < 0)
+    return ret;
+
+  frame->pts = enc->next_pts;
+  enc->next_pts += nb_samples;
+  enc->frame_pending = 1;
+
+  return 0;
+}
+
+int encoder_receive_packet(Encoder *enc, AVPacket **packet) {
+  AVCodecContext *codec_ctx = enc->codec_ctx;
+  int ret;
+
+  av_packet_unref(enc->packet);
+
+  for (;;) {
+    if ((ret = avcodec_receive_packet(codec_ctx, enc->packet)) == 0) {
+      enc->stats.packets++;
+      enc->stats.bytes_out += enc->packet->size;
+      *packet = enc->packet;
+      return 0;
+    }
+
+    if (ret != AVERROR(EAGAIN))
+      return ret;
+
+    // The codec wants more input.
+    if (codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (ret = fill_audio_frame(enc)) < 0)
+      return ret;
+
+    if (enc->frame_pending) {
+      ret = avcodec_send_frame(codec_ctx, enc->frame);
+      av_frame_unref(enc->frame);
+      enc->frame_pending = 0;
+
+      if (ret < 0) {
+        enc->stats.errors++;
+        return ret;
+      }
+    } else if (enc->draining && !enc->drain_sent) {
+      enc->drain_sent = 1;
+      avcodec_send_frame(codec_ctx, NULL);
+    } else {
+      return AVERROR(EAGAIN);
+    }
+  }
+}
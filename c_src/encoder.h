@@ -0,0 +1,100 @@
+#ifndef LIBAV_ENCODER_H
+#define LIBAV_ENCODER_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+#include <sys/types.h>
+
+// How an encoder is opened. Raw input is described by the sample_* fields
+// for audio and by the video ones otherwise.
+typedef struct {
+  // Time base of the input timestamps.
+  AVRational time_base;
+  // 0 lets libav pick one thread per core, a thread_type of 0 keeps the
+  // libav default.
+  int thread_count;
+  int thread_type;
+  // 0 keeps the default bitrate of the codec.
+  int64_t bit_rate;
+  // Places the codec headers in the extradata rather than in every
+  // keyframe, as required by containers such as mp4.
+  int global_header;
+
+  // The input audio format, packed samples only.
+  enum AVSampleFormat sample_format;
+  int sample_rate;
+  int channels;
+
+  // The input video format. The encoder must support the pixel format.
+  enum AVPixelFormat pixel_format;
+  int width;
+  int height;
+  AVRational framerate;
+} EncoderConfig;
+
+// Runtime counters of an encoder.
+typedef struct {
+  u_long frames;
+  u_long bytes_in;
+  u_long packets;
+  u_long bytes_out;
+  // Frames the codec refused.
+  u_long errors;
+  // Time spent encoding, in nanoseconds. Maintained by the callers.
+  int64_t encode_time;
+} EncoderStats;
+
+typedef struct {
+  AVCodecContext *codec_ctx;
+  AVRational input_time_base;
+
+  // Audio only. Converts the input samples to the format of the codec.
+  SwrContext *resampler_ctx;
+  // Audio only. Holds the samples until they fill a frame of the size
+  // expected by the codec.
+  AVAudioFifo *fifo;
+  // Size in bytes of an input sample, all channels included.
+  int input_sample_size;
+  // Timestamp of the first sample in the fifo, in the codec time base.
+  int64_t next_pts;
+
+  // The frame to be sent to the codec, when frame_pending is set.
+  AVFrame *frame;
+  int frame_pending;
+  // Converted samples, before they are written in the fifo.
+  AVFrame *convert_frame;
+  AVPacket *packet;
+
+  // Set once encoder_send_frame has been called without data.
+  int draining;
+  int drain_sent;
+
+  EncoderStats stats;
+} Encoder;
+
+void encoder_config_init(EncoderConfig *config);
+
+// Opens the encoder named codec_name, e.g. "aac" or "mpeg4". Options not
+// consumed by the codec are left in options.
+int encoder_open(Encoder *enc, const char *codec_name,
+                 const EncoderConfig *config, AVDictionary **options);
+
+void encoder_close(Encoder *enc);
+
+// Sends size bytes of raw input, i.e. packed audio samples or a whole
+// picture, or puts the encoder in drain mode when data is NULL. Video data
+// is referenced until encoder_receive_packet returns AVERROR(EAGAIN).
+int encoder_send_frame(Encoder *enc, const uint8_t *data, int size,
+                       int64_t pts);
+
+// Receives the next encoded packet, with timestamps in the codec time
+// base. Returns AVERROR(EAGAIN) when more input is needed and AVERROR_EOF
+// once drained. The packet belongs to the encoder and is valid until the
+// next call: callers can take over its buffer but must not free it.
+int encoder_receive_packet(Encoder *enc, AVPacket **packet);
+
+#endif
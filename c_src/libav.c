@@ -1,3 +1,7 @@
+#include "decoder.h"
+#include "demuxer.h"
+#include "encoder.h"
+#include "muxer.h"
 #include "erl_drv_nif.h"
 #include "libavcodec/codec.h"
 #include "libavcodec/codec_id.h"
@@ -12,6 +16,7 @@
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/error.h>
+#include <libavutil/imgutils.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -26,106 +31,206 @@
 ErlNifResourceType *DEMUXER_CTX_RES_TYPE;
 ErlNifResourceType *CODEC_PARAMS_RES_TYPE;
 ErlNifResourceType *DECODER_CTX_RES_TYPE;
+ErlNifResourceType *ENCODER_CTX_RES_TYPE;
+ErlNifResourceType *MUXER_CTX_RES_TYPE;
+ErlNifResourceType *WORKER_POOL_RES_TYPE;
+ErlNifResourceType *DECODER_POOL_RES_TYPE;
+ErlNifResourceType *MULTI_DECODER_RES_TYPE;
+ErlNifResourceType *BUFFER_REF_RES_TYPE;
+
+// Appends a reference to the binary term to the queue, storing its size
+// in size. The referenced bytes are charged to the arena of the queue
+// until they are dequeued. Returns 0, AVERROR(EINVAL) when the term is not
+// a binary or AVERROR_MEMORY_LIMIT.
+int queue_enq(Ioq *q, ErlNifEnv *env, ERL_NIF_TERM binary, u_long *size) {
+  ErlNifIOVec vec, *iovec = &vec;
+  ERL_NIF_TERM tail;
+  int errnum;
 
-typedef enum { QUEUE_MODE_SHIFT, QUEUE_MODE_GROW } QUEUE_MODE;
+  if (!enif_inspect_iovec(env, 1, enif_make_list1(env, binary), &tail,
+                          &iovec))
+    return AVERROR(EINVAL);
 
-typedef struct {
-  void *ptr;
-  // The total size of ptr
-  u_long size;
-  // Where the next bytes should be written at.
-  u_long buf_end;
+  if ((errnum = arena_reserve(q->arena, iovec->size)))
+    return errnum;
+
+  if (!enif_ioq_enqv(q->q, iovec, 0)) {
+    arena_release(q->arena, iovec->size);
+    return AVERROR(EINVAL);
+  }
 
-  // position of the last read.
-  u_long pos;
+  if (queue_len(q) > q->high_water)
+    q->high_water = queue_len(q);
 
-  // Used to differentiate wether the queue is removing
-  // the bytes each time they're read or it is growing to
-  // accomodate more. The latter is used when probing the
-  // input to find the header.
-  QUEUE_MODE mode;
-} Ioq;
+  *size = iovec->size;
+  return 0;
+}
 
-int queue_is_filled(Ioq *q) { return q->buf_end == q->size; }
-int queue_freespace(Ioq *q) { return q->size - q->buf_end; }
+void read_ahead_stop(Arena *arena, struct ReadAhead *ra);
 
-void queue_grow(Ioq *q, int factor) {
-  u_long new_size;
+void free_demuxer_context_res(ErlNifEnv *env, void *res) {
+  DemuxerContext *ctx = *(DemuxerContext **)res;
 
-  new_size = q->size * factor;
-  q->ptr = realloc(q->ptr, new_size);
-  q->size = new_size;
+  // The thread must be gone before the context it reads from.
+  if (ctx->read_ahead)
+    read_ahead_stop(&ctx->arena, ctx->read_ahead);
+  demuxer_context_free(ctx);
 }
 
-void queue_copy(Ioq *q, void *src, int size) {
-  // Do we have enough space for the data? If not, reallocate some space.
-  if (queue_freespace(q) < size)
-    queue_grow(q, 2);
+void free_codec_params_res(ErlNifEnv *env, void *res) {
+  AVCodecParameters **params = (AVCodecParameters **)res;
+  avcodec_parameters_free(params);
+}
 
-  memcpy(q->ptr + q->buf_end, src, size);
-  q->buf_end += size;
+void free_buffer_ref_res(ErlNifEnv *env, void *res) {
+  av_buffer_unref((AVBufferRef **)res);
 }
 
-void queue_deq(Ioq *q) {
-  int unread;
+// Returns a binary of size bytes starting at data, which must be owned by
+// ref. The binary takes ownership of the reference, which is released once
+// the binary is garbage collected.
+ERL_NIF_TERM make_buffer_ref_binary(ErlNifEnv *env, AVBufferRef **ref,
+                                    const uint8_t *data, size_t size) {
+  ERL_NIF_TERM term;
+  AVBufferRef **ref_res =
+      enif_alloc_resource(BUFFER_REF_RES_TYPE, sizeof(AVBufferRef *));
+  *ref_res = *ref;
+  *ref = NULL;
 
-  unread = q->buf_end - q->pos;
-  if (unread == 0) {
-    q->pos = 0;
-    q->buf_end = 0;
-  } else {
-    memmove(q->ptr, q->ptr + q->pos, unread);
-    q->pos = 0;
-    q->buf_end = unread;
-  }
+  term = enif_make_resource_binary(env, ref_res, data, size);
+  enif_release_resource(ref_res);
+
+  return term;
 }
 
-int queue_read(Ioq *q, void *dst, int buf_size) {
-  int unread;
-  int size;
+// Reads a boolean from the options map, if present.
+int get_bool_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                    int default_value) {
+  ERL_NIF_TERM value;
+
+  if (!enif_is_map(env, opts) ||
+      !enif_get_map_value(env, opts, enif_make_atom(env, key), &value))
+    return default_value;
 
-  unread = q->buf_end - q->pos;
-  if (unread <= 0)
-    return AVERROR_EOF;
+  return enif_is_identical(value, enif_make_atom(env, "true"));
+}
 
-  size = buf_size > unread ? unread : buf_size;
-  memcpy(dst, q->ptr + q->pos, size);
-  q->pos += size;
+// Reads an integer from the options map, if present.
+int get_int_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                   int default_value) {
+  ERL_NIF_TERM value;
+  int result;
 
-  if (q->mode == QUEUE_MODE_SHIFT)
-    queue_deq(q);
+  if (!enif_is_map(env, opts) ||
+      !enif_get_map_value(env, opts, enif_make_atom(env, key), &value) ||
+      !enif_get_int(env, value, &result))
+    return default_value;
 
-  return size;
+  return result;
 }
 
-typedef enum { CTX_MODE_DRAIN, CTX_MODE_BUF } CTX_MODE;
+// Reads a size in bytes from the options map, if present.
+size_t get_size_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                       size_t default_value) {
+  ERL_NIF_TERM value;
+  ErlNifUInt64 result;
 
-typedef struct {
-  // Used to write binary data coming from membrane and as source for the
-  // AVFormatContext.
-  Ioq *queue;
-  // The context responsible for reading data from the queue. It is
-  // configured to use the read_packet function as source.
-  AVIOContext *io_ctx;
-  // The actual libAV demuxer.
-  AVFormatContext *fmt_ctx;
+  if (!enif_is_map(env, opts) ||
+      !enif_get_map_value(env, opts, enif_make_atom(env, key), &value) ||
+      !enif_get_uint64(env, value, &result))
+    return default_value;
 
-  CTX_MODE mode;
+  return result;
+}
 
-  int has_header;
-} DemuxerContext;
+// Reads an atom from the options map into buf, if present. Returns
+// whether the option was found.
+int get_atom_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                    char *buf, unsigned size) {
+  ERL_NIF_TERM value;
 
-void free_demuxer_context_res(ErlNifEnv *env, void *res) {
-  DemuxerContext **ctx = (DemuxerContext **)res;
-  free((*ctx)->queue->ptr);
-  avio_context_free(&(*ctx)->io_ctx);
-  avformat_close_input(&(*ctx)->fmt_ctx);
-  free(*ctx);
+  return enif_is_map(env, opts) &&
+         enif_get_map_value(env, opts, enif_make_atom(env, key), &value) &&
+         enif_get_atom(env, value, buf, size, ERL_NIF_LATIN1);
 }
 
-void free_codec_params_res(ErlNifEnv *env, void *res) {
-  AVCodecParameters **params = (AVCodecParameters **)res;
-  avcodec_parameters_free(params);
+// Reads a {num, den} tuple from the options map into rational, if
+// present. Returns whether the option was found.
+int get_rational_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                        AVRational *rational) {
+  ERL_NIF_TERM value;
+  const ERL_NIF_TERM *tuple;
+  int arity;
+
+  return enif_is_map(env, opts) &&
+         enif_get_map_value(env, opts, enif_make_atom(env, key), &value) &&
+         enif_get_tuple(env, value, &arity, &tuple) && arity == 2 &&
+         enif_get_int(env, tuple[0], &rational->num) &&
+         enif_get_int(env, tuple[1], &rational->den);
+}
+
+// Copies the map of binaries found under key in the options map into
+// dict, to be passed to libav as AVOptions. Returns 0 on success.
+int get_dict_option(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key,
+                    AVDictionary **dict) {
+  ERL_NIF_TERM map, k, v;
+  ErlNifMapIterator iter;
+  ErlNifBinary key_bin, value_bin;
+  char *key_str, *value_str;
+  int errnum = 0;
+
+  if (!enif_is_map(env, opts) ||
+      !enif_get_map_value(env, opts, enif_make_atom(env, key), &map))
+    return 0;
+
+  if (!enif_map_iterator_create(env, map, &iter, ERL_NIF_MAP_ITERATOR_FIRST))
+    return AVERROR(EINVAL);
+
+  while (!errnum && enif_map_iterator_get_pair(env, &iter, &k, &v)) {
+    if (!enif_inspect_binary(env, k, &key_bin) ||
+        !enif_inspect_binary(env, v, &value_bin)) {
+      errnum = AVERROR(EINVAL);
+      break;
+    }
+
+    // Binaries are not NULL terminated.
+    key_str = av_malloc(key_bin.size + 1);
+    value_str = av_malloc(value_bin.size + 1);
+    memcpy(key_str, key_bin.data, key_bin.size);
+    memcpy(value_str, value_bin.data, value_bin.size);
+    key_str[key_bin.size] = 0;
+    value_str[value_bin.size] = 0;
+
+    errnum = av_dict_set(dict, key_str, value_str,
+                         AV_DICT_DONT_STRDUP_KEY | AV_DICT_DONT_STRDUP_VAL);
+    enif_map_iterator_next(env, &iter);
+  }
+  enif_map_iterator_destroy(env, &iter);
+
+  return errnum < 0 ? errnum : 0;
+}
+
+ERL_NIF_TERM make_rational(ErlNifEnv *env, AVRational rational) {
+  return enif_make_tuple2(env, enif_make_int(env, rational.num),
+                          enif_make_int(env, rational.den));
+}
+
+// Returns the reason of an error: the libav message, or :memory_limit when
+// the arena of a context is full.
+ERL_NIF_TERM make_av_error_reason(ErlNifEnv *env, int errnum) {
+  char err[256];
+
+  if (errnum == AVERROR_MEMORY_LIMIT)
+    return enif_make_atom(env, "memory_limit");
+
+  av_strerror(errnum, err, sizeof(err));
+  return enif_make_string(env, err, ERL_NIF_UTF8);
+}
+
+// Builds {:error, reason}.
+ERL_NIF_TERM make_av_error(ErlNifEnv *env, int errnum) {
+  return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                          make_av_error_reason(env, errnum));
 }
 
 void get_codec_params(ErlNifEnv *env, ERL_NIF_TERM term,
@@ -142,111 +247,238 @@ void get_demuxer_context(ErlNifEnv *env, ERL_NIF_TERM term,
   *ctx = *ctx_res;
 }
 
-int read_ioq(void *opaque, uint8_t *buf, int buf_size) {
-  return queue_read((Ioq *)opaque, buf, buf_size);
+// Packets parsed ahead of the element by a native thread, see
+// demuxer_start_read_ahead. The thread owns the parsing while the NIFs keep
+// feeding the queue, both under lock.
+typedef struct ReadAhead {
+  ErlNifTid tid;
+  ErlNifMutex *lock;
+  ErlNifCond *cond;
+  int shutdown;
+
+  // Receives {:libav_demuxer, tag} when there is something to take.
+  ErlNifPid owner;
+  ErlNifEnv *tag_env;
+  ERL_NIF_TERM tag;
+  // At most one message is pending between two calls taking the packets
+  // or adding data.
+  int notified;
+
+  // The packets parsed so far, most recent first, in a process
+  // independent environment.
+  ErlNifEnv *env;
+  ERL_NIF_TERM packets;
+  long count;
+  u_long bytes;
+  // AVERROR_EOF or the error that stopped the thread, 0 while reading.
+  int status;
+  // Time spent by the thread parsing packets.
+  ErlNifTime busy_time;
+} ReadAhead;
+
+// The locking is only needed once the context reads ahead.
+void demuxer_lock(DemuxerContext *ctx) {
+  if (ctx->read_ahead)
+    enif_mutex_lock(ctx->read_ahead->lock);
 }
 
-int demuxer_read_header(DemuxerContext *ctx) {
-  AVIOContext *io_ctx;
-  AVFormatContext *fmt_ctx;
-  void *io_buffer;
-  int errnum;
-  int ret;
+void demuxer_unlock(DemuxerContext *ctx) {
+  if (ctx->read_ahead)
+    enif_mutex_unlock(ctx->read_ahead->lock);
+}
 
-  // TODO can we avoid allocating this buffer each time we do a read attempt?
-  io_buffer = av_malloc(ctx->queue->size);
-  // Context that reads from queue and uses io_buffer as scratch space.
-  io_ctx = avio_alloc_context(io_buffer, ctx->queue->size, 0, ctx->queue,
-                              &read_ioq, NULL, NULL);
-  io_ctx->seekable = 0;
+// Lets the thread look for work again after the owner reacted to its
+// notification. Called with the lock held.
+void read_ahead_wake(DemuxerContext *ctx) {
+  if (!ctx->read_ahead)
+    return;
 
-  fmt_ctx = avformat_alloc_context();
-  fmt_ctx->pb = io_ctx;
-  fmt_ctx->probesize = ctx->queue->size;
+  ctx->read_ahead->notified = 0;
+  enif_cond_signal(ctx->read_ahead->cond);
+}
+
+// Accounts the time elapsed since started to the NIF time of the context,
+// then returns result. The first call after the header is read records the
+// time it took.
+ERL_NIF_TERM demuxer_account(DemuxerContext *ctx, ErlNifTime started,
+                             ERL_NIF_TERM result) {
+  ErlNifTime now = enif_monotonic_time(ERL_NIF_NSEC);
+
+  ctx->stats.nif_time += now - started;
+  if (ctx->has_header && !ctx->stats.time_to_header) {
+    ctx->stats.time_to_header = now - ctx->stats.first_data_at;
+    ctx->stats.header_nif_time = ctx->stats.nif_time;
+  }
+
+  return result;
+}
 
-  if ((errnum = avformat_open_input(&fmt_ctx, NULL, NULL, NULL)))
-    goto open_error;
+// Reads the probing settings from the options. The format is given by
+// name, AVERROR_DEMUXER_NOT_FOUND is returned when libav does not know it.
+int get_probe_options(ErlNifEnv *env, ERL_NIF_TERM opts,
+                      ProbeOptions *probe_opts) {
+  ERL_NIF_TERM value;
+  ErlNifBinary name_bin;
+  char name[64];
+
+  memset(probe_opts, 0, sizeof(ProbeOptions));
+  probe_opts->max_probe_size = get_int_option(env, opts, "max_probe_size", 0);
+  probe_opts->max_analyze_duration =
+      get_int_option(env, opts, "max_analyze_duration", 0);
+  probe_opts->skip_stream_info =
+      get_bool_option(env, opts, "skip_stream_info", 0);
+
+  if (!enif_is_map(env, opts) ||
+      !enif_get_map_value(env, opts, enif_make_atom(env, "format"), &value) ||
+      enif_is_atom(env, value))
+    return 0;
 
-  if ((errnum = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
-    goto open_error;
+  if (!enif_inspect_binary(env, value, &name_bin) ||
+      name_bin.size >= sizeof(name))
+    return AVERROR(EINVAL);
+  memcpy(name, name_bin.data, name_bin.size);
+  name[name_bin.size] = 0;
 
-  ctx->has_header = 1;
-  ctx->io_ctx = io_ctx;
-  ctx->fmt_ctx = fmt_ctx;
+  if (!(probe_opts->format = av_find_input_format(name)))
+    return AVERROR_DEMUXER_NOT_FOUND;
 
-  // From now on, the queue will not grow but rather override data
-  // read by the io_ctx. Dequeue every information read by the
-  queue_deq(ctx->queue);
-  ctx->queue->mode = QUEUE_MODE_SHIFT;
+  return 0;
+}
 
-  return errnum;
+// Makes the resource take ownership on the context.
+ERL_NIF_TERM make_demuxer_context_res(ErlNifEnv *env, DemuxerContext *ctx) {
+  DemuxerContext **ctx_res =
+      enif_alloc_resource(DEMUXER_CTX_RES_TYPE, sizeof(DemuxerContext *));
+  *ctx_res = ctx;
 
-open_error:
-  avio_context_free(&io_ctx);
-  avformat_close_input(&fmt_ctx);
+  ERL_NIF_TERM term = enif_make_resource(env, ctx_res);
 
-  queue_grow(ctx->queue, 2);
-  ctx->queue->pos = 0;
+  // This is done to allow the erlang garbage collector to take care
+  // of freeing this resource when needed.
+  enif_release_resource(ctx_res);
 
-  return errnum;
+  return term;
 }
 
+// Allocates a demuxer reading from a queue, returned as {:ok, ctx}. An
+// unknown forced format is reported as badarg, the context cannot be used
+// without it. The memory_limit option caps the native memory of the
+// context, in bytes.
 ERL_NIF_TERM demuxer_alloc_context(ErlNifEnv *env, int argc,
                                    const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ProbeOptions probe_opts;
   int probe_size;
 
   enif_get_int(env, argv[0], &probe_size);
   if (probe_size <= 0)
     probe_size = DEFAULT_PROBE_SIZE;
 
-  Ioq *queue = (Ioq *)malloc(sizeof(Ioq));
-  queue->ptr = malloc(probe_size);
-  queue->mode = QUEUE_MODE_GROW;
-  queue->size = probe_size;
-  queue->pos = 0;
-  queue->buf_end = 0;
+  if (get_probe_options(env, argv[1], &probe_opts))
+    return enif_make_badarg(env);
 
-  DemuxerContext *ctx = (DemuxerContext *)malloc(sizeof(DemuxerContext));
-  ctx->queue = queue;
-  ctx->mode = CTX_MODE_BUF;
-  ctx->has_header = 0;
+  if (!(ctx = demuxer_context_alloc(
+            probe_size, &probe_opts,
+            get_size_option(env, argv[1], "memory_limit", 0))))
+    return make_av_error(env, AVERROR_MEMORY_LIMIT);
+  ctx->zero_copy = get_bool_option(env, argv[1], "zero_copy", 0);
 
-  // Make the resource take ownership on the context.
-  DemuxerContext **ctx_res =
-      enif_alloc_resource(DEMUXER_CTX_RES_TYPE, sizeof(DemuxerContext *));
-  *ctx_res = ctx;
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"),
+                          make_demuxer_context_res(env, ctx));
+}
 
-  ERL_NIF_TERM term = enif_make_resource(env, ctx_res);
+// Opens a demuxer reading from the file at path. The whole input is
+// available and seekable, hence the header is read right away.
+ERL_NIF_TERM demuxer_open_file(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  ErlNifBinary binary;
+  DemuxerContext *ctx;
+  ProbeOptions probe_opts;
+  ErlNifTime started;
+  ERL_NIF_TERM term;
+  char *path;
+  int errnum;
 
-  // This is done to allow the erlang garbage collector to take care
-  // of freeing this resource when needed.
-  enif_release_resource(ctx_res);
+  started = enif_monotonic_time(ERL_NIF_NSEC);
 
-  return term;
-}
+  if (!enif_inspect_binary(env, argv[0], &binary))
+    return enif_make_badarg(env);
+  if ((errnum = get_probe_options(env, argv[1], &probe_opts)))
+    return make_av_error(env, errnum);
 
-ERL_NIF_TERM demuxer_add_data(ErlNifEnv *env, int argc,
-                              const ERL_NIF_TERM argv[]) {
-  DemuxerContext *ctx;
-  ErlNifBinary binary;
+  // Binaries are not NULL terminated.
+  path = av_malloc(binary.size + 1);
+  memcpy(path, binary.data, binary.size);
+  path[binary.size] = 0;
 
-  get_demuxer_context(env, argv[0], &ctx);
-  enif_inspect_binary(env, argv[1], &binary);
+  errnum = demuxer_context_open_file(
+      &ctx, path, &probe_opts,
+      get_size_option(env, argv[1], "memory_limit", 0));
+  av_free(path);
+
+  if (!ctx)
+    return make_av_error(env, errnum);
+
+  // The resource owns the context and frees it if something went wrong.
+  term = make_demuxer_context_res(env, ctx);
+  if (errnum)
+    return make_av_error(env, errnum);
+
+  ctx->zero_copy = get_bool_option(env, argv[1], "zero_copy", 0);
+  ctx->stats.first_data_at = started;
+  return demuxer_account(ctx, started,
+                         enif_make_tuple2(env, enif_make_atom(env, "ok"), term));
+}
+
+// Queues the data given to demuxer_add_data, reading the header when
+// enough of it is available.
+ERL_NIF_TERM demuxer_enqueue(ErlNifEnv *env, DemuxerContext *ctx,
+                             ERL_NIF_TERM data, ErlNifTime started) {
+  u_long size;
+  int errnum;
 
   // Indicates EOS.
-  if (!binary.data) {
+  if (enif_is_atom(env, data)) {
     ctx->mode = CTX_MODE_DRAIN;
     return enif_make_atom(env, "ok");
   }
 
-  // Copy the data in the buffer.
-  queue_copy(ctx->queue, binary.data, binary.size);
+  // Reference the data in the queue. File contexts have no queue.
+  if (!ctx->queue)
+    return enif_make_badarg(env);
+  if ((errnum = queue_enq(ctx->queue, env, data, &size)))
+    return errnum == AVERROR_MEMORY_LIMIT
+               ? demuxer_account(ctx, started, make_av_error(env, errnum))
+               : enif_make_badarg(env);
+  if (!ctx->stats.first_data_at)
+    ctx->stats.first_data_at = started;
+  ctx->stats.bytes_in += size;
 
   // Make an attemp reading the header only when the ioq buffer is filled.
-  if (!ctx->has_header && queue_is_filled(ctx->queue))
-    demuxer_read_header(ctx);
+  // More data cannot help when the header is not found within
+  // max_probe_size bytes.
+  if (!ctx->has_header && queue_is_filled(ctx->queue) &&
+      (errnum = demuxer_read_header(ctx)) && errnum != AVERROR(EAGAIN))
+    return demuxer_account(ctx, started, make_av_error(env, errnum));
 
-  return enif_make_atom(env, "ok");
+  return demuxer_account(ctx, started, enif_make_atom(env, "ok"));
+}
+
+ERL_NIF_TERM demuxer_add_data(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ErlNifTime started;
+  ERL_NIF_TERM result;
+
+  started = enif_monotonic_time(ERL_NIF_NSEC);
+  get_demuxer_context(env, argv[0], &ctx);
+
+  demuxer_lock(ctx);
+  result = demuxer_enqueue(env, ctx, argv[1], started);
+  read_ahead_wake(ctx);
+  demuxer_unlock(ctx);
+
+  return result;
 }
 
 ERL_NIF_TERM demuxer_is_ready(ErlNifEnv *env, int argc,
@@ -258,10 +490,20 @@ ERL_NIF_TERM demuxer_is_ready(ErlNifEnv *env, int argc,
                          : enif_make_atom(env, "false");
 }
 
-ERL_NIF_TERM make_packet_map(ErlNifEnv *env, AVPacket *packet) {
+ERL_NIF_TERM make_packet_map(ErlNifEnv *env, AVPacket *packet,
+                             int zero_copy) {
   ERL_NIF_TERM data;
-  void *ptr = enif_make_new_binary(env, packet->size, &data);
-  memcpy(ptr, packet->data, packet->size);
+
+  // Packets returned by av_read_frame are usually reference counted
+  // already, in which case the binary just takes over the reference.
+  if (zero_copy &&
+      (packet->buf || av_packet_make_refcounted(packet) == 0)) {
+    data = make_buffer_ref_binary(env, &packet->buf, packet->data,
+                                  packet->size);
+  } else {
+    void *ptr = enif_make_new_binary(env, packet->size, &data);
+    memcpy(ptr, packet->data, packet->size);
+  }
 
   ERL_NIF_TERM map;
   map = enif_make_new_map(env);
@@ -278,57 +520,236 @@ ERL_NIF_TERM make_packet_map(ErlNifEnv *env, AVPacket *packet) {
   enif_make_map_put(env, map, enif_make_atom(env, "duration"),
                     enif_make_long(env, packet->duration), &map);
 
+  enif_make_map_put(
+      env, map, enif_make_atom(env, "keyframe"),
+      enif_make_atom(env, packet->flags & AV_PKT_FLAG_KEY ? "true" : "false"),
+      &map);
+
   enif_make_map_put(env, map, enif_make_atom(env, "data"), data, &map);
 
   return map;
 }
 
+ERL_NIF_TERM make_read_error(ErlNifEnv *env, int errnum) {
+  if (errnum == AVERROR_EOF)
+    return enif_make_atom(env, "eof");
+
+  return make_av_error(env, errnum);
+}
+
 ERL_NIF_TERM demuxer_read_packet(ErlNifEnv *env, int argc,
                                  const ERL_NIF_TERM argv[]) {
   DemuxerContext *ctx;
-  AVPacket *packet;
-  int errnum, freespace;
-  char err[256];
+  ErlNifTime started;
+  ERL_NIF_TERM map;
+  int ret;
 
-  packet = av_packet_alloc();
+  started = enif_monotonic_time(ERL_NIF_NSEC);
   get_demuxer_context(env, argv[0], &ctx);
 
-  freespace = queue_freespace(ctx->queue);
+  // The packets belong to the thread, see demuxer_take_packets.
+  if (ctx->read_ahead)
+    return enif_make_badarg(env);
 
-  if (freespace > 0 && ctx->mode == CTX_MODE_BUF)
-    return enif_make_tuple2(env, enif_make_atom(env, "demand"),
-                            enif_make_long(env, freespace));
+  // Met by demuxer_read_packets after the packets it returned.
+  if ((ret = ctx->read_error)) {
+    ctx->read_error = 0;
+    return demuxer_account(ctx, started, make_read_error(env, ret));
+  }
 
-  if ((errnum = av_read_frame(ctx->fmt_ctx, packet)) < 0) {
-    if (errnum == AVERROR_EOF)
-      return enif_make_atom(env, "eof");
+  if ((ret = demuxer_next_packet(ctx)) > 0)
+    return demuxer_account(ctx, started,
+                           enif_make_tuple2(env, enif_make_atom(env, "demand"),
+                                            enif_make_long(env, ret)));
 
-    av_strerror(errnum, err, sizeof(err));
-    return enif_make_tuple2(env, enif_make_atom(env, "error"),
-                            enif_make_string(env, err, ERL_NIF_UTF8));
+  if (ret < 0)
+    return demuxer_account(ctx, started, make_read_error(env, ret));
+
+  map = make_packet_map(env, ctx->packet, ctx->zero_copy);
+  av_packet_unref(ctx->packet);
+
+  return demuxer_account(ctx, started,
+                         enif_make_tuple2(env, enif_make_atom(env, "ok"), map));
+}
+
+// Reads packets until max_packets or max_bytes are reached, more data is
+// needed or the stream is over, returning {:ok, packets},
+// {:demand, size, packets}, {:eof, packets} or {:error, reason}. An error
+// met after some packets were read returns them as {:ok, packets} and is
+// reported by the next call instead. Long
+// batches yield back to the scheduler when the timeslice is exhausted,
+// rescheduling themselves with the partial result as extra arguments.
+ERL_NIF_TERM demuxer_read_packets(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM args[6];
+  ErlNifTime entered, started, now;
+  long max_packets, count;
+  u_long max_bytes, bytes;
+  int ret, percent;
+
+  get_demuxer_context(env, argv[0], &ctx);
+  if (ctx->read_ahead || !enif_get_long(env, argv[1], &max_packets) ||
+      !enif_get_ulong(env, argv[2], &max_bytes))
+    return enif_make_badarg(env);
+
+  if (argc == 6) {
+    list = argv[3];
+    enif_get_long(env, argv[4], &count);
+    enif_get_ulong(env, argv[5], &bytes);
+  } else {
+    list = enif_make_list(env, 0);
+    count = 0;
+    bytes = 0;
+  }
+
+  entered = enif_monotonic_time(ERL_NIF_NSEC);
+  started = enif_monotonic_time(ERL_NIF_USEC);
+
+  if ((ret = ctx->read_error)) {
+    ctx->read_error = 0;
+    return demuxer_account(ctx, entered, make_read_error(env, ret));
+  }
+
+  while (count < max_packets && bytes < max_bytes) {
+    if ((ret = demuxer_next_packet(ctx)) != 0)
+      break;
+
+    bytes += ctx->packet->size;
+    count++;
+    list = enif_make_list_cell(
+        env, make_packet_map(env, ctx->packet, ctx->zero_copy), list);
+    av_packet_unref(ctx->packet);
+
+    // A timeslice is roughly 1ms.
+    now = enif_monotonic_time(ERL_NIF_USEC);
+    percent = (now - started) / 10;
+    if (percent > 0) {
+      started = now;
+      if (enif_consume_timeslice(env, percent > 100 ? 100 : percent)) {
+        args[0] = argv[0];
+        args[1] = argv[1];
+        args[2] = argv[2];
+        args[3] = list;
+        args[4] = enif_make_long(env, count);
+        args[5] = enif_make_ulong(env, bytes);
+        return demuxer_account(
+            ctx, entered,
+            enif_schedule_nif(env, "demuxer_read_packets", 0,
+                              demuxer_read_packets, 6, args));
+      }
+    }
   }
 
+  // Packets were prepended, restore the demuxing order.
+  enif_make_reverse_list(env, list, &list);
+
+  if (count >= max_packets || bytes >= max_bytes)
+    return demuxer_account(
+        ctx, entered, enif_make_tuple2(env, enif_make_atom(env, "ok"), list));
+
+  if (ret > 0)
+    return demuxer_account(ctx, entered,
+                           enif_make_tuple3(env, enif_make_atom(env, "demand"),
+                                            enif_make_long(env, ret), list));
+
+  if (ret == AVERROR_EOF)
+    return demuxer_account(
+        ctx, entered, enif_make_tuple2(env, enif_make_atom(env, "eof"), list));
+
+  if (count == 0)
+    return demuxer_account(ctx, entered, make_read_error(env, ret));
+
+  ctx->read_error = ret;
+  return demuxer_account(
+      ctx, entered, enif_make_tuple2(env, enif_make_atom(env, "ok"), list));
+}
+
+// Builds the map describing a stream, holding a copy of its codec
+// parameters.
+ERL_NIF_TERM make_stream_map(ErlNifEnv *env, const AVCodecParameters *codecpar,
+                             int index, AVRational time_base) {
+  AVCodecParameters *params = NULL;
+  const char *codec_name;
+
+  // Parameters are used to preserve as much information
+  // as possible when creating a new Codec. We're making
+  // a copy to ensure we own this data.
+
+  params = avcodec_parameters_alloc();
+  avcodec_parameters_copy(params, codecpar);
+
+  // Make the resource
+  AVCodecParameters **codec_params_res =
+      enif_alloc_resource(CODEC_PARAMS_RES_TYPE, sizeof(AVCodecParameters *));
+  *codec_params_res = params;
+
+  ERL_NIF_TERM res_term = enif_make_resource(env, codec_params_res);
+
+  // This is done to allow the erlang garbage collector to take care
+  // of freeing this resource when needed.
+  enif_release_resource(codec_params_res);
+
+  // Create the returned map of information.
+  codec_name = avcodec_get_name(params->codec_id);
+
   ERL_NIF_TERM map;
-  map = make_packet_map(env, packet);
-  av_packet_unref(packet);
+  map = enif_make_new_map(env);
+
+  ERL_NIF_TERM codec_type;
+  switch (params->codec_type) {
+  case AVMEDIA_TYPE_AUDIO:
+    codec_type = enif_make_atom(env, "audio");
+    break;
+  case AVMEDIA_TYPE_VIDEO:
+    codec_type = enif_make_atom(env, "video");
+    break;
+  default:
+    codec_type = enif_make_atom(env, "und");
+    break;
+  }
 
-  return enif_make_tuple2(env, enif_make_atom(env, "ok"), map);
+  enif_make_map_put(env, map, enif_make_atom(env, "codec_id"),
+                    enif_make_int(env, params->codec_id), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "codec_type"), codec_type,
+                    &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "codec_name"),
+                    enif_make_string(env, codec_name, ERL_NIF_UTF8), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "codec_params"), res_term,
+                    &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "stream_index"),
+                    enif_make_int(env, index), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "time_base"),
+                    make_rational(env, time_base), &map);
+
+  // TODO
+  // Expand the information available to Elixir: here we can only select a
+  // stream by index and codec, quality or language should be available too.
+
+  return map;
 }
 
 ERL_NIF_TERM demuxer_streams(ErlNifEnv *env, int argc,
                              const ERL_NIF_TERM argv[]) {
   DemuxerContext *ctx;
-  ERL_NIF_TERM *codecs;
+  ErlNifTime started;
+  ERL_NIF_TERM *codecs, list;
   int errnum;
   char err[256];
 
+  started = enif_monotonic_time(ERL_NIF_NSEC);
   get_demuxer_context(env, argv[0], &ctx);
 
+  // Contexts reading ahead have their header already.
+  demuxer_lock(ctx);
+
   // Called on EOS: we're not ready, meaning that we did not get
   // the amount of data we wanted, but we may still be able to
   // obtain the streams.
   if (!ctx->has_header) {
     if ((errnum = demuxer_read_header(ctx))) {
+      demuxer_unlock(ctx);
       av_strerror(errnum, err, sizeof(err));
       return enif_make_tuple2(env, enif_make_atom(env, "error"),
                               enif_make_string(env, err, ERL_NIF_UTF8));
@@ -337,305 +758,2287 @@ ERL_NIF_TERM demuxer_streams(ErlNifEnv *env, int argc,
 
   codecs = calloc(ctx->fmt_ctx->nb_streams, sizeof(ERL_NIF_TERM));
   for (int i = 0; i < ctx->fmt_ctx->nb_streams; i++) {
-    ERL_NIF_TERM codec_term;
-    ErlNifBinary *binary;
-    AVStream *av_stream;
-    AVCodecParameters *params = NULL;
-    const char *codec_name;
+    AVStream *av_stream = ctx->fmt_ctx->streams[i];
+    codecs[i] = make_stream_map(env, av_stream->codecpar, av_stream->index,
+                                av_stream->time_base);
+  }
+
+  list = enif_make_list_from_array(env, codecs, ctx->fmt_ctx->nb_streams);
+  free(codecs);
+  demuxer_unlock(ctx);
 
-    av_stream = ctx->fmt_ctx->streams[i];
+  return demuxer_account(ctx, started,
+                         enif_make_tuple2(env, enif_make_atom(env, "ok"), list));
+}
 
-    // Parameters are used to preserve as much information
-    // as possible when creating a new Codec. We're making
-    // a copy to ensure we own this data.
+// Adds the bytes held by the arena, and the most it ever held, to the
+// stats map.
+void put_memory_stats(ErlNifEnv *env, Arena *arena, ERL_NIF_TERM *map) {
+  enif_make_map_put(
+      env, *map, enif_make_atom(env, "memory"),
+      enif_make_uint64(env, __atomic_load_n(&arena->current, __ATOMIC_RELAXED)),
+      map);
+  enif_make_map_put(
+      env, *map, enif_make_atom(env, "memory_peak"),
+      enif_make_uint64(env, __atomic_load_n(&arena->peak, __ATOMIC_RELAXED)),
+      map);
+}
 
-    params = avcodec_parameters_alloc();
-    avcodec_parameters_copy(params, av_stream->codecpar);
+// Describes the arena of a context: the native bytes it holds, the most it
+// ever held and its limit, nil when it has none.
+ERL_NIF_TERM make_memory_map(ErlNifEnv *env, Arena *arena) {
+  ERL_NIF_TERM map;
 
-    // Make the resource
-    AVCodecParameters **codec_params_res =
-        enif_alloc_resource(CODEC_PARAMS_RES_TYPE, sizeof(AVCodecParameters *));
-    *codec_params_res = params;
+  map = enif_make_new_map(env);
+  enif_make_map_put(
+      env, map, enif_make_atom(env, "current"),
+      enif_make_uint64(env, __atomic_load_n(&arena->current, __ATOMIC_RELAXED)),
+      &map);
+  enif_make_map_put(
+      env, map, enif_make_atom(env, "peak"),
+      enif_make_uint64(env, __atomic_load_n(&arena->peak, __ATOMIC_RELAXED)),
+      &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "limit"),
+                    arena->limit ? enif_make_uint64(env, arena->limit)
+                                 : enif_make_atom(env, "nil"),
+                    &map);
 
-    ERL_NIF_TERM res_term = enif_make_resource(env, codec_params_res);
+  return map;
+}
 
-    // This is done to allow the erlang garbage collector to take care
-    // of freeing this resource when needed.
-    enif_release_resource(codec_params_res);
+ERL_NIF_TERM demuxer_memory(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ERL_NIF_TERM map;
 
-    // Create the returned map of information.
-    codec_name = avcodec_get_name(params->codec_id);
+  get_demuxer_context(env, argv[0], &ctx);
+  demuxer_lock(ctx);
+  map = make_memory_map(env, &ctx->arena);
+  demuxer_unlock(ctx);
 
-    ERL_NIF_TERM map;
-    map = enif_make_new_map(env);
+  return map;
+}
 
-    ERL_NIF_TERM codec_type;
-    switch (params->codec_type) {
-    case AVMEDIA_TYPE_AUDIO:
-      codec_type = enif_make_atom(env, "audio");
-      break;
-    case AVMEDIA_TYPE_VIDEO:
-      codec_type = enif_make_atom(env, "video");
-      break;
-    default:
-      codec_type = enif_make_atom(env, "und");
-      break;
-    }
+ERL_NIF_TERM demuxer_probe_stats(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ERL_NIF_TERM map, format;
 
-    enif_make_map_put(env, map, enif_make_atom(env, "codec_id"),
-                      enif_make_int(env, params->codec_id), &map);
-    enif_make_map_put(env, map, enif_make_atom(env, "codec_type"), codec_type,
-                      &map);
-    enif_make_map_put(env, map, enif_make_atom(env, "codec_name"),
-                      enif_make_string(env, codec_name, ERL_NIF_UTF8), &map);
-    enif_make_map_put(env, map, enif_make_atom(env, "codec_params"), res_term,
-                      &map);
-    enif_make_map_put(env, map, enif_make_atom(env, "stream_index"),
-                      enif_make_int(env, av_stream->index), &map);
+  get_demuxer_context(env, argv[0], &ctx);
+  demuxer_lock(ctx);
 
-    // TODO
-    // Expand the information available to Elixir: here we can only select a
-    // stream by index and codec, quality or language should be available too.
+  format = ctx->probe.format
+               ? enif_make_string(env, ctx->probe.format->name, ERL_NIF_UTF8)
+               : enif_make_atom(env, "nil");
 
-    codecs[i] = map;
-  }
+  map = enif_make_new_map(env);
+  enif_make_map_put(env, map, enif_make_atom(env, "attempts"),
+                    enif_make_int(env, ctx->probe.attempts), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_probed"),
+                    enif_make_ulong(env, ctx->probe.bytes_probed), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "format"), format, &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "score"),
+                    enif_make_int(env, ctx->probe.score), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "queue_size"),
+                    enif_make_ulong(env, ctx->queue ? ctx->queue->size : 0),
+                    &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "time_to_header"),
+                    enif_make_int64(env, ctx->stats.time_to_header), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "nif_time"),
+                    enif_make_int64(env, ctx->stats.header_nif_time), &map);
+  demuxer_unlock(ctx);
 
-  return enif_make_tuple2(
-      env, enif_make_atom(env, "ok"),
-      enif_make_list_from_array(env, codecs, ctx->fmt_ctx->nb_streams));
+  return map;
 }
 
-ERL_NIF_TERM demuxer_demand(ErlNifEnv *env, int argc,
-                            const ERL_NIF_TERM argv[]) {
+ERL_NIF_TERM demuxer_stats(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
   DemuxerContext *ctx;
+  Ioq empty = {0};
+  Ioq *queue;
+  ERL_NIF_TERM map;
+
   get_demuxer_context(env, argv[0], &ctx);
+  demuxer_lock(ctx);
+  queue = ctx->queue ? ctx->queue : &empty;
+
+  map = enif_make_new_map(env);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_in"),
+                    enif_make_ulong(env, ctx->stats.bytes_in), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "queue_size"),
+                    enif_make_ulong(env, queue->size), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "queue_high_water"),
+                    enif_make_ulong(env, queue->high_water), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "queue_grows"),
+                    enif_make_ulong(env, queue->grows), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_copied"),
+                    enif_make_ulong(env, queue->bytes_copied), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "probe_attempts"),
+                    enif_make_int(env, ctx->probe.attempts), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "packets"),
+                    enif_make_ulong(env, ctx->stats.packets), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "packet_bytes"),
+                    enif_make_ulong(env, ctx->stats.packet_bytes), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "nif_time"),
+                    enif_make_int64(env, ctx->stats.nif_time), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "time_to_header"),
+                    enif_make_int64(env, ctx->stats.time_to_header), &map);
+  enif_make_map_put(
+      env, map, enif_make_atom(env, "read_ahead_time"),
+      enif_make_int64(env, ctx->read_ahead ? ctx->read_ahead->busy_time : 0),
+      &map);
+  put_memory_stats(env, &ctx->arena, &map);
+  demuxer_unlock(ctx);
 
-  return enif_make_int(env, ctx->queue->size - ctx->queue->buf_end);
+  return map;
 }
 
-typedef struct {
-  AVCodecContext *codec_ctx;
-  SwrContext *resampler_ctx;
-  enum AVSampleFormat output_sample_format;
-} DecoderContext;
+// Makes libav skip every stream whose index is not in the given list: the
+// packets of discarded streams are neither parsed nor returned. Returns
+// {:error, :eagain} until the header is read.
+ERL_NIF_TERM demuxer_select_streams(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ERL_NIF_TERM list, head;
+  int index;
 
-void free_decoder_context_res(ErlNifEnv *env, void *res) {
-  DecoderContext **ctx = (DecoderContext **)res;
-  avcodec_free_context(&(*ctx)->codec_ctx);
-  if ((*ctx)->resampler_ctx)
-    swr_free(&(*ctx)->resampler_ctx);
+  get_demuxer_context(env, argv[0], &ctx);
+  demuxer_lock(ctx);
+
+  if (!ctx->has_header) {
+    demuxer_unlock(ctx);
+    return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                            enif_make_atom(env, "eagain"));
+  }
+
+  // Validate the indices before touching the streams.
+  for (list = argv[1]; enif_get_list_cell(env, list, &head, &list);)
+    if (!enif_get_int(env, head, &index) || index < 0 ||
+        index >= ctx->fmt_ctx->nb_streams)
+      break;
+  if (!enif_is_empty_list(env, list)) {
+    demuxer_unlock(ctx);
+    return enif_make_badarg(env);
+  }
+
+  for (int i = 0; i < ctx->fmt_ctx->nb_streams; i++)
+    ctx->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
 
-  free(*ctx);
+  for (list = argv[1]; enif_get_list_cell(env, list, &head, &list);) {
+    enif_get_int(env, head, &index);
+    ctx->fmt_ctx->streams[index]->discard = AVDISCARD_DEFAULT;
+  }
+  demuxer_unlock(ctx);
+
+  return enif_make_atom(env, "ok");
 }
 
-void get_decoder_context(ErlNifEnv *env, ERL_NIF_TERM term,
-                         DecoderContext **ctx) {
-  DecoderContext **ctx_res;
-  enif_get_resource(env, term, DECODER_CTX_RES_TYPE, (void *)&ctx_res);
-  *ctx = *ctx_res;
+// Moves a file context to the last keyframe of the stream at or before the
+// given pts, expressed in the stream time base.
+ERL_NIF_TERM demuxer_seek(ErlNifEnv *env, int argc,
+                          const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ErlNifTime started;
+  int stream_index, errnum;
+  int64_t pts;
+
+  get_demuxer_context(env, argv[0], &ctx);
+  // Seeking would leave stale packets in the read-ahead.
+  if (ctx->read_ahead || !enif_get_int(env, argv[1], &stream_index) ||
+      !enif_get_int64(env, argv[2], (long *)&pts))
+    return enif_make_badarg(env);
+
+  started = enif_monotonic_time(ERL_NIF_NSEC);
+  errnum = demuxer_seek_keyframe(ctx, stream_index, pts);
+  return demuxer_account(ctx, started,
+                         errnum < 0 ? make_av_error(env, errnum)
+                                    : enif_make_atom(env, "ok"));
 }
 
-int is_planar(enum AVSampleFormat fmt) {
-  switch (fmt) {
-  case AV_SAMPLE_FMT_U8P:
-  case AV_SAMPLE_FMT_S16P:
-  case AV_SAMPLE_FMT_S32P:
-  case AV_SAMPLE_FMT_FLTP:
-  case AV_SAMPLE_FMT_DBLP:
-  case AV_SAMPLE_FMT_S64P:
-    return 1;
-  default:
-    return 0;
+ERL_NIF_TERM demuxer_keyframes(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  Keyframe *kfs;
+  ERL_NIF_TERM list, map;
+  int stream_index, count;
+
+  get_demuxer_context(env, argv[0], &ctx);
+  if (!enif_get_int(env, argv[1], &stream_index))
+    return enif_make_badarg(env);
+
+  // The arena is shared with the read-ahead thread.
+  demuxer_lock(ctx);
+  if ((count = demuxer_collect_keyframes(ctx, stream_index, &kfs)) < 0) {
+    demuxer_unlock(ctx);
+    return make_av_error(env, count);
   }
+
+  list = enif_make_list(env, 0);
+  for (int i = count - 1; i >= 0; i--) {
+    map = enif_make_new_map(env);
+    enif_make_map_put(env, map, enif_make_atom(env, "pts"),
+                      enif_make_int64(env, kfs[i].pts), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "dts"),
+                      enif_make_int64(env, kfs[i].dts), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "pos"),
+                      enif_make_int64(env, kfs[i].pos), &map);
+    list = enif_make_list_cell(env, map, list);
+  }
+  arena_free(&ctx->arena, kfs);
+  demuxer_unlock(ctx);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
 }
 
-int alloc_resampler(DecoderContext *ctx) {
-  int ret;
-  AVCodecContext *codec_ctx;
-  enum AVSampleFormat output_fmt;
+ERL_NIF_TERM demuxer_demand(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  int demand;
 
-  codec_ctx = ctx->codec_ctx;
-  output_fmt = av_get_packed_sample_fmt(codec_ctx->sample_fmt);
+  get_demuxer_context(env, argv[0], &ctx);
 
-  swr_alloc_set_opts2(&(ctx->resampler_ctx), &codec_ctx->ch_layout, output_fmt,
-                      codec_ctx->sample_rate, &codec_ctx->ch_layout,
-                      codec_ctx->sample_fmt, codec_ctx->sample_rate, 0, NULL);
+  // When reading ahead, the queue only drains while the thread has room
+  // for more packets: the demand drops to zero once the owner stops taking
+  // them.
+  demuxer_lock(ctx);
+  demand = ctx->queue ? queue_freespace(ctx->queue) : 0;
+  demuxer_unlock(ctx);
 
-  ctx->output_sample_format = output_fmt;
-  return swr_init(ctx->resampler_ctx);
+  return enif_make_int(env, demand);
 }
 
-ERL_NIF_TERM decoder_alloc_context(ErlNifEnv *env, int argc,
-                                   const ERL_NIF_TERM argv[]) {
-  int codec_id;
-  AVCodecParameters *params;
-  const AVCodec *codec;
-  AVCodecContext *codec_ctx;
-  DecoderContext *ctx;
+// Bounds of the packets parsed ahead. Past them, or past the memory limit
+// of the context, the thread waits for the owner to take the packets: the
+// queue fills up and demuxer_demand drops to zero, which stops the input.
+#define READ_AHEAD_MAX_PACKETS 256
+#define READ_AHEAD_MAX_BYTES (4 << 20)
+
+// Tells the owner that there is something to take, unless a message is
+// pending already. Called with the lock held.
+void read_ahead_notify(ReadAhead *ra) {
+  ErlNifEnv *msg_env;
+
+  if (ra->notified)
+    return;
+
+  msg_env = enif_alloc_env();
+  enif_send(NULL, &ra->owner, msg_env,
+            enif_make_tuple2(msg_env, enif_make_atom(msg_env, "libav_demuxer"),
+                             enif_make_copy(msg_env, ra->tag)));
+  enif_free_env(msg_env);
+  ra->notified = 1;
+}
 
-  enif_get_int(env, argv[0], &codec_id);
-  get_codec_params(env, argv[1], &params);
+void *read_ahead_run(void *arg) {
+  DemuxerContext *ctx = (DemuxerContext *)arg;
+  ReadAhead *ra = ctx->read_ahead;
+  ErlNifTime started;
+  ERL_NIF_TERM map;
+  int ret;
 
-  codec = avcodec_find_decoder((enum AVCodecID)codec_id);
-  codec_ctx = avcodec_alloc_context3(codec);
+  enif_mutex_lock(ra->lock);
+  while (!ra->shutdown) {
+    if (ra->status || ra->count >= READ_AHEAD_MAX_PACKETS ||
+        ra->bytes >= READ_AHEAD_MAX_BYTES ||
+        (ra->count && !arena_fits(&ctx->arena, 0))) {
+      enif_cond_wait(ra->cond, ra->lock);
+      continue;
+    }
 
-  avcodec_parameters_to_context(codec_ctx, params);
-  avcodec_open2(codec_ctx, codec, NULL);
+    // Parsing happens under the lock as it reads from the queue, the
+    // schedulers adding data wait for at most one packet.
+    started = enif_monotonic_time(ERL_NIF_NSEC);
+    if ((ret = demuxer_next_packet(ctx)) == 0) {
+      // The packet is read already, the limit only stops the next ones.
+      arena_charge(&ctx->arena, ctx->packet->size);
+      ra->bytes += ctx->packet->size;
+      map = make_packet_map(ra->env, ctx->packet, ctx->zero_copy);
+      av_packet_unref(ctx->packet);
+      ra->packets = enif_make_list_cell(ra->env, map, ra->packets);
+      ra->count++;
+    } else if (ret < 0) {
+      ra->status = ret;
+    }
+    ra->busy_time += enif_monotonic_time(ERL_NIF_NSEC) - started;
 
-  ctx = (DecoderContext *)malloc(sizeof(DecoderContext));
-  ctx->codec_ctx = codec_ctx;
-  ctx->output_sample_format = codec_ctx->sample_fmt;
+    // The owner is also told when the thread starves, so that it demands
+    // more input.
+    read_ahead_notify(ra);
+    if (ret > 0)
+      enif_cond_wait(ra->cond, ra->lock);
+  }
+  enif_mutex_unlock(ra->lock);
 
-  if (is_planar(codec_ctx->sample_fmt))
-    alloc_resampler(ctx);
+  return NULL;
+}
 
-  // Make the resource take ownership on the context.
-  DecoderContext **ctx_res =
-      enif_alloc_resource(DECODER_CTX_RES_TYPE, sizeof(DecoderContext *));
-  *ctx_res = ctx;
+void read_ahead_free(Arena *arena, ReadAhead *ra) {
+  enif_free_env(ra->env);
+  enif_free_env(ra->tag_env);
+  enif_cond_destroy(ra->cond);
+  enif_mutex_destroy(ra->lock);
+  arena_free(arena, ra);
+}
 
-  ERL_NIF_TERM term = enif_make_resource(env, ctx_res);
+void read_ahead_stop(Arena *arena, ReadAhead *ra) {
+  enif_mutex_lock(ra->lock);
+  ra->shutdown = 1;
+  enif_cond_broadcast(ra->cond);
+  enif_mutex_unlock(ra->lock);
 
-  // This is done to allow the erlang garbage collector to take care
+  enif_thread_join(ra->tid, NULL);
+  read_ahead_free(arena, ra);
+}
+
+// Moves the parsing of the packets to a native thread, which reads ahead as
+// data is added and sends {:libav_demuxer, tag} to the calling process when
+// there are packets to take with demuxer_take_packets, when it needs more
+// data or once the stream is over. The header must have been read.
+ERL_NIF_TERM demuxer_start_read_ahead(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ReadAhead *ra;
+
+  get_demuxer_context(env, argv[0], &ctx);
+  if (ctx->read_ahead)
+    return enif_make_badarg(env);
+  if (!ctx->has_header)
+    return make_av_error(env, AVERROR(EAGAIN));
+
+  if (!(ra = (ReadAhead *)arena_alloc(&ctx->arena, sizeof(ReadAhead))))
+    return make_av_error(env, AVERROR_MEMORY_LIMIT);
+  ra->lock = enif_mutex_create("libav_read_ahead");
+  ra->cond = enif_cond_create("libav_read_ahead");
+  ra->env = enif_alloc_env();
+  ra->packets = enif_make_list(ra->env, 0);
+  ra->tag_env = enif_alloc_env();
+  ra->tag = enif_make_copy(ra->tag_env, argv[1]);
+  enif_self(env, &ra->owner);
+
+  ctx->read_ahead = ra;
+  if (enif_thread_create("libav_read_ahead", &ra->tid, read_ahead_run, ctx,
+                         NULL)) {
+    ctx->read_ahead = NULL;
+    read_ahead_free(&ctx->arena, ra);
+    return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                            enif_make_atom(env, "thread_create"));
+  }
+
+  return enif_make_atom(env, "ok");
+}
+
+// Returns the packets read ahead so far as {:ok, packets}, {:eof, packets}
+// once the stream is over or {:error, reason} once the packets read before
+// the error were taken.
+ERL_NIF_TERM demuxer_take_packets(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  DemuxerContext *ctx;
+  ReadAhead *ra;
+  ERL_NIF_TERM list;
+  int status;
+
+  get_demuxer_context(env, argv[0], &ctx);
+  if (!(ra = ctx->read_ahead))
+    return enif_make_badarg(env);
+
+  // Copying the list only references the payloads.
+  enif_mutex_lock(ra->lock);
+  list = enif_make_copy(env, ra->packets);
+  status = ra->status;
+  enif_clear_env(ra->env);
+  ra->packets = enif_make_list(ra->env, 0);
+  arena_release(&ctx->arena, ra->bytes);
+  ra->count = 0;
+  ra->bytes = 0;
+  read_ahead_wake(ctx);
+  enif_mutex_unlock(ra->lock);
+
+  enif_make_reverse_list(env, list, &list);
+
+  // The error is reported once the packets read before it are taken.
+  if (status && status != AVERROR_EOF && enif_is_empty_list(env, list))
+    return make_av_error(env, status);
+  if (status && status != AVERROR_EOF)
+    status = 0;
+
+  return enif_make_tuple2(
+      env, enif_make_atom(env, status ? "eof" : "ok"), list);
+}
+
+// A packet waiting to be decoded by a WorkerPool. The job owns a process
+// independent environment which holds a copy of the packet term (refc
+// binaries are not copied, just referenced) and which is later reused to
+// send the decoded frames back to the owner.
+typedef struct DecodeJob {
+  ErlNifEnv *env;
+  ERL_NIF_TERM packet;
+  ErlNifPid owner;
+  // Identifies the decoder in the reply.
+  ERL_NIF_TERM tag;
+  // The decoder resource, kept alive until the job is done.
+  void *ctx_res;
+  // Bytes charged to the arena of the decoder until the job is done.
+  size_t charge;
+  ErlNifTime enqueued_at;
+  struct DecodeJob *next;
+} DecodeJob;
+
+struct WorkerPool;
+
+// What a pooled decoder was opened with. Another context can take it over
+// only when every field matches.
+typedef struct {
+  enum AVCodecID codec_id;
+  AVCodecParameters *params;
+  DecoderConfig config;
+  // The codec options, serialized by av_dict_get_string.
+  char *options;
+} DecoderKey;
+
+typedef struct DecoderContext {
+  Decoder decoder;
+
+  // Async decoding state, guarded by lock. The jobs of a context are
+  // processed by at most one worker at a time, which preserves the packet
+  // order.
+  ErlNifMutex *lock;
+  DecodeJob *jobs_head;
+  DecodeJob *jobs_tail;
+  int scheduled;
+  // The pool this context was first submitted to.
+  struct WorkerPool *pool;
+  // Link in the run queue of the pool.
+  struct DecoderContext *next_ready;
+
+  // The DecoderPool resource the context goes back to when it is
+  // destroyed, kept alive until then, and the key it is filed under. NULL
+  // for contexts that are not pooled.
+  void *decoder_pool_res;
+  DecoderKey *key;
+  // Link in the idle list of the DecoderPool.
+  struct DecoderContext *next_idle;
+
+  // Copy of decoder.stats taken after each packet, guarded by lock, as
+  // decoder_stats might be called while a worker is decoding.
+  DecoderStats stats;
+} DecoderContext;
+
+void decoder_key_free(DecoderKey *key) {
+  if (!key)
+    return;
+  avcodec_parameters_free(&key->params);
+  av_free(key->options);
+  free(key);
+}
+
+// Tells whether a decoder opened for a can decode streams described by b.
+int codec_params_equal(const AVCodecParameters *a,
+                       const AVCodecParameters *b) {
+  return a->codec_type == b->codec_type && a->codec_id == b->codec_id &&
+         a->format == b->format && a->profile == b->profile &&
+         a->level == b->level &&
+         a->bits_per_coded_sample == b->bits_per_coded_sample &&
+         a->bits_per_raw_sample == b->bits_per_raw_sample &&
+         a->width == b->width && a->height == b->height &&
+         a->sample_rate == b->sample_rate &&
+         a->block_align == b->block_align && a->frame_size == b->frame_size &&
+         !av_channel_layout_compare(&a->ch_layout, &b->ch_layout) &&
+         a->extradata_size == b->extradata_size &&
+         (!a->extradata_size ||
+          !memcmp(a->extradata, b->extradata, a->extradata_size));
+}
+
+int decoder_key_equal(const DecoderKey *a, const DecoderKey *b) {
+  const DecoderConfig *ac = &a->config, *bc = &b->config;
+
+  return a->codec_id == b->codec_id && !strcmp(a->options, b->options) &&
+         !av_cmp_q(ac->time_base, bc->time_base) &&
+         ac->thread_count == bc->thread_count &&
+         ac->thread_type == bc->thread_type &&
+         ac->sample_format == bc->sample_format &&
+         ac->sample_rate == bc->sample_rate &&
+         ac->channels == bc->channels &&
+         ac->chunk_samples == bc->chunk_samples &&
+         ac->chunk_duration == bc->chunk_duration &&
+         ac->pixel_format == bc->pixel_format && ac->width == bc->width &&
+         ac->height == bc->height &&
+         ac->memory_limit == bc->memory_limit &&
+         codec_params_equal(a->params, b->params);
+}
+
+void decoder_context_free(DecoderContext *ctx) {
+  decoder_close(&ctx->decoder);
+  decoder_key_free(ctx->key);
+  enif_mutex_destroy(ctx->lock);
+  enif_free(ctx);
+}
+
+// Opened decoders kept for reuse. Contexts allocated with a pool are
+// returned to it when their resource is destroyed, flushed, instead of
+// being closed. The next context opened with the same codec, parameters
+// and configuration takes one over, skipping avcodec_open2 and the
+// resampler setup. Idle decoders are kept up to max_idle, the least
+// recently returned ones are closed first.
+typedef struct DecoderPool {
+  ErlNifMutex *lock;
+  // Most recently returned first.
+  DecoderContext *idle;
+  int nb_idle;
+  int max_idle;
+
+  // Metrics, guarded by lock.
+  u_long hits;
+  u_long misses;
+  u_long returned;
+  u_long evicted;
+} DecoderPool;
+
+// Takes over an idle context matching key, if any. The context is left as
+// a newly opened one would be.
+DecoderContext *decoder_pool_checkout(DecoderPool *pool, const DecoderKey *key) {
+  DecoderContext **link, *ctx = NULL;
+
+  enif_mutex_lock(pool->lock);
+  for (link = &pool->idle; *link; link = &(*link)->next_idle) {
+    if (decoder_key_equal((*link)->key, key)) {
+      ctx = *link;
+      *link = ctx->next_idle;
+      pool->nb_idle--;
+      break;
+    }
+  }
+  if (ctx)
+    pool->hits++;
+  else
+    pool->misses++;
+  enif_mutex_unlock(pool->lock);
+
+  if (ctx) {
+    ctx->next_idle = NULL;
+    memset(&ctx->decoder.stats, 0, sizeof(DecoderStats));
+    memset(&ctx->stats, 0, sizeof(DecoderStats));
+    ctx->decoder.arena.peak = ctx->decoder.arena.current;
+  }
+
+  return ctx;
+}
+
+// Files the context of a destroyed resource as idle. Returns the context
+// the caller has to free instead: the context itself when it cannot be
+// reused, the least recently returned one when the pool is full, NULL
+// otherwise.
+DecoderContext *decoder_pool_checkin(DecoderPool *pool, DecoderContext *ctx) {
+  DecoderContext **link, *evicted = NULL;
+
+  // Drops the packets and samples left by the previous stream, and
+  // leaves drain mode.
+  if (decoder_reset(&ctx->decoder) < 0)
+    return ctx;
+
+  // The next owner might submit its packets to another worker pool.
+  ctx->pool = NULL;
+
+  enif_mutex_lock(pool->lock);
+  ctx->next_idle = pool->idle;
+  pool->idle = ctx;
+  pool->nb_idle++;
+  pool->returned++;
+
+  if (pool->nb_idle > pool->max_idle) {
+    for (link = &pool->idle; (*link)->next_idle; link = &(*link)->next_idle)
+      ;
+    evicted = *link;
+    *link = NULL;
+    pool->nb_idle--;
+    pool->evicted++;
+  }
+  enif_mutex_unlock(pool->lock);
+
+  return evicted;
+}
+
+void free_decoder_context_res(ErlNifEnv *env, void *res) {
+  DecoderContext *ctx = *(DecoderContext **)res;
+  void *pool_res = ctx->decoder_pool_res;
+
+  // Pending jobs keep the resource alive, hence there is nothing queued
+  // at this point.
+  if (pool_res) {
+    ctx->decoder_pool_res = NULL;
+    ctx = decoder_pool_checkin(*(DecoderPool **)pool_res, ctx);
+  }
+  if (ctx)
+    decoder_context_free(ctx);
+
+  // Might free the decoder pool, with the context that was just filed.
+  if (pool_res)
+    enif_release_resource(pool_res);
+}
+
+void free_decoder_pool_res(ErlNifEnv *env, void *res) {
+  DecoderPool *pool = *(DecoderPool **)res;
+  DecoderContext *ctx;
+
+  // Contexts in use keep the resource alive, only idle ones are left.
+  while ((ctx = pool->idle)) {
+    pool->idle = ctx->next_idle;
+    decoder_context_free(ctx);
+  }
+
+  enif_mutex_destroy(pool->lock);
+  free(pool);
+}
+
+ERL_NIF_TERM decoder_pool_alloc(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  DecoderPool *pool;
+  int max_idle;
+
+  if (!enif_get_int(env, argv[0], &max_idle) || max_idle < 0)
+    return enif_make_badarg(env);
+
+  pool = (DecoderPool *)calloc(1, sizeof(DecoderPool));
+  pool->lock = enif_mutex_create("libav_decoder_pool");
+  pool->max_idle = max_idle;
+
+  DecoderPool **pool_res =
+      enif_alloc_resource(DECODER_POOL_RES_TYPE, sizeof(DecoderPool *));
+  *pool_res = pool;
+
+  ERL_NIF_TERM term = enif_make_resource(env, pool_res);
+  enif_release_resource(pool_res);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+ERL_NIF_TERM decoder_pool_stats(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  DecoderPool **pool_res;
+  DecoderPool *pool;
+  ERL_NIF_TERM map;
+
+  if (!enif_get_resource(env, argv[0], DECODER_POOL_RES_TYPE,
+                         (void *)&pool_res))
+    return enif_make_badarg(env);
+  pool = *pool_res;
+  map = enif_make_new_map(env);
+
+  enif_mutex_lock(pool->lock);
+  enif_make_map_put(env, map, enif_make_atom(env, "idle"),
+                    enif_make_int(env, pool->nb_idle), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "max_idle"),
+                    enif_make_int(env, pool->max_idle), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "hits"),
+                    enif_make_ulong(env, pool->hits), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "misses"),
+                    enif_make_ulong(env, pool->misses), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "returned"),
+                    enif_make_ulong(env, pool->returned), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "evicted"),
+                    enif_make_ulong(env, pool->evicted), &map);
+  enif_mutex_unlock(pool->lock);
+
+  return map;
+}
+
+void get_decoder_context(ErlNifEnv *env, ERL_NIF_TERM term,
+                         DecoderContext **ctx) {
+  DecoderContext **ctx_res;
+  enif_get_resource(env, term, DECODER_CTX_RES_TYPE, (void *)&ctx_res);
+  *ctx = *ctx_res;
+}
+
+// Reads the decoder configuration from the options: a thread_count of 0
+// lets libav pick one thread per core, thread_type restricts threading to
+// either :frame or :slice. The output_* options select the audio or video
+// format of the decoded frames, chunk_samples or chunk_duration, in
+// microseconds, the size of the chunks audio is regrouped in. memory_limit
+// caps the native memory of the decoder, in bytes.
+int get_decoder_config(ErlNifEnv *env, ERL_NIF_TERM opts,
+                       DecoderConfig *config) {
+  char buf[16];
+
+  decoder_config_init(config);
+  get_rational_option(env, opts, "time_base", &config->time_base);
+
+  config->thread_count = get_int_option(env, opts, "thread_count", 0);
+  if (get_atom_option(env, opts, "thread_type", buf, sizeof(buf))) {
+    if (!strcmp(buf, "frame"))
+      config->thread_type = FF_THREAD_FRAME;
+    else if (!strcmp(buf, "slice"))
+      config->thread_type = FF_THREAD_SLICE;
+    else
+      config->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+
+  if (get_atom_option(env, opts, "output_sample_format", buf, sizeof(buf)) &&
+      (config->sample_format = av_get_sample_fmt(buf)) == AV_SAMPLE_FMT_NONE)
+    return AVERROR(EINVAL);
+  config->sample_rate = get_int_option(env, opts, "output_sample_rate", 0);
+  config->channels = get_int_option(env, opts, "output_channels", 0);
+  config->chunk_samples = get_int_option(env, opts, "chunk_samples", 0);
+  config->chunk_duration = get_int_option(env, opts, "chunk_duration", 0);
+
+  if (get_atom_option(env, opts, "output_pixel_format", buf, sizeof(buf)) &&
+      (config->pixel_format = av_get_pix_fmt(buf)) == AV_PIX_FMT_NONE)
+    return AVERROR(EINVAL);
+  config->width = get_int_option(env, opts, "output_width", 0);
+  config->height = get_int_option(env, opts, "output_height", 0);
+
+  config->memory_limit = get_size_option(env, opts, "memory_limit", 0);
+
+  return 0;
+}
+
+// Reads the key a pooled decoder is filed under. The options are those
+// given to the codec, before avcodec_open2 consumes them.
+int get_decoder_key(enum AVCodecID codec_id, const AVCodecParameters *params,
+                    const DecoderConfig *config, const AVDictionary *options,
+                    DecoderKey **key) {
+  int errnum;
+
+  *key = (DecoderKey *)calloc(1, sizeof(DecoderKey));
+  (*key)->codec_id = codec_id;
+  (*key)->config = *config;
+
+  if (!((*key)->params = avcodec_parameters_alloc()))
+    errnum = AVERROR(ENOMEM);
+  else if ((errnum = avcodec_parameters_copy((*key)->params, params)) >= 0)
+    errnum = av_dict_get_string(options, &(*key)->options, '=', ',');
+
+  if (errnum < 0) {
+    decoder_key_free(*key);
+    *key = NULL;
+    return errnum;
+  }
+
+  return 0;
+}
+
+// Opens a decoder, or takes over an idle one from the decoder_pool option
+// when it holds one opened for the same stream and configuration.
+ERL_NIF_TERM decoder_alloc_context(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  int codec_id, errnum;
+  AVCodecParameters *params;
+  DecoderConfig config;
+  AVDictionary *options = NULL;
+  AVDictionaryEntry *unused;
+  DecoderContext *ctx = NULL;
+  DecoderPool **pool_res = NULL;
+  DecoderKey *key = NULL;
+  ERL_NIF_TERM value;
+
+  enif_get_int(env, argv[0], &codec_id);
+  get_codec_params(env, argv[1], &params);
+
+  if (enif_is_map(env, argv[2]) &&
+      enif_get_map_value(env, argv[2], enif_make_atom(env, "decoder_pool"),
+                         &value) &&
+      !enif_is_atom(env, value) &&
+      !enif_get_resource(env, value, DECODER_POOL_RES_TYPE, (void *)&pool_res))
+    return enif_make_badarg(env);
+
+  if ((errnum = get_decoder_config(env, argv[2], &config)) ||
+      (errnum = get_dict_option(env, argv[2], "codec_options", &options)) ||
+      (pool_res && (errnum = get_decoder_key((enum AVCodecID)codec_id, params,
+                                             &config, options, &key)))) {
+    av_dict_free(&options);
+    return make_av_error(env, errnum);
+  }
+
+  if (key && (ctx = decoder_pool_checkout(*pool_res, key))) {
+    av_dict_free(&options);
+    decoder_key_free(key);
+    goto done;
+  }
+
+  ctx = (DecoderContext *)enif_alloc(sizeof(DecoderContext));
+  memset(ctx, 0, sizeof(DecoderContext));
+
+  // The context is charged to the arena of its decoder.
+  if ((errnum = decoder_open(&ctx->decoder, (enum AVCodecID)codec_id, params,
+                             &config, &options)) ||
+      (errnum = arena_reserve(&ctx->decoder.arena, sizeof(DecoderContext)))) {
+    if (ctx->decoder.codec_ctx)
+      decoder_close(&ctx->decoder);
+    av_dict_free(&options);
+    decoder_key_free(key);
+    enif_free(ctx);
+    return make_av_error(env, errnum);
+  }
+
+  // avcodec_open2 leaves the options it did not recognise in the
+  // dictionary.
+  if ((unused = av_dict_get(options, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+    ERL_NIF_TERM reason = enif_make_tuple2(
+        env, enif_make_atom(env, "unknown_option"),
+        enif_make_string(env, unused->key, ERL_NIF_UTF8));
+    av_dict_free(&options);
+    decoder_key_free(key);
+    decoder_close(&ctx->decoder);
+    enif_free(ctx);
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), reason);
+  }
+  av_dict_free(&options);
+
+  ctx->lock = enif_mutex_create("libav_decoder_ctx");
+  ctx->key = key;
+
+done:
+  if (pool_res) {
+    enif_keep_resource(pool_res);
+    ctx->decoder_pool_res = pool_res;
+  }
+
+  // Make the resource take ownership on the context.
+  DecoderContext **ctx_res =
+      enif_alloc_resource(DECODER_CTX_RES_TYPE, sizeof(DecoderContext *));
+  *ctx_res = ctx;
+
+  ERL_NIF_TERM term = enif_make_resource(env, ctx_res);
+
+  // This is done to allow the erlang garbage collector to take care
   // of freeing this resource when needed.
   enif_release_resource(ctx_res);
 
-  return term;
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+ERL_NIF_TERM make_thread_type(ErlNifEnv *env, int thread_type) {
+  if (thread_type & FF_THREAD_FRAME)
+    return enif_make_atom(env, "frame");
+  if (thread_type & FF_THREAD_SLICE)
+    return enif_make_atom(env, "slice");
+  return enif_make_atom(env, "none");
 }
 
 ERL_NIF_TERM decoder_stream_format(ErlNifEnv *env, int argc,
                                    const ERL_NIF_TERM argv[]) {
   DecoderContext *ctx;
-  enum AVSampleFormat fmt;
+  AVCodecContext *codec_ctx;
   ERL_NIF_TERM map;
   get_decoder_context(env, argv[0], &ctx);
-
-  // TODO
-  // this function is only meaningful when the stream is of audio type. To
-  // support video, add another if condition or a switch and add the relevant
-  // information to the map.
+  codec_ctx = ctx->decoder.codec_ctx;
 
   map = enif_make_new_map(env);
 
-  if (ctx->codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+  // The threading configuration in effect, as chosen by libav.
+  enif_make_map_put(env, map, enif_make_atom(env, "thread_count"),
+                    enif_make_int(env, codec_ctx->thread_count), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "thread_type"),
+                    make_thread_type(env, codec_ctx->active_thread_type),
+                    &map);
 
-    enif_make_map_put(env, map, enif_make_atom(env, "channels"),
-                      enif_make_int(env, ctx->codec_ctx->ch_layout.nb_channels),
-                      &map);
+  if (codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+
+    enif_make_map_put(
+        env, map, enif_make_atom(env, "channels"),
+        enif_make_int(env, ctx->decoder.output_ch_layout.nb_channels), &map);
     enif_make_map_put(env, map, enif_make_atom(env, "sample_rate"),
-                      enif_make_int(env, ctx->codec_ctx->sample_rate), &map);
+                      enif_make_int(env, ctx->decoder.output_sample_rate),
+                      &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "sample_format"),
+                      enif_make_string(env,
+                                       av_get_sample_fmt_name(
+                                           ctx->decoder.output_sample_format),
+                                       ERL_NIF_UTF8),
+                      &map);
+    // 0 when the frames of the codec are output as they are.
+    enif_make_map_put(env, map, enif_make_atom(env, "chunk_samples"),
+                      enif_make_int(env, ctx->decoder.chunk_samples), &map);
+  }
+
+  if (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+    // The output format, or the one of the codec where it is not set.
+    // Fields still unknown are 0 and nil.
+    enum AVPixelFormat pixel_format =
+        ctx->decoder.output_pixel_format != AV_PIX_FMT_NONE
+            ? ctx->decoder.output_pixel_format
+            : codec_ctx->pix_fmt;
+
+    enif_make_map_put(env, map, enif_make_atom(env, "width"),
+                      enif_make_int(env, ctx->decoder.output_width
+                                             ? ctx->decoder.output_width
+                                             : codec_ctx->width),
+                      &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "height"),
+                      enif_make_int(env, ctx->decoder.output_height
+                                             ? ctx->decoder.output_height
+                                             : codec_ctx->height),
+                      &map);
     enif_make_map_put(
-        env, map, enif_make_atom(env, "sample_format"),
-        enif_make_string(env, av_get_sample_fmt_name(ctx->output_sample_format),
-                         ERL_NIF_UTF8),
+        env, map, enif_make_atom(env, "pixel_format"),
+        pixel_format != AV_PIX_FMT_NONE
+            ? enif_make_string(env, av_get_pix_fmt_name(pixel_format),
+                               ERL_NIF_UTF8)
+            : enif_make_atom(env, "nil"),
         &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "framerate"),
+                      make_rational(env, codec_ctx->framerate), &map);
   }
 
   return map;
 }
 
-ERL_NIF_TERM decoder_add_data(ErlNifEnv *env, int argc,
-                              const ERL_NIF_TERM argv[]) {
-  DecoderContext *ctx;
-  AVPacket *ipacket, *packet;
+// The keys of packet and frame maps, made once per call rather than once
+// per packet.
+typedef struct {
+  ERL_NIF_TERM data;
+  ERL_NIF_TERM pts;
+  ERL_NIF_TERM dts;
+} DecodeKeys;
+
+void make_decode_keys(ErlNifEnv *env, DecodeKeys *keys) {
+  keys->data = enif_make_atom(env, "data");
+  keys->pts = enif_make_atom(env, "pts");
+  keys->dts = enif_make_atom(env, "dts");
+}
+
+// Returns the data of a decoded picture. Pictures whose planes are packed
+// in their first buffer, such as the ones of the scaler, are exported
+// without copying like audio frames. The others are copied in the same
+// layout.
+ERL_NIF_TERM make_picture_data(ErlNifEnv *env, AVFrame *frame) {
+  ERL_NIF_TERM data;
+  uint8_t *ptr;
+  int size;
+
+  if ((size = decoder_picture_size(frame)))
+    return make_buffer_ref_binary(env, &frame->buf[0], frame->data[0], size);
+
+  size = av_image_get_buffer_size(frame->format, frame->width, frame->height,
+                                  1);
+  ptr = enif_make_new_binary(env, size > 0 ? size : 0, &data);
+  if (size > 0)
+    av_image_copy_to_buffer(ptr, size, (const uint8_t *const *)frame->data,
+                            frame->linesize, frame->format, frame->width,
+                            frame->height, 1);
+
+  return data;
+}
+
+// Returns the samples of a decoded audio frame. The samples of packed
+// formats are contiguous in the first plane, which is exported without
+// copying: the binary takes over the frame's buffer reference and keeps
+// it alive until it is garbage collected. Planar data is copied plane
+// after plane.
+ERL_NIF_TERM make_audio_data(ErlNifEnv *env, AVFrame *frame) {
+  ERL_NIF_TERM data;
+  AVBufferRef *ref;
+  int size, planes;
+
+  size = av_samples_get_buffer_size(NULL, frame->ch_layout.nb_channels,
+                                    frame->nb_samples, frame->format, 1);
+  planes = av_sample_fmt_is_planar(frame->format)
+               ? frame->ch_layout.nb_channels
+               : 1;
+  ref = frame->buf[0];
+
+  if (planes == 1 && ref && frame->data[0] >= ref->data &&
+      frame->data[0] + size <= ref->data + ref->size)
+    return make_buffer_ref_binary(env, &frame->buf[0], frame->data[0], size);
+
+  uint8_t *ptr = enif_make_new_binary(env, size, &data);
+  int plane_size = size / planes;
+
+  for (int i = 0; i < planes; i++)
+    memcpy(ptr + i * plane_size, frame->extended_data[i], plane_size);
+
+  return data;
+}
+
+// Builds the map describing a decoded frame. Only pictures have a size.
+ERL_NIF_TERM make_frame_map(ErlNifEnv *env, AVFrame *frame,
+                            const DecodeKeys *keys) {
+  ERL_NIF_TERM map, map_keys[2], values[2];
+  int64_t pts;
+
+  pts = frame->pts != AV_NOPTS_VALUE ? frame->pts
+                                      : frame->best_effort_timestamp;
+
+  map_keys[0] = keys->pts;
+  values[0] = enif_make_long(env, pts);
+  map_keys[1] = keys->data;
+  values[1] = frame->width ? make_picture_data(env, frame)
+                           : make_audio_data(env, frame);
+  enif_make_map_from_arrays(env, map_keys, values, 2, &map);
+
+  return map;
+}
+
+// Returned by decode_into for packet maps without binary data.
+#define AVERROR_BADARG FFERRTAG('B', 'A', 'R', 'G')
+
+// Tells whether decode_into accepts the term: a packet map with binary
+// data, or any other term, which drains the decoder.
+int is_packet_term(ErlNifEnv *env, ERL_NIF_TERM term) {
+  ERL_NIF_TERM data;
+  ErlNifBinary binary;
+
+  return !enif_is_map(env, term) ||
+         (enif_get_map_value(env, term, enif_make_atom(env, "data"), &data) &&
+          enif_inspect_binary(env, data, &binary));
+}
+
+// Sends the packet map to the decoder, or drains it when the term is not
+// a map, then prepends the frames received to list. Timestamps that are
+// missing or not integers, e.g. nil, are unknown. Returns the error of
+// decoder_send_packet, AVERROR_BADARG when the data is not a binary or
+// the last result of decoder_receive_frame.
+int decode_into(ErlNifEnv *env, DecoderContext *ctx, ERL_NIF_TERM packet_term,
+                const DecodeKeys *keys, ERL_NIF_TERM *list, int *nb_frames) {
   AVFrame *frame;
   ErlNifBinary binary;
   ERL_NIF_TERM map_value;
+  ErlNifTime started;
+  ErlNifSInt64 pts, dts;
+  int ret;
+
+  if (enif_is_map(env, packet_term)) {
+    if (!enif_get_map_value(env, packet_term, keys->data, &map_value) ||
+        !enif_inspect_binary(env, map_value, &binary))
+      return AVERROR_BADARG;
+
+    pts = dts = AV_NOPTS_VALUE;
+    if (enif_get_map_value(env, packet_term, keys->pts, &map_value) &&
+        !enif_get_int64(env, map_value, &pts))
+      pts = AV_NOPTS_VALUE;
+    if (enif_get_map_value(env, packet_term, keys->dts, &map_value) &&
+        !enif_get_int64(env, map_value, &dts))
+      dts = AV_NOPTS_VALUE;
+  }
+
+  started = enif_monotonic_time(ERL_NIF_NSEC);
+
+  if (enif_is_map(env, packet_term))
+    ret = decoder_send_packet(&ctx->decoder, binary.data, binary.size, pts,
+                              dts);
+  else
+    ret = decoder_send_packet(&ctx->decoder, NULL, 0, AV_NOPTS_VALUE,
+                              AV_NOPTS_VALUE);
+
+  // The frames pending in the decoder were received by the previous call,
+  // hence it cannot be full.
+  if (ret >= 0) {
+    while ((ret = decoder_receive_frame(&ctx->decoder, &frame)) == 0) {
+      *list =
+          enif_make_list_cell(env, make_frame_map(env, frame, keys), *list);
+      *nb_frames += 1;
+    }
+  }
+
+  ctx->decoder.stats.decode_time +=
+      enif_monotonic_time(ERL_NIF_NSEC) - started;
+
+  enif_mutex_lock(ctx->lock);
+  ctx->stats = ctx->decoder.stats;
+  enif_mutex_unlock(ctx->lock);
+
+  return ret;
+}
+
+// Decodes the packet map (or nil, which drains the decoder) and returns
+// the {:ok | :eof, frames} / {:error, reason} term built in env. The
+// :flush atom resets the decoder instead and returns {:flushed, []}. The number
+// of frames produced is stored in nb_frames. Callers must ensure that no
+// other thread is decoding with the same context.
+ERL_NIF_TERM decode_packet(ErlNifEnv *env, DecoderContext *ctx,
+                           ERL_NIF_TERM packet_term, int *nb_frames) {
+  DecodeKeys keys;
   ERL_NIF_TERM list;
   char err[256];
   int ret;
 
+  *nb_frames = 0;
+
+  if (enif_is_identical(packet_term, enif_make_atom(env, "flush"))) {
+    if ((ret = decoder_reset(&ctx->decoder)) < 0)
+      return make_av_error(env, ret);
+    return enif_make_tuple2(env, enif_make_atom(env, "flushed"),
+                            enif_make_list(env, 0));
+  }
+
+  make_decode_keys(env, &keys);
+  list = enif_make_list(env, 0);
+  // Packets decoded by a WorkerPool were checked when submitted.
+  if ((ret = decode_into(env, ctx, packet_term, &keys, &list, nb_frames)) ==
+      AVERROR_BADARG)
+    return enif_make_badarg(env);
+
+  // Frames were prepended, restore the decoding order.
+  enif_make_reverse_list(env, list, &list);
+
+  switch (ret) {
+  case 0:
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
+  case AVERROR(EAGAIN):
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
+  case AVERROR_EOF:
+    return enif_make_tuple2(env, enif_make_atom(env, "eof"), list);
+  default:
+    av_strerror(ret, err, sizeof(err));
+    return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                            enif_make_string(env, err, ERL_NIF_UTF8));
+  }
+}
+
+ERL_NIF_TERM decoder_stats(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  DecoderContext *ctx;
+  DecoderStats stats;
+  ERL_NIF_TERM map;
+
   get_decoder_context(env, argv[0], &ctx);
+  enif_mutex_lock(ctx->lock);
+  stats = ctx->stats;
+  enif_mutex_unlock(ctx->lock);
 
-  // decode the fields of the input map.
-  if ((ret = enif_get_map_value(env, argv[1], enif_make_atom(env, "data"),
-                                &map_value))) {
-    ipacket = av_packet_alloc();
-    enif_inspect_binary(env, map_value, &binary);
-    ipacket->data = binary.data;
-    ipacket->size = binary.size;
+  map = enif_make_new_map(env);
+  enif_make_map_put(env, map, enif_make_atom(env, "packets"),
+                    enif_make_ulong(env, stats.packets), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_in"),
+                    enif_make_ulong(env, stats.bytes_in), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "frames"),
+                    enif_make_ulong(env, stats.frames), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "errors"),
+                    enif_make_ulong(env, stats.errors), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "nif_time"),
+                    enif_make_int64(env, stats.decode_time), &map);
+  put_memory_stats(env, &ctx->decoder.arena, &map);
 
-    enif_get_map_value(env, argv[1], enif_make_atom(env, "pts"), &map_value);
-    enif_get_int64(env, map_value, (long *)&ipacket->pts);
+  return map;
+}
 
-    enif_get_map_value(env, argv[1], enif_make_atom(env, "dts"), &map_value);
-    enif_get_int64(env, map_value, (long *)&ipacket->dts);
+// Reports the memory of the decoder, packets waiting in a WorkerPool
+// included.
+ERL_NIF_TERM decoder_memory(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  DecoderContext *ctx;
 
-    packet = av_packet_alloc();
-    av_packet_ref(packet, ipacket);
-    av_packet_free(&ipacket);
+  get_decoder_context(env, argv[0], &ctx);
+  return make_memory_map(env, &ctx->decoder.arena);
+}
 
-    avcodec_send_packet(ctx->codec_ctx, packet);
-    av_packet_unref(packet);
-  } else {
-    // This is a "drain" packet, i.e. NULL.
-    avcodec_send_packet(ctx->codec_ctx, NULL);
-  };
+ERL_NIF_TERM decoder_add_data(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  DecoderContext *ctx;
+  int nb_frames;
 
-  list = enif_make_list(env, 0);
-  frame = av_frame_alloc();
-  while ((ret = avcodec_receive_frame(ctx->codec_ctx, frame)) == 0) {
-    enum AVSampleFormat actual_format = frame->format;
+  get_decoder_context(env, argv[0], &ctx);
+  return decode_packet(env, ctx, argv[1], &nb_frames);
+}
+
+// Decodes a list of packet maps and returns {:ok, frames} with the frames
+// of every packet, in decoding order, or {:error, reason, frames} with the
+// frames of the packets preceding the one that failed. On normal
+// schedulers, the call yields once its timeslice is used up and is
+// continued with the packets left and the frames decoded so far.
+ERL_NIF_TERM decoder_add_packets(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  DecoderContext *ctx;
+  DecodeKeys keys;
+  ERL_NIF_TERM packets, packet, list;
+  ERL_NIF_TERM args[3];
+  ErlNifTime started, now;
+  int nb_frames = 0, ret, percent, yield;
+
+  get_decoder_context(env, argv[0], &ctx);
+  if (!enif_is_list(env, argv[1]))
+    return enif_make_badarg(env);
+
+  packets = argv[1];
+  list = argc == 3 ? argv[2] : enif_make_list(env, 0);
+  yield = enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER;
+  make_decode_keys(env, &keys);
+  started = enif_monotonic_time(ERL_NIF_USEC);
+
+  while (enif_get_list_cell(env, packets, &packet, &packets)) {
+    // The end of stream goes through decoder_add_data.
+    if (!enif_is_map(env, packet))
+      return enif_make_badarg(env);
+
+    if ((ret = decode_into(env, ctx, packet, &keys, &list, &nb_frames)) ==
+        AVERROR_BADARG)
+      return enif_make_badarg(env);
+    if (ret != AVERROR(EAGAIN)) {
+      enif_make_reverse_list(env, list, &list);
+      return enif_make_tuple3(env, enif_make_atom(env, "error"),
+                              make_av_error_reason(env, ret), list);
+    }
+
+    if (!yield)
+      continue;
+
+    // A timeslice is roughly 1ms.
+    now = enif_monotonic_time(ERL_NIF_USEC);
+    percent = (now - started) / 10;
+    if (percent > 0) {
+      started = now;
+      if (enif_consume_timeslice(env, percent > 100 ? 100 : percent)) {
+        args[0] = argv[0];
+        args[1] = packets;
+        args[2] = list;
+        return enif_schedule_nif(env, "decoder_add_packets", 0,
+                                 decoder_add_packets, 3, args);
+      }
+    }
+  }
+
+  // Frames were prepended, restore the decoding order.
+  enif_make_reverse_list(env, list, &list);
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
+}
+
+// A fixed set of native threads decoding packets on behalf of any number
+// of decoders, keeping the BEAM schedulers free. Decoded frames are sent
+// back to the process that submitted the packet.
+typedef struct WorkerPool {
+  ErlNifMutex *lock;
+  ErlNifCond *cond;
+  ErlNifTid *threads;
+  int nb_threads;
+  int shutdown;
+  // Set by worker_pool_close, which joins the threads.
+  int closed;
+  // Next pool waiting for the reaper to join its threads.
+  struct WorkerPool *next_reaped;
+  // Submissions fail with AVERROR(EBUSY) once this many jobs are queued,
+  // with AVERROR(E2BIG) when they would not fit in an empty queue.
+  u_long max_jobs;
+
+  // Run queue of the decoder contexts that have pending jobs.
+  DecoderContext *ready_head;
+  DecoderContext *ready_tail;
+
+  // Metrics, guarded by lock.
+  int busy_threads;
+  u_long queued;
+  u_long max_queued;
+  u_long submitted;
+  u_long completed;
+  u_long frames;
+  // Cumulative time spent decoding and waiting in the queue.
+  ErlNifTime busy_time;
+  ErlNifTime wait_time;
+} WorkerPool;
+
+void worker_pool_push(WorkerPool *pool, DecoderContext *ctx) {
+  ctx->next_ready = NULL;
+  if (pool->ready_tail)
+    pool->ready_tail->next_ready = ctx;
+  else
+    pool->ready_head = ctx;
+  pool->ready_tail = ctx;
+}
+
+DecoderContext *worker_pool_pop(WorkerPool *pool) {
+  DecoderContext *ctx;
 
-    if (ctx->resampler_ctx) {
-      AVFrame *resampled_frame;
-      resampled_frame = av_frame_alloc();
-      resampled_frame->nb_samples = frame->nb_samples;
-      resampled_frame->ch_layout = frame->ch_layout;
-      resampled_frame->sample_rate = frame->sample_rate;
-      resampled_frame->format = ctx->output_sample_format;
+  ctx = pool->ready_head;
+  pool->ready_head = ctx->next_ready;
+  if (!pool->ready_head)
+    pool->ready_tail = NULL;
+  ctx->next_ready = NULL;
 
-      av_frame_get_buffer(resampled_frame, 0);
+  return ctx;
+}
 
-      swr_convert_frame(ctx->resampler_ctx, resampled_frame, frame);
-      resampled_frame->pts = frame->pts;
+void *worker_pool_run(void *arg) {
+  WorkerPool *pool = (WorkerPool *)arg;
+  DecoderContext *ctx;
+  DecodeJob *job;
+  ERL_NIF_TERM reply;
+  ErlNifTime started, finished;
+  int nb_frames;
+
+  enif_mutex_lock(pool->lock);
+  for (;;) {
+    while (!pool->ready_head && !pool->shutdown)
+      enif_cond_wait(pool->cond, pool->lock);
+
+    // Pending jobs are drained before shutting down.
+    if (!pool->ready_head)
+      break;
 
-      av_frame_unref(frame);
-      frame = resampled_frame;
+    ctx = worker_pool_pop(pool);
+    pool->busy_threads++;
+    enif_mutex_unlock(pool->lock);
+
+    enif_mutex_lock(ctx->lock);
+    job = ctx->jobs_head;
+    ctx->jobs_head = job->next;
+    if (!ctx->jobs_head)
+      ctx->jobs_tail = NULL;
+    enif_mutex_unlock(ctx->lock);
+
+    started = enif_monotonic_time(ERL_NIF_NSEC);
+    reply = decode_packet(job->env, ctx, job->packet, &nb_frames);
+    reply = enif_make_tuple3(job->env, enif_make_atom(job->env, "libav_decoder"),
+                             job->tag, reply);
+    enif_send(NULL, &job->owner, job->env, reply);
+    finished = enif_monotonic_time(ERL_NIF_NSEC);
+
+    enif_mutex_lock(pool->lock);
+    pool->busy_threads--;
+    pool->queued--;
+    pool->completed++;
+    pool->frames += nb_frames;
+    pool->busy_time += finished - started;
+    pool->wait_time += started - job->enqueued_at;
+
+    // Put the context back in the run queue if more packets arrived in
+    // the meantime, otherwise the next submission will schedule it.
+    enif_mutex_lock(ctx->lock);
+    if (ctx->jobs_head) {
+      worker_pool_push(pool, ctx);
+      enif_cond_signal(pool->cond);
+    } else {
+      ctx->scheduled = 0;
     }
+    enif_mutex_unlock(ctx->lock);
+    enif_mutex_unlock(pool->lock);
+
+    // Might free the decoder context, do it without holding the lock.
+    enif_free_env(job->env);
+    arena_release(&ctx->decoder.arena, job->charge);
+    enif_release_resource(job->ctx_res);
+    enif_free(job);
+
+    enif_mutex_lock(pool->lock);
+  }
+  enif_mutex_unlock(pool->lock);
+
+  return NULL;
+}
+
+// Tells the threads to exit once the queued jobs are done. Returns 0 when
+// the pool was already stopped.
+int worker_pool_stop(WorkerPool *pool) {
+  int stopped;
+
+  enif_mutex_lock(pool->lock);
+  stopped = pool->shutdown;
+  pool->shutdown = 1;
+  enif_cond_broadcast(pool->cond);
+  enif_mutex_unlock(pool->lock);
+
+  return !stopped;
+}
+
+void worker_pool_free(WorkerPool *pool) {
+  enif_cond_destroy(pool->cond);
+  enif_mutex_destroy(pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+// Joins the threads of the pools garbage collected without being closed,
+// which may still have jobs to decode, rather than holding up the
+// scheduler running their destructor. The library starts it on load and
+// joins it on unload, once every pool handed over is freed.
+typedef struct {
+  ErlNifMutex *lock;
+  ErlNifCond *cond;
+  ErlNifTid tid;
+  WorkerPool *pools;
+  int shutdown;
+} PoolReaper;
+
+void *pool_reaper_run(void *arg) {
+  PoolReaper *reaper = (PoolReaper *)arg;
+  WorkerPool *pool;
+
+  enif_mutex_lock(reaper->lock);
+  for (;;) {
+    while (!reaper->pools && !reaper->shutdown)
+      enif_cond_wait(reaper->cond, reaper->lock);
+
+    if (!(pool = reaper->pools))
+      break;
+    reaper->pools = pool->next_reaped;
+    enif_mutex_unlock(reaper->lock);
+
+    for (int i = 0; i < pool->nb_threads; i++)
+      enif_thread_join(pool->threads[i], NULL);
+    worker_pool_free(pool);
 
-    AVBufferRef *ref;
-    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
-      if (!(ref = frame->buf[i]))
-        break;
-
-      ERL_NIF_TERM data;
-      ERL_NIF_TERM map;
-
-      void *ptr = enif_make_new_binary(env, ref->size, &data);
-      memcpy(ptr, ref->data, ref->size);
-
-      // Create a frame map with the data contained in each
-      // buffer reference.
-      map = enif_make_new_map(env);
-      // TODO
-      // each frame map created here will have the same pts value.
-      // To solve, we might divide frame->duration with the number of
-      // buffers found duration this process.
-      enif_make_map_put(env, map, enif_make_atom(env, "pts"),
-                        enif_make_long(env, frame->pts), &map);
-      enif_make_map_put(env, map, enif_make_atom(env, "data"), data, &map);
-
-      list = enif_make_list_cell(env, map, list);
+    enif_mutex_lock(reaper->lock);
+  }
+  enif_mutex_unlock(reaper->lock);
+
+  return NULL;
+}
+
+int pool_reaper_start(PoolReaper *reaper) {
+  reaper->lock = enif_mutex_create("libav_pool_reaper");
+  reaper->cond = enif_cond_create("libav_pool_reaper");
+  reaper->pools = NULL;
+  reaper->shutdown = 0;
+
+  if (enif_thread_create("libav_pool_reaper", &reaper->tid, pool_reaper_run,
+                         reaper, NULL)) {
+    enif_cond_destroy(reaper->cond);
+    enif_mutex_destroy(reaper->lock);
+    return -1;
+  }
+
+  return 0;
+}
+
+void pool_reaper_stop(PoolReaper *reaper) {
+  enif_mutex_lock(reaper->lock);
+  reaper->shutdown = 1;
+  enif_cond_signal(reaper->cond);
+  enif_mutex_unlock(reaper->lock);
+
+  enif_thread_join(reaper->tid, NULL);
+  enif_cond_destroy(reaper->cond);
+  enif_mutex_destroy(reaper->lock);
+}
+
+void free_worker_pool_res(ErlNifEnv *env, void *res) {
+  WorkerPool *pool = *(WorkerPool **)res;
+  PoolReaper *reaper = (PoolReaper *)enif_priv_data(env);
+
+  if (pool->closed) {
+    worker_pool_free(pool);
+    return;
+  }
+
+  worker_pool_stop(pool);
+  enif_mutex_lock(reaper->lock);
+  pool->next_reaped = reaper->pools;
+  reaper->pools = pool;
+  enif_cond_signal(reaper->cond);
+  enif_mutex_unlock(reaper->lock);
+}
+
+void get_worker_pool(ErlNifEnv *env, ERL_NIF_TERM term, WorkerPool **pool) {
+  WorkerPool **pool_res;
+  enif_get_resource(env, term, WORKER_POOL_RES_TYPE, (void *)&pool_res);
+  *pool = *pool_res;
+}
+
+// Starts a pool of nb_threads threads, queuing at most max_jobs packets.
+ERL_NIF_TERM worker_pool_alloc(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  WorkerPool *pool;
+  unsigned long max_jobs;
+  int nb_threads;
+
+  if (!enif_get_int(env, argv[0], &nb_threads) || nb_threads <= 0 ||
+      !enif_get_ulong(env, argv[1], &max_jobs) || max_jobs == 0)
+    return enif_make_badarg(env);
+
+  pool = (WorkerPool *)calloc(1, sizeof(WorkerPool));
+  pool->max_jobs = max_jobs;
+  pool->lock = enif_mutex_create("libav_worker_pool");
+  pool->cond = enif_cond_create("libav_worker_pool");
+  pool->threads = (ErlNifTid *)calloc(nb_threads, sizeof(ErlNifTid));
+
+  for (int i = 0; i < nb_threads; i++) {
+    if (enif_thread_create("libav_worker", &pool->threads[i], worker_pool_run,
+                           pool, NULL))
+      break;
+    pool->nb_threads++;
+  }
+
+  // Make the resource take ownership on the pool. Even if some threads could
+  // not be started, the destructor joins the ones that are running.
+  WorkerPool **pool_res =
+      enif_alloc_resource(WORKER_POOL_RES_TYPE, sizeof(WorkerPool *));
+  *pool_res = pool;
+
+  ERL_NIF_TERM term = enif_make_resource(env, pool_res);
+  enif_release_resource(pool_res);
+
+  if (pool->nb_threads == 0)
+    return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                            enif_make_atom(env, "thread_create"));
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+// Stops the pool once the packets already queued are decoded, waiting for
+// its threads to exit. Runs on a dirty IO scheduler.
+ERL_NIF_TERM worker_pool_close(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  WorkerPool *pool;
+
+  get_worker_pool(env, argv[0], &pool);
+
+  if (worker_pool_stop(pool)) {
+    for (int i = 0; i < pool->nb_threads; i++)
+      enif_thread_join(pool->threads[i], NULL);
+    pool->closed = 1;
+  }
+
+  return enif_make_atom(env, "ok");
+}
+
+ERL_NIF_TERM worker_pool_stats(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  WorkerPool *pool;
+  ERL_NIF_TERM map;
+
+  get_worker_pool(env, argv[0], &pool);
+  map = enif_make_new_map(env);
+
+  enif_mutex_lock(pool->lock);
+  enif_make_map_put(env, map, enif_make_atom(env, "threads"),
+                    enif_make_int(env, pool->nb_threads), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "busy_threads"),
+                    enif_make_int(env, pool->busy_threads), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "queued"),
+                    enif_make_ulong(env, pool->queued), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "max_queued"),
+                    enif_make_ulong(env, pool->max_queued), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "max_jobs"),
+                    enif_make_ulong(env, pool->max_jobs), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "submitted"),
+                    enif_make_ulong(env, pool->submitted), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "completed"),
+                    enif_make_ulong(env, pool->completed), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "frames"),
+                    enif_make_ulong(env, pool->frames), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "busy_time"),
+                    enif_make_int64(env, pool->busy_time), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "wait_time"),
+                    enif_make_int64(env, pool->wait_time), &map);
+  enif_mutex_unlock(pool->lock);
+
+  return map;
+}
+
+// Returns the bytes a job holds on to until it is done: the job itself and
+// the payload of its packet.
+size_t decode_job_charge(ErlNifEnv *env, ERL_NIF_TERM packet) {
+  ERL_NIF_TERM data;
+  ErlNifBinary binary;
+  size_t charge = sizeof(DecodeJob);
+
+  if (enif_is_map(env, packet) &&
+      enif_get_map_value(env, packet, enif_make_atom(env, "data"), &data) &&
+      enif_inspect_binary(env, data, &binary))
+    charge += binary.size;
+
+  return charge;
+}
+
+// Takes nb_jobs slots in the queue of the pool. Returns 0, AVERROR(EBUSY)
+// when they are not available yet, AVERROR(E2BIG) when they never will be
+// or AVERROR_EOF once the pool is stopped.
+int worker_pool_reserve(WorkerPool *pool, u_long nb_jobs) {
+  int ret = 0;
+
+  enif_mutex_lock(pool->lock);
+  if (pool->shutdown) {
+    ret = AVERROR_EOF;
+  } else if (nb_jobs > pool->max_jobs) {
+    ret = AVERROR(E2BIG);
+  } else if (pool->queued + nb_jobs > pool->max_jobs) {
+    ret = AVERROR(EBUSY);
+  } else {
+    pool->queued += nb_jobs;
+    pool->submitted += nb_jobs;
+    if (pool->queued > pool->max_queued)
+      pool->max_queued = pool->queued;
+  }
+  enif_mutex_unlock(pool->lock);
+
+  return ret;
+}
+
+void worker_pool_unreserve(WorkerPool *pool, u_long nb_jobs) {
+  enif_mutex_lock(pool->lock);
+  pool->queued -= nb_jobs;
+  pool->submitted -= nb_jobs;
+  enif_mutex_unlock(pool->lock);
+}
+
+// Returns -1 when the context was submitted to another pool than this
+// one before, 0 otherwise.
+int decoder_check_pool(DecoderContext *ctx, WorkerPool *pool) {
+  int mismatch;
+
+  enif_mutex_lock(ctx->lock);
+  mismatch = ctx->pool && ctx->pool != pool;
+  enif_mutex_unlock(ctx->lock);
+
+  return mismatch ? -1 : 0;
+}
+
+// Queues the packet term for decoding on the pool, which has a slot
+// reserved for it, as the arena of the decoder has the charge of the job.
+// Returns 0, -1 when the context was submitted to another pool before or
+// AVERROR(ENOMEM), in which case the caller still holds the reservations.
+int decoder_enqueue(ErlNifEnv *env, WorkerPool *pool, DecoderContext **ctx_res,
+                    ERL_NIF_TERM packet, ERL_NIF_TERM tag, size_t charge) {
+  DecoderContext *ctx = *ctx_res;
+  DecodeJob *job;
+  int schedule;
+
+  if (!(job = (DecodeJob *)enif_alloc(sizeof(DecodeJob))))
+    return AVERROR(ENOMEM);
+  job->charge = charge;
+  job->env = enif_alloc_env();
+  job->packet = enif_make_copy(job->env, packet);
+  job->tag = enif_make_copy(job->env, tag);
+  job->ctx_res = ctx_res;
+  job->next = NULL;
+  enif_self(env, &job->owner);
+
+  enif_mutex_lock(ctx->lock);
+  if (ctx->pool && ctx->pool != pool) {
+    enif_mutex_unlock(ctx->lock);
+    enif_free_env(job->env);
+    enif_free(job);
+    return -1;
+  }
+
+  enif_keep_resource(ctx_res);
+  ctx->pool = pool;
+  if (ctx->jobs_tail)
+    ctx->jobs_tail->next = job;
+  else
+    ctx->jobs_head = job;
+  ctx->jobs_tail = job;
+
+  schedule = !ctx->scheduled;
+  ctx->scheduled = 1;
+  enif_mutex_unlock(ctx->lock);
+
+  enif_mutex_lock(pool->lock);
+  job->enqueued_at = enif_monotonic_time(ERL_NIF_NSEC);
+  if (schedule) {
+    worker_pool_push(pool, ctx);
+    enif_cond_signal(pool->cond);
+  }
+  enif_mutex_unlock(pool->lock);
+
+  return 0;
+}
+
+// Queues the packet term for decoding on the pool. The frames are
+// delivered to the calling process as {:libav_decoder, tag, result}
+// messages. Returns 0, -1 when the context was submitted to another pool
+// before, AVERROR(EBUSY) when the queue of the pool is full, AVERROR_EOF
+// when the pool is closed or AVERROR_MEMORY_LIMIT when the packet does not
+// fit in the arena of the decoder along with the ones already queued.
+int decoder_submit(ErlNifEnv *env, WorkerPool *pool, DecoderContext **ctx_res,
+                   ERL_NIF_TERM packet, ERL_NIF_TERM tag) {
+  DecoderContext *ctx = *ctx_res;
+  size_t charge;
+  int ret;
+
+  if ((ret = worker_pool_reserve(pool, 1)))
+    return ret;
+
+  charge = decode_job_charge(env, packet);
+  if (arena_reserve(&ctx->decoder.arena, charge)) {
+    worker_pool_unreserve(pool, 1);
+    return AVERROR_MEMORY_LIMIT;
+  }
+
+  if ((ret = decoder_enqueue(env, pool, ctx_res, packet, tag, charge))) {
+    arena_release(&ctx->decoder.arena, charge);
+    worker_pool_unreserve(pool, 1);
+  }
+
+  return ret;
+}
+
+ERL_NIF_TERM make_submit_error(ErlNifEnv *env, int errnum) {
+  const char *reason;
+
+  if (errnum == AVERROR_MEMORY_LIMIT)
+    return make_av_error(env, errnum);
+
+  if (errnum == AVERROR(EBUSY))
+    reason = "busy";
+  else if (errnum == AVERROR(E2BIG))
+    reason = "batch_too_large";
+  else if (errnum == AVERROR_EOF)
+    reason = "closed";
+  else if (errnum == -1)
+    reason = "pool_mismatch";
+  else
+    return make_av_error(env, errnum);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                          enif_make_atom(env, reason));
+}
+
+// Queues the packet for decoding on the pool. The frames are delivered
+// to the calling process as {:libav_decoder, ctx, result} messages, where
+// result is what decoder_add_data would have returned.
+ERL_NIF_TERM decoder_add_data_async(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  WorkerPool *pool;
+  DecoderContext **ctx_res;
+  int errnum;
+
+  get_worker_pool(env, argv[0], &pool);
+  enif_get_resource(env, argv[1], DECODER_CTX_RES_TYPE, (void *)&ctx_res);
+  if (!is_packet_term(env, argv[2]))
+    return enif_make_badarg(env);
+
+  if ((errnum = decoder_submit(env, pool, ctx_res, argv[2], argv[1])))
+    return make_submit_error(env, errnum);
+
+  return enif_make_atom(env, "ok");
+}
+
+// The decoders of several streams sharing a WorkerPool. Packets of any
+// stream are fanned out to the job queues of their decoder in a single
+// call: the streams are decoded in parallel by the pool threads, while each
+// decoder still sees its packets in order.
+typedef struct {
+  // Kept alive as long as the context.
+  WorkerPool **pool_res;
+  // The decoder resources by stream index, NULL for unknown streams.
+  DecoderContext ***decoders;
+  int nb_decoders;
+} MultiDecoder;
+
+void free_multi_decoder_res(ErlNifEnv *env, void *res) {
+  MultiDecoder *multi = *(MultiDecoder **)res;
+
+  // Pending jobs keep their own reference on the decoders.
+  for (int i = 0; i < multi->nb_decoders; i++)
+    if (multi->decoders[i])
+      enif_release_resource(multi->decoders[i]);
+  enif_release_resource(multi->pool_res);
+  free(multi->decoders);
+  free(multi);
+}
+
+void get_multi_decoder(ErlNifEnv *env, ERL_NIF_TERM term,
+                       MultiDecoder **multi) {
+  MultiDecoder **multi_res;
+  enif_get_resource(env, term, MULTI_DECODER_RES_TYPE, (void *)&multi_res);
+  *multi = *multi_res;
+}
+
+ERL_NIF_TERM multi_decoder_alloc(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  WorkerPool **pool_res;
+  MultiDecoder *multi;
+
+  if (!enif_get_resource(env, argv[0], WORKER_POOL_RES_TYPE,
+                         (void *)&pool_res))
+    return enif_make_badarg(env);
+
+  multi = (MultiDecoder *)calloc(1, sizeof(MultiDecoder));
+  multi->pool_res = pool_res;
+  enif_keep_resource(pool_res);
+
+  MultiDecoder **multi_res =
+      enif_alloc_resource(MULTI_DECODER_RES_TYPE, sizeof(MultiDecoder *));
+  *multi_res = multi;
+
+  ERL_NIF_TERM term = enif_make_resource(env, multi_res);
+  enif_release_resource(multi_res);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+// Assigns the decoder to the stream, which must not have one yet.
+ERL_NIF_TERM multi_decoder_add_stream(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  MultiDecoder *multi;
+  DecoderContext **ctx_res;
+  int index;
+
+  get_multi_decoder(env, argv[0], &multi);
+  if (!enif_get_int(env, argv[1], &index) || index < 0 ||
+      !enif_get_resource(env, argv[2], DECODER_CTX_RES_TYPE,
+                         (void *)&ctx_res))
+    return enif_make_badarg(env);
+
+  if (index >= multi->nb_decoders) {
+    multi->decoders = (DecoderContext ***)realloc(
+        multi->decoders, (index + 1) * sizeof(DecoderContext **));
+    memset(multi->decoders + multi->nb_decoders, 0,
+           (index + 1 - multi->nb_decoders) * sizeof(DecoderContext **));
+    multi->nb_decoders = index + 1;
+  }
+
+  if (multi->decoders[index])
+    return enif_make_badarg(env);
+
+  enif_keep_resource(ctx_res);
+  multi->decoders[index] = ctx_res;
+
+  return enif_make_atom(env, "ok");
+}
+
+// Queues a list of {stream_index, packet} entries, where packet is what
+// decoder_add_data accepts. The frames are delivered to the calling process
+// as {:libav_decoder, stream_index, result} messages. The batch is queued
+// as a whole or not at all, both by the pool and by the memory limits of
+// the decoders: a batch larger than the queue of the pool is refused with
+// {:error, :batch_too_large}. Should queuing a job fail, the packets queued
+// before it are still decoded.
+ERL_NIF_TERM multi_decoder_add_packets(ErlNifEnv *env, int argc,
+                                       const ERL_NIF_TERM argv[]) {
+  MultiDecoder *multi;
+  WorkerPool *pool;
+  DecoderContext **ctx_res;
+  ERL_NIF_TERM list, head;
+  const ERL_NIF_TERM *entry;
+  u_long nb_packets = 0;
+  size_t *charges, charge;
+  int arity, index, errnum, i;
+
+  get_multi_decoder(env, argv[0], &multi);
+  pool = *multi->pool_res;
+
+  // Validate the whole batch before queuing any of it.
+  for (list = argv[1]; enif_get_list_cell(env, list, &head, &list);) {
+    if (!enif_get_tuple(env, head, &arity, &entry) || arity != 2 ||
+        !enif_get_int(env, entry[0], &index) || index < 0 ||
+        index >= multi->nb_decoders || !multi->decoders[index] ||
+        !is_packet_term(env, entry[1]))
+      return enif_make_badarg(env);
+    if (decoder_check_pool(*multi->decoders[index], pool))
+      return make_submit_error(env, -1);
+    nb_packets++;
+  }
+  if (!enif_is_empty_list(env, list))
+    return enif_make_badarg(env);
+
+  // The share of the batch of each decoder.
+  if (!(charges = (size_t *)calloc(multi->nb_decoders, sizeof(size_t))))
+    return make_av_error(env, AVERROR(ENOMEM));
+  for (list = argv[1]; enif_get_list_cell(env, list, &head, &list);) {
+    enif_get_tuple(env, head, &arity, &entry);
+    enif_get_int(env, entry[0], &index);
+    charges[index] += decode_job_charge(env, entry[1]);
+  }
+
+  if ((errnum = worker_pool_reserve(pool, nb_packets))) {
+    free(charges);
+    return make_submit_error(env, errnum);
+  }
+
+  for (i = 0; i < multi->nb_decoders; i++)
+    if (charges[i] &&
+        arena_reserve(&(*multi->decoders[i])->decoder.arena, charges[i]))
+      break;
+
+  if (i < multi->nb_decoders) {
+    while (i-- > 0)
+      if (charges[i])
+        arena_release(&(*multi->decoders[i])->decoder.arena, charges[i]);
+    free(charges);
+    worker_pool_unreserve(pool, nb_packets);
+    return make_submit_error(env, AVERROR_MEMORY_LIMIT);
+  }
+  free(charges);
+
+  // Each job releases its own charge once decoded, nb_packets counts the
+  // reservations left.
+  for (list = argv[1]; enif_get_list_cell(env, list, &head, &list);
+       nb_packets--) {
+    enif_get_tuple(env, head, &arity, &entry);
+    enif_get_int(env, entry[0], &index);
+    ctx_res = multi->decoders[index];
+    charge = decode_job_charge(env, entry[1]);
+
+    if ((errnum =
+             decoder_enqueue(env, pool, ctx_res, entry[1], entry[0], charge)))
+      break;
+  }
+
+  if (errnum) {
+    arena_release(&(*ctx_res)->decoder.arena, charge);
+    while (enif_get_list_cell(env, list, &head, &list)) {
+      enif_get_tuple(env, head, &arity, &entry);
+      enif_get_int(env, entry[0], &index);
+      arena_release(&(*multi->decoders[index])->decoder.arena,
+                    decode_job_charge(env, entry[1]));
     }
-    // Reset the frame to reuse it for the next decode round.
-    av_frame_unref(frame);
+    worker_pool_unreserve(pool, nb_packets);
+    return make_submit_error(env, errnum);
   }
 
+  return enif_make_atom(env, "ok");
+}
+
+void free_encoder_context_res(ErlNifEnv *env, void *res) {
+  Encoder **enc = (Encoder **)res;
+  encoder_close(*enc);
+  free(*enc);
+}
+
+void get_encoder_context(ErlNifEnv *env, ERL_NIF_TERM term, Encoder **enc) {
+  Encoder **enc_res;
+  enif_get_resource(env, term, ENCODER_CTX_RES_TYPE, (void *)&enc_res);
+  *enc = *enc_res;
+}
+
+// Reads the encoder configuration from the options. Threading options
+// follow the decoder ones, bit_rate is in bits per second. The format of
+// the raw input is given by sample_format, sample_rate and channels for
+// audio, by pixel_format, width, height and framerate for video.
+int get_encoder_config(ErlNifEnv *env, ERL_NIF_TERM opts,
+                       EncoderConfig *config) {
+  char buf[32];
+
+  encoder_config_init(config);
+  get_rational_option(env, opts, "time_base", &config->time_base);
+
+  config->thread_count = get_int_option(env, opts, "thread_count", 0);
+  if (get_atom_option(env, opts, "thread_type", buf, sizeof(buf))) {
+    if (!strcmp(buf, "frame"))
+      config->thread_type = FF_THREAD_FRAME;
+    else if (!strcmp(buf, "slice"))
+      config->thread_type = FF_THREAD_SLICE;
+    else
+      config->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  config->bit_rate = get_int_option(env, opts, "bit_rate", 0);
+  config->global_header = get_bool_option(env, opts, "global_header", 0);
+
+  if (get_atom_option(env, opts, "sample_format", buf, sizeof(buf)) &&
+      (config->sample_format = av_get_sample_fmt(buf)) == AV_SAMPLE_FMT_NONE)
+    return AVERROR(EINVAL);
+  config->sample_rate = get_int_option(env, opts, "sample_rate", 0);
+  config->channels = get_int_option(env, opts, "channels", 0);
+
+  if (get_atom_option(env, opts, "pixel_format", buf, sizeof(buf)) &&
+      (config->pixel_format = av_get_pix_fmt(buf)) == AV_PIX_FMT_NONE)
+    return AVERROR(EINVAL);
+  config->width = get_int_option(env, opts, "width", 0);
+  config->height = get_int_option(env, opts, "height", 0);
+  get_rational_option(env, opts, "framerate", &config->framerate);
+
+  return 0;
+}
+
+ERL_NIF_TERM encoder_alloc_context(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+  char codec_name[64];
+  EncoderConfig config;
+  AVDictionary *options = NULL;
+  AVDictionaryEntry *unused;
+  Encoder *enc;
+  int errnum;
+
+  if (!enif_inspect_binary(env, argv[0], &name_bin) ||
+      name_bin.size >= sizeof(codec_name))
+    return enif_make_badarg(env);
+  memcpy(codec_name, name_bin.data, name_bin.size);
+  codec_name[name_bin.size] = 0;
+
+  if (!(enc = (Encoder *)calloc(1, sizeof(Encoder))))
+    return enif_make_tuple2(env, enif_make_atom(env, "error"),
+                            enif_make_atom(env, "enomem"));
+
+  if ((errnum = get_encoder_config(env, argv[1], &config)) ||
+      (errnum = get_dict_option(env, argv[1], "codec_options", &options)) ||
+      (errnum = encoder_open(enc, codec_name, &config, &options))) {
+    av_dict_free(&options);
+    free(enc);
+    return make_av_error(env, errnum);
+  }
+
+  if ((unused = av_dict_get(options, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+    ERL_NIF_TERM reason = enif_make_tuple2(
+        env, enif_make_atom(env, "unknown_option"),
+        enif_make_string(env, unused->key, ERL_NIF_UTF8));
+    av_dict_free(&options);
+    encoder_close(enc);
+    free(enc);
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), reason);
+  }
+  av_dict_free(&options);
+
+  Encoder **enc_res =
+      enif_alloc_resource(ENCODER_CTX_RES_TYPE, sizeof(Encoder *));
+  *enc_res = enc;
+
+  ERL_NIF_TERM term = enif_make_resource(env, enc_res);
+  enif_release_resource(enc_res);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+// Describes the encoded stream like demuxer_streams does, so that it can
+// be fed to a decoder or a muxer.
+ERL_NIF_TERM encoder_stream(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  Encoder *enc;
+  AVCodecParameters *params;
+  ERL_NIF_TERM map;
+
+  get_encoder_context(env, argv[0], &enc);
+
+  params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, enc->codec_ctx);
+  map = make_stream_map(env, params, 0, enc->codec_ctx->time_base);
+  avcodec_parameters_free(&params);
+
+  enif_make_map_put(env, map, enif_make_atom(env, "thread_count"),
+                    enif_make_int(env, enc->codec_ctx->thread_count), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "thread_type"),
+                    make_thread_type(env, enc->codec_ctx->active_thread_type),
+                    &map);
+
+  return map;
+}
+
+ERL_NIF_TERM encoder_stats(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  Encoder *enc;
+  ERL_NIF_TERM map;
+
+  get_encoder_context(env, argv[0], &enc);
+
+  map = enif_make_new_map(env);
+  enif_make_map_put(env, map, enif_make_atom(env, "frames"),
+                    enif_make_ulong(env, enc->stats.frames), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_in"),
+                    enif_make_ulong(env, enc->stats.bytes_in), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "packets"),
+                    enif_make_ulong(env, enc->stats.packets), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_out"),
+                    enif_make_ulong(env, enc->stats.bytes_out), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "errors"),
+                    enif_make_ulong(env, enc->stats.errors), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "nif_time"),
+                    enif_make_int64(env, enc->stats.encode_time), &map);
+
+  return map;
+}
+
+// Encodes the raw frame map (or nil, which drains the encoder) and returns
+// {:ok | :eof, packets} or {:error, reason}. Packet timestamps are in the
+// time base of the encoded stream.
+ERL_NIF_TERM encoder_add_data(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  Encoder *enc;
+  AVPacket *packet;
+  ErlNifBinary binary;
+  ERL_NIF_TERM map_value, list;
+  ErlNifTime started;
+  int64_t pts = AV_NOPTS_VALUE;
+  int ret;
+
+  get_encoder_context(env, argv[0], &enc);
+  started = enif_monotonic_time(ERL_NIF_NSEC);
+
+  if (enif_get_map_value(env, argv[1], enif_make_atom(env, "data"),
+                         &map_value)) {
+    if (!enif_inspect_binary(env, map_value, &binary))
+      return enif_make_badarg(env);
+
+    if (enif_get_map_value(env, argv[1], enif_make_atom(env, "pts"),
+                           &map_value))
+      enif_get_int64(env, map_value, (long *)&pts);
+
+    ret = encoder_send_frame(enc, binary.data, binary.size, pts);
+  } else {
+    ret = encoder_send_frame(enc, NULL, 0, AV_NOPTS_VALUE);
+  }
+
+  if (ret < 0) {
+    enc->stats.encode_time += enif_monotonic_time(ERL_NIF_NSEC) - started;
+    return make_av_error(env, ret);
+  }
+
+  list = enif_make_list(env, 0);
+  while ((ret = encoder_receive_packet(enc, &packet)) == 0)
+    list = enif_make_list_cell(env, make_packet_map(env, packet, 1), list);
+
+  enc->stats.encode_time += enif_monotonic_time(ERL_NIF_NSEC) - started;
+
+  // Packets were prepended, restore the encoding order.
+  enif_make_reverse_list(env, list, &list);
+
   switch (ret) {
-  case 0:
-    return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
   case AVERROR(EAGAIN):
     return enif_make_tuple2(env, enif_make_atom(env, "ok"), list);
   case AVERROR_EOF:
     return enif_make_tuple2(env, enif_make_atom(env, "eof"), list);
   default:
-    av_strerror(ret, err, sizeof(err));
-    return enif_make_tuple2(env, enif_make_atom(env, "error"),
-                            enif_make_string(env, err, ERL_NIF_UTF8));
+    return make_av_error(env, ret);
   }
 }
 
+void free_muxer_context_res(ErlNifEnv *env, void *res) {
+  muxer_free(*(Muxer **)res);
+}
+
+void get_muxer_context(ErlNifEnv *env, ERL_NIF_TERM term, Muxer **mux) {
+  Muxer **mux_res;
+  enif_get_resource(env, term, MUXER_CTX_RES_TYPE, (void *)&mux_res);
+  *mux = *mux_res;
+}
+
+// Returns {:ok, output}, where output is the binary written by the muxer
+// since the last call, or the libav error.
+ERL_NIF_TERM make_muxer_result(ErlNifEnv *env, Muxer *mux, int errnum) {
+  ErlNifBinary bin;
+  ERL_NIF_TERM output;
+
+  if (errnum < 0)
+    return make_av_error(env, errnum);
+
+  if (muxer_take_output(mux, &bin))
+    output = enif_make_binary(env, &bin);
+  else
+    enif_make_new_binary(env, 0, &output);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), output);
+}
+
+// Allocates a muxer for the format named by the first argument. The
+// options map can hold the options of the format under the options key.
+ERL_NIF_TERM muxer_alloc_context(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  ErlNifBinary name_bin;
+  char format_name[64];
+  AVDictionary *options = NULL;
+  Muxer *mux;
+  int errnum;
+
+  if (!enif_inspect_binary(env, argv[0], &name_bin) ||
+      name_bin.size >= sizeof(format_name))
+    return enif_make_badarg(env);
+  memcpy(format_name, name_bin.data, name_bin.size);
+  format_name[name_bin.size] = 0;
+
+  if ((errnum = get_dict_option(env, argv[1], "options", &options))) {
+    av_dict_free(&options);
+    return make_av_error(env, errnum);
+  }
+
+  if ((errnum = muxer_open(&mux, format_name, &options)))
+    return make_av_error(env, errnum);
+
+  Muxer **mux_res = enif_alloc_resource(MUXER_CTX_RES_TYPE, sizeof(Muxer *));
+  *mux_res = mux;
+
+  ERL_NIF_TERM term = enif_make_resource(env, mux_res);
+  enif_release_resource(mux_res);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"), term);
+}
+
+// Adds a stream given the codec_params resource and the time base of its
+// packets, as found in the stream maps.
+ERL_NIF_TERM muxer_add_stream(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  Muxer *mux;
+  AVCodecParameters *params;
+  const ERL_NIF_TERM *tuple;
+  AVRational time_base;
+  int arity, index;
+
+  get_muxer_context(env, argv[0], &mux);
+  get_codec_params(env, argv[1], &params);
+  if (!enif_get_tuple(env, argv[2], &arity, &tuple) || arity != 2 ||
+      !enif_get_int(env, tuple[0], &time_base.num) ||
+      !enif_get_int(env, tuple[1], &time_base.den))
+    return enif_make_badarg(env);
+
+  if ((index = muxer_new_stream(mux, params, time_base)) < 0)
+    return make_av_error(env, index);
+
+  return enif_make_tuple2(env, enif_make_atom(env, "ok"),
+                          enif_make_int(env, index));
+}
+
+ERL_NIF_TERM muxer_write_header(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  Muxer *mux;
+  AVDictionaryEntry *unused;
+  int errnum;
+
+  get_muxer_context(env, argv[0], &mux);
+
+  if ((errnum = muxer_start(mux)) < 0)
+    return make_av_error(env, errnum);
+
+  // avformat_write_header leaves the options it did not recognise in the
+  // dictionary.
+  if ((unused = av_dict_get(mux->options, "", NULL, AV_DICT_IGNORE_SUFFIX)))
+    return enif_make_tuple2(
+        env, enif_make_atom(env, "error"),
+        enif_make_tuple2(env, enif_make_atom(env, "unknown_option"),
+                         enif_make_string(env, unused->key, ERL_NIF_UTF8)));
+
+  return make_muxer_result(env, mux, 0);
+}
+
+// Writes a list of packet maps, as returned by the demuxer, and returns
+// the output produced.
+ERL_NIF_TERM muxer_write_packets(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  Muxer *mux;
+  ERL_NIF_TERM list, head, value;
+  ErlNifBinary data;
+  int stream_index, errnum = 0;
+  int64_t pts, dts, duration;
+
+  get_muxer_context(env, argv[0], &mux);
+
+  for (list = argv[1]; !errnum && enif_get_list_cell(env, list, &head, &list);) {
+    pts = dts = AV_NOPTS_VALUE;
+    duration = 0;
+
+    if (!enif_get_map_value(env, head, enif_make_atom(env, "stream_index"),
+                            &value) ||
+        !enif_get_int(env, value, &stream_index) ||
+        !enif_get_map_value(env, head, enif_make_atom(env, "data"), &value) ||
+        !enif_inspect_binary(env, value, &data))
+      return enif_make_badarg(env);
+
+    if (enif_get_map_value(env, head, enif_make_atom(env, "pts"), &value))
+      enif_get_int64(env, value, (long *)&pts);
+    if (enif_get_map_value(env, head, enif_make_atom(env, "dts"), &value))
+      enif_get_int64(env, value, (long *)&dts);
+    if (enif_get_map_value(env, head, enif_make_atom(env, "duration"), &value))
+      enif_get_int64(env, value, (long *)&duration);
+
+    errnum = muxer_write_packet(
+        mux, stream_index, data.data, data.size, pts, dts, duration,
+        get_bool_option(env, head, "keyframe", 0));
+  }
+
+  return make_muxer_result(env, mux, errnum);
+}
+
+ERL_NIF_TERM muxer_write_trailer(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  Muxer *mux;
+
+  get_muxer_context(env, argv[0], &mux);
+  return make_muxer_result(env, mux, muxer_finish(mux));
+}
+
+ERL_NIF_TERM muxer_stats(ErlNifEnv *env, int argc,
+                         const ERL_NIF_TERM argv[]) {
+  Muxer *mux;
+  ERL_NIF_TERM map;
+
+  get_muxer_context(env, argv[0], &mux);
+
+  map = enif_make_new_map(env);
+  enif_make_map_put(env, map, enif_make_atom(env, "packets"),
+                    enif_make_ulong(env, mux->stats.packets), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_in"),
+                    enif_make_ulong(env, mux->stats.bytes_in), &map);
+  enif_make_map_put(env, map, enif_make_atom(env, "bytes_out"),
+                    enif_make_ulong(env, mux->stats.bytes_out), &map);
+
+  return map;
+}
+
 // Called when the nif is loaded, as specified in the ERL_NIF_INIT call.
 int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info) {
   int flags = ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER;
@@ -648,21 +3051,94 @@ int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info) {
   DECODER_CTX_RES_TYPE = enif_open_resource_type(
       env, NULL, "decoder_ctx", free_decoder_context_res, flags, NULL);
 
+  ENCODER_CTX_RES_TYPE = enif_open_resource_type(
+      env, NULL, "encoder_ctx", free_encoder_context_res, flags, NULL);
+
+  MUXER_CTX_RES_TYPE = enif_open_resource_type(
+      env, NULL, "muxer_ctx", free_muxer_context_res, flags, NULL);
+
+  WORKER_POOL_RES_TYPE = enif_open_resource_type(
+      env, NULL, "worker_pool", free_worker_pool_res, flags, NULL);
+
+  DECODER_POOL_RES_TYPE = enif_open_resource_type(
+      env, NULL, "decoder_pool", free_decoder_pool_res, flags, NULL);
+
+  MULTI_DECODER_RES_TYPE = enif_open_resource_type(
+      env, NULL, "multi_decoder", free_multi_decoder_res, flags, NULL);
+
+  BUFFER_REF_RES_TYPE = enif_open_resource_type(
+      env, NULL, "buffer_ref", free_buffer_ref_res, flags, NULL);
+
+  if (!(*priv_data = enif_alloc(sizeof(PoolReaper))))
+    return -1;
+  if (pool_reaper_start((PoolReaper *)*priv_data)) {
+    enif_free(*priv_data);
+    return -1;
+  }
+
   return 0;
 }
 
+// Called when the nif is unloaded, once no resource is left.
+void unload(ErlNifEnv *env, void *priv_data) {
+  pool_reaper_stop((PoolReaper *)priv_data);
+  enif_free(priv_data);
+}
+
 static ErlNifFunc nif_funcs[] = {
     // {erl_function_name, erl_function_arity, c_function}
     // Demuxer
-    {"demuxer_alloc_context", 1, demuxer_alloc_context},
+    {"demuxer_alloc_context", 2, demuxer_alloc_context},
+    {"demuxer_open_file", 2, demuxer_open_file},
+    {"demuxer_select_streams", 2, demuxer_select_streams},
+    {"demuxer_seek", 3, demuxer_seek},
+    {"demuxer_keyframes", 2, demuxer_keyframes},
+    {"demuxer_stats", 1, demuxer_stats},
+    {"demuxer_memory", 1, demuxer_memory},
     {"demuxer_add_data", 2, demuxer_add_data},
     {"demuxer_is_ready", 1, demuxer_is_ready},
     {"demuxer_demand", 1, demuxer_demand},
     {"demuxer_streams", 1, demuxer_streams},
     {"demuxer_read_packet", 1, demuxer_read_packet},
+    {"demuxer_read_packets", 3, demuxer_read_packets},
+    {"demuxer_probe_stats", 1, demuxer_probe_stats},
+    {"demuxer_start_read_ahead", 2, demuxer_start_read_ahead},
+    {"demuxer_take_packets", 1, demuxer_take_packets},
     // Decoder
-    {"decoder_alloc_context", 2, decoder_alloc_context},
+    {"decoder_alloc_context", 3, decoder_alloc_context},
     {"decoder_stream_format", 1, decoder_stream_format},
-    {"decoder_add_data", 2, decoder_add_data}};
-
-ERL_NIF_INIT(Elixir.Membrane.LibAV, nif_funcs, load, NULL, NULL, NULL)
+    {"decoder_stats", 1, decoder_stats},
+    {"decoder_memory", 1, decoder_memory},
+    {"decoder_add_data", 2, decoder_add_data},
+    {"decoder_add_data_dirty", 2, decoder_add_data,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"decoder_add_packets", 2, decoder_add_packets},
+    {"decoder_add_packets_dirty", 2, decoder_add_packets,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"decoder_add_data_async", 3, decoder_add_data_async},
+    // Encoder
+    {"encoder_alloc_context", 2, encoder_alloc_context},
+    {"encoder_stream", 1, encoder_stream},
+    {"encoder_stats", 1, encoder_stats},
+    {"encoder_add_data", 2, encoder_add_data},
+    {"encoder_add_data_dirty", 2, encoder_add_data,
+     ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    // Muxer
+    {"muxer_alloc_context", 2, muxer_alloc_context},
+    {"muxer_add_stream", 3, muxer_add_stream},
+    {"muxer_write_header", 1, muxer_write_header},
+    {"muxer_write_packets", 2, muxer_write_packets},
+    {"muxer_write_trailer", 1, muxer_write_trailer},
+    {"muxer_stats", 1, muxer_stats},
+    // Worker pool
+    {"worker_pool_alloc", 2, worker_pool_alloc},
+    {"worker_pool_close", 1, worker_pool_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"worker_pool_stats", 1, worker_pool_stats},
+    {"multi_decoder_alloc", 1, multi_decoder_alloc},
+    {"multi_decoder_add_stream", 3, multi_decoder_add_stream},
+    {"multi_decoder_add_packets", 2, multi_decoder_add_packets},
+    // Decoder pool
+    {"decoder_pool_alloc", 1, decoder_pool_alloc},
+    {"decoder_pool_stats", 1, decoder_pool_stats}};
+
+ERL_NIF_INIT(Elixir.Membrane.LibAV, nif_funcs, load, NULL, NULL, unload)
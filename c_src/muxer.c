@@ -0,0 +1,193 @@
+#include "muxer.h"
+#include <errno.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Appends the data flushed by the AVIO context to the output binary.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int write_output(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+int write_output(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+  Muxer *mux = (Muxer *)opaque;
+  size_t size;
+
+  if (!mux->has_out) {
+    size = buf_size > MUXER_IO_BUFFER_SIZE ? buf_size : MUXER_IO_BUFFER_SIZE;
+    if (!enif_alloc_binary(size, &mux->out))
+      return AVERROR(ENOMEM);
+    mux->has_out = 1;
+    mux->out_size = 0;
+  } else if (mux->out_size + buf_size > mux->out.size) {
+    size = mux->out.size * 2;
+    if (size < mux->out_size + buf_size)
+      size = mux->out_size + buf_size;
+    if (!enif_realloc_binary(&mux->out, size))
+      return AVERROR(ENOMEM);
+  }
+
+  memcpy(mux->out.data + mux->out_size, buf, buf_size);
+  mux->out_size += buf_size;
+  mux->stats.bytes_out += buf_size;
+
+  return buf_size;
+}
+
+int muxer_open(Muxer **mux, const char *format_name, AVDictionary **options) {
+  uint8_t *buffer;
+  int errnum;
+
+  if (!(*mux = (Muxer *)calloc(1, sizeof(Muxer)))) {
+    av_dict_free(options);
+    return AVERROR(ENOMEM);
+  }
+  (*mux)->options = *options;
+  *options = NULL;
+
+  if (!((*mux)->packet = av_packet_alloc())) {
+    errnum = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  if ((errnum = avformat_alloc_output_context2(&(*mux)->fmt_ctx, NULL,
+                                               format_name, NULL)) < 0)
+    goto fail;
+
+  // The output is never seekable: formats that need to go back, such as
+  // plain mp4, must be configured to avoid it, e.g. by fragmenting.
+  if (!(buffer = av_malloc(MUXER_IO_BUFFER_SIZE))) {
+    errnum = AVERROR(ENOMEM);
+    goto fail;
+  }
+  if (!((*mux)->io_ctx = avio_alloc_context(buffer, MUXER_IO_BUFFER_SIZE, 1,
+                                            *mux, NULL, &write_output, NULL))) {
+    av_free(buffer);
+    errnum = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  (*mux)->fmt_ctx->pb = (*mux)->io_ctx;
+  (*mux)->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  return 0;
+
+fail:
+  muxer_free(*mux);
+  *mux = NULL;
+  return errnum;
+}
+
+void muxer_free(Muxer *mux) {
+  avformat_free_context(mux->fmt_ctx);
+  if (mux->io_ctx)
+    av_freep(&mux->io_ctx->buffer);
+  avio_context_free(&mux->io_ctx);
+  if (mux->has_out)
+    enif_release_binary(&mux->out);
+  av_dict_free(&mux->options);
+  av_packet_free(&mux->packet);
+  free(mux->time_bases);
+  free(mux);
+}
+
+int muxer_new_stream(Muxer *mux, const AVCodecParameters *params,
+                     AVRational time_base) {
+  AVRational *time_bases;
+  AVStream *stream;
+  int errnum;
+
+  if (mux->header_written)
+    return AVERROR(EINVAL);
+
+  // Grown first, every stream of the context must have its time base.
+  if (!(time_bases = (AVRational *)realloc(
+            mux->time_bases,
+            (mux->fmt_ctx->nb_streams + 1) * sizeof(AVRational))))
+    return AVERROR(ENOMEM);
+  mux->time_bases = time_bases;
+
+  if (!(stream = avformat_new_stream(mux->fmt_ctx, NULL)))
+    return AVERROR(ENOMEM);
+  mux->time_bases[stream->index] = time_base;
+
+  if ((errnum = avcodec_parameters_copy(stream->codecpar, params)) < 0)
+    return errnum;
+
+  // The tag of the source container might not be valid in the output one,
+  // let the muxer pick its own.
+  stream->codecpar->codec_tag = 0;
+  // A hint, the muxer may choose another time base.
+  stream->time_base = time_base;
+
+  return stream->index;
+}
+
+int muxer_start(Muxer *mux) {
+  int errnum;
+
+  if (mux->header_written)
+    return AVERROR(EINVAL);
+
+  if ((errnum = avformat_write_header(mux->fmt_ctx, &mux->options)) < 0)
+    return errnum;
+
+  mux->header_written = 1;
+  return 0;
+}
+
+int muxer_write_packet(Muxer *mux, int stream_index, uint8_t *data, int size,
+                       int64_t pts, int64_t dts, int64_t duration,
+                       int keyframe) {
+  AVPacket *packet = mux->packet;
+
+  if (!mux->header_written || mux->trailer_written || stream_index < 0 ||
+      stream_index >= (int)mux->fmt_ctx->nb_streams)
+    return AVERROR(EINVAL);
+
+  packet->data = data;
+  packet->size = size;
+  packet->pts = pts;
+  packet->dts = dts;
+  packet->duration = duration;
+  packet->stream_index = stream_index;
+  packet->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+  av_packet_rescale_ts(packet, mux->time_bases[stream_index],
+                       mux->fmt_ctx->streams[stream_index]->time_base);
+
+  mux->stats.packets++;
+  mux->stats.bytes_in += size;
+
+  // Takes over the packet, which is left blank.
+  return av_interleaved_write_frame(mux->fmt_ctx, packet);
+}
+
+int muxer_finish(Muxer *mux) {
+  int errnum;
+
+  if (!mux->header_written || mux->trailer_written)
+    return AVERROR(EINVAL);
+
+  if ((errnum = av_write_trailer(mux->fmt_ctx)) < 0)
+    return errnum;
+
+  mux->trailer_written = 1;
+  return 0;
+}
+
+int muxer_take_output(Muxer *mux, ErlNifBinary *bin) {
+  avio_flush(mux->io_ctx);
+
+  if (!mux->has_out)
+    return 0;
+
+  if (mux->out_size < mux->out.size)
+    enif_realloc_binary(&mux->out, mux->out_size);
+
+  *bin = mux->out;
+  mux->has_out = 0;
+  mux->out_size = 0;
+
+  return 1;
+}
@@ -0,0 +1,79 @@
+#ifndef LIBAV_MUXER_H
+#define LIBAV_MUXER_H
+
+// The muxing core. Output is written in binaries allocated with the
+// ErlNifBinary API, which are handed over to the caller without copying.
+#include <erl_nif.h>
+#include <libavcodec/codec_par.h>
+#include <libavcodec/packet.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Size of the AVIO buffer libav writes in before it is flushed to the
+// output binary.
+#define MUXER_IO_BUFFER_SIZE (1 << 15)
+
+// Runtime counters of a muxer.
+typedef struct {
+  u_long packets;
+  u_long bytes_in;
+  u_long bytes_out;
+} MuxerStats;
+
+typedef struct {
+  AVFormatContext *fmt_ctx;
+  // Writes to out through the write_output callback.
+  AVIOContext *io_ctx;
+
+  // The output produced since it was last taken. Only allocated when
+  // there is some.
+  ErlNifBinary out;
+  size_t out_size;
+  int has_out;
+
+  // Time base of the packets of each stream, as provided by the caller.
+  AVRational *time_bases;
+  // Options of the format, applied when the header is written.
+  AVDictionary *options;
+  int header_written;
+  int trailer_written;
+
+  // Reused by every write.
+  AVPacket *packet;
+
+  MuxerStats stats;
+} Muxer;
+
+// Allocates a muxer producing the format named format_name, e.g. "mpegts",
+// "matroska" or "mp4". The muxer takes ownership of options. On failure,
+// *mux is NULL.
+int muxer_open(Muxer **mux, const char *format_name, AVDictionary **options);
+
+void muxer_free(Muxer *mux);
+
+// Adds a stream whose packets are described by params and have timestamps
+// in time_base. Returns the index of the stream or a negative libav error.
+// Streams can only be added before the header is written.
+int muxer_new_stream(Muxer *mux, const AVCodecParameters *params,
+                     AVRational time_base);
+
+// Writes the header. Format options that were not consumed are left in
+// mux->options.
+int muxer_start(Muxer *mux);
+
+// Writes a packet of the stream. The data is copied when libav needs to
+// hold it for interleaving.
+int muxer_write_packet(Muxer *mux, int stream_index, uint8_t *data, int size,
+                       int64_t pts, int64_t dts, int64_t duration,
+                       int keyframe);
+
+// Flushes the packets held for interleaving and writes the trailer.
+int muxer_finish(Muxer *mux);
+
+// Hands the output written so far over to bin. Returns whether there was
+// any: the binary then belongs to the caller.
+int muxer_take_output(Muxer *mux, ErlNifBinary *bin);
+
+#endif
@@ -6,8 +6,12 @@ defmodule Membrane.LibAV do
     :erlang.load_nif(path, 0)
   end
 
-  def demuxer_alloc_context(_probe_size) do
-    raise "NIF demuxer_alloc_context/1 not implemented"
+  def demuxer_alloc_context(_probe_size, _opts) do
+    raise "NIF demuxer_alloc_context/2 not implemented"
+  end
+
+  def demuxer_open_file(_path, _opts) do
+    raise "NIF demuxer_open_file/2 not implemented"
   end
 
   def demuxer_add_data(_ctx, _data) do
@@ -22,6 +26,26 @@ defmodule Membrane.LibAV do
     raise "NIF demuxer_is_ready/1 not implemented"
   end
 
+  def demuxer_select_streams(_ctx, _stream_indices) do
+    raise "NIF demuxer_select_streams/2 not implemented"
+  end
+
+  def demuxer_seek(_ctx, _stream_index, _pts) do
+    raise "NIF demuxer_seek/3 not implemented"
+  end
+
+  def demuxer_keyframes(_ctx, _stream_index) do
+    raise "NIF demuxer_keyframes/2 not implemented"
+  end
+
+  def demuxer_stats(_ctx) do
+    raise "NIF demuxer_stats/1 not implemented"
+  end
+
+  def demuxer_memory(_ctx) do
+    raise "NIF demuxer_memory/1 not implemented"
+  end
+
   def demuxer_demand(_ctx) do
     raise "NIF demuxer_demand/1 not implemented"
   end
@@ -30,15 +54,131 @@ defmodule Membrane.LibAV do
     raise "NIF demuxer_read_packet/1 not implemented"
   end
 
-  def decoder_alloc_context(_codec_id, _codec_params) do
-    raise "NIF decoder_alloc_context/2 not implemented"
+  def demuxer_read_packets(_ctx, _max_packets, _max_bytes) do
+    raise "NIF demuxer_read_packets/3 not implemented"
+  end
+
+  def demuxer_probe_stats(_ctx) do
+    raise "NIF demuxer_probe_stats/1 not implemented"
+  end
+
+  def demuxer_start_read_ahead(_ctx, _tag) do
+    raise "NIF demuxer_start_read_ahead/2 not implemented"
+  end
+
+  def demuxer_take_packets(_ctx) do
+    raise "NIF demuxer_take_packets/1 not implemented"
+  end
+
+  def decoder_alloc_context(_codec_id, _codec_params, _opts) do
+    raise "NIF decoder_alloc_context/3 not implemented"
+  end
+
+  def decoder_stats(_ctx) do
+    raise "NIF decoder_stats/1 not implemented"
+  end
+
+  def decoder_memory(_ctx) do
+    raise "NIF decoder_memory/1 not implemented"
   end
 
   def decoder_add_data(_ctx, _packet) do
     raise "NIF decoder_add_data/2 not implemented"
   end
 
+  def decoder_add_data_dirty(_ctx, _packet) do
+    raise "NIF decoder_add_data_dirty/2 not implemented"
+  end
+
+  def decoder_add_packets(_ctx, _packets) do
+    raise "NIF decoder_add_packets/2 not implemented"
+  end
+
+  def decoder_add_packets_dirty(_ctx, _packets) do
+    raise "NIF decoder_add_packets_dirty/2 not implemented"
+  end
+
+  def decoder_add_data_async(_pool, _ctx, _packet) do
+    raise "NIF decoder_add_data_async/3 not implemented"
+  end
+
   def decoder_stream_format(_ctx) do
     raise "NIF decoder_stream_format/1 not implemented"
   end
+
+  def encoder_alloc_context(_codec_name, _opts) do
+    raise "NIF encoder_alloc_context/2 not implemented"
+  end
+
+  def encoder_stream(_ctx) do
+    raise "NIF encoder_stream/1 not implemented"
+  end
+
+  def encoder_stats(_ctx) do
+    raise "NIF encoder_stats/1 not implemented"
+  end
+
+  def encoder_add_data(_ctx, _frame) do
+    raise "NIF encoder_add_data/2 not implemented"
+  end
+
+  def encoder_add_data_dirty(_ctx, _frame) do
+    raise "NIF encoder_add_data_dirty/2 not implemented"
+  end
+
+  def muxer_alloc_context(_format_name, _opts) do
+    raise "NIF muxer_alloc_context/2 not implemented"
+  end
+
+  def muxer_add_stream(_ctx, _codec_params, _time_base) do
+    raise "NIF muxer_add_stream/3 not implemented"
+  end
+
+  def muxer_write_header(_ctx) do
+    raise "NIF muxer_write_header/1 not implemented"
+  end
+
+  def muxer_write_packets(_ctx, _packets) do
+    raise "NIF muxer_write_packets/2 not implemented"
+  end
+
+  def muxer_write_trailer(_ctx) do
+    raise "NIF muxer_write_trailer/1 not implemented"
+  end
+
+  def muxer_stats(_ctx) do
+    raise "NIF muxer_stats/1 not implemented"
+  end
+
+  def worker_pool_alloc(_threads, _max_jobs) do
+    raise "NIF worker_pool_alloc/2 not implemented"
+  end
+
+  def worker_pool_close(_pool) do
+    raise "NIF worker_pool_close/1 not implemented"
+  end
+
+  def worker_pool_stats(_pool) do
+    raise "NIF worker_pool_stats/1 not implemented"
+  end
+
+  def multi_decoder_alloc(_pool) do
+    raise "NIF multi_decoder_alloc/1 not implemented"
+  end
+
+  def multi_decoder_add_stream(_ctx, _stream_index, _decoder) do
+    raise "NIF multi_decoder_add_stream/3 not implemented"
+  end
+
+  def multi_decoder_add_packets(_ctx, _packets) do
+    raise "NIF multi_decoder_add_packets/2 not implemented"
+  end
+
+  def decoder_pool_alloc(_max_idle) do
+    raise "NIF decoder_pool_alloc/1 not implemented"
+  end
+
+  def decoder_pool_stats(_pool) do
+    raise "NIF decoder_pool_stats/1 not implemented"
+  end
 end
@@ -0,0 +1,49 @@
+defmodule Membrane.LibAV.Backlog do
+  @moduledoc false
+  # Holds back what an element submits to a `Membrane.LibAV.WorkerPool`
+  # while the queue of the pool is full, and submits it again, in order,
+  # once the pool drains. The element is sent `:libav_submit_backlog` when
+  # it should retry.
+
+  @retry_interval 1
+
+  defstruct queue: :queue.new(), retry_scheduled?: false
+
+  @type t :: %__MODULE__{}
+
+  # Submits item after the ones held back. submit_fun returns the result
+  # of the submitting NIF.
+  @spec submit(t(), term(), (term() -> :ok | {:error, atom()})) :: t()
+  def submit(backlog, item, submit_fun) do
+    flush(%{backlog | queue: :queue.in(item, backlog.queue)}, submit_fun)
+  end
+
+  # Called when the element receives :libav_submit_backlog.
+  @spec retry(t(), (term() -> :ok | {:error, atom()})) :: t()
+  def retry(backlog, submit_fun) do
+    flush(%{backlog | retry_scheduled?: false}, submit_fun)
+  end
+
+  defp flush(backlog, submit_fun) do
+    case :queue.peek(backlog.queue) do
+      :empty ->
+        backlog
+
+      {:value, item} ->
+        case submit_fun.(item) do
+          :ok -> flush(%{backlog | queue: :queue.drop(backlog.queue)}, submit_fun)
+          {:error, :busy} -> schedule_retry(backlog)
+          {:error, :memory_limit} -> raise "Decoder memory limit exceeded"
+          {:error, :batch_too_large} -> raise "Batch larger than the worker pool queue"
+          {:error, :closed} -> raise "Worker pool closed"
+        end
+    end
+  end
+
+  defp schedule_retry(backlog = %{retry_scheduled?: true}), do: backlog
+
+  defp schedule_retry(backlog) do
+    Process.send_after(self(), :libav_submit_backlog, @retry_interval)
+    %{backlog | retry_scheduled?: true}
+  end
+end
@@ -7,6 +7,92 @@ defmodule Membrane.LibAV.Decoder do
     stream: [
       spec: map(),
       description: "Stream information as provided by the demuxer"
+    ],
+    mode: [
+      spec: :sync | :dirty | :async,
+      default: :sync,
+      description: """
+      Where decoding takes place. `:sync` decodes on the scheduler running the
+      element, `:dirty` on a dirty CPU scheduler and `:async` on the threads of
+      a `Membrane.LibAV.WorkerPool`, delivering the frames back as messages.
+      """
+    ],
+    pool: [
+      spec: Membrane.LibAV.WorkerPool.t() | nil,
+      default: nil,
+      description:
+        "Pool used in `:async` mode. When nil, `Membrane.LibAV.WorkerPool.default/0` is used."
+    ],
+    decoder_pool: [
+      spec: Membrane.LibAV.DecoderPool.t() | nil,
+      default: nil,
+      description: """
+      Pool the codec is taken from and returned to when the element terminates,
+      instead of being opened and closed each time. Worth it when many short
+      lived decoders handle similar streams, e.g. the segments of a playlist.
+      """
+    ],
+    thread_count: [
+      spec: non_neg_integer() | :auto,
+      default: :auto,
+      description: """
+      Threads used by the codec. With `:auto` libav uses one thread per core,
+      for the codecs that support threading.
+      """
+    ],
+    thread_type: [
+      spec: :frame | :slice | :auto,
+      default: :auto,
+      description: """
+      Restricts codec threading to frame or slice threading. With `:auto` libav
+      picks what the codec supports, preferring frame threading.
+      """
+    ],
+    codec_options: [
+      spec: %{optional(atom() | String.t()) => String.Chars.t()},
+      default: %{},
+      description: "Private options of the codec, as accepted by the ffmpeg command line."
+    ],
+    output_format: [
+      spec: Membrane.RawAudio.t() | Membrane.RawVideo.t() | nil,
+      default: nil,
+      description: """
+      Format of the decoded audio or video. Sample format, rate and channel
+      conversions, and pixel format and size conversions happen in the same
+      native call that decodes the packets. The fields of a
+      `Membrane.RawVideo` left nil keep those of each picture, following
+      resolution changes of the stream, its framerate is ignored. When nil,
+      the samples produced by the codec are emitted, in packed layout, and
+      the pictures as they are.
+      """
+    ],
+    chunk_size: [
+      spec: {:samples, pos_integer()} | {:duration, Membrane.Time.t()} | nil,
+      default: nil,
+      description: """
+      Size of the output buffers, in samples or as a duration at the output
+      sample rate. The decoded samples are regrouped natively, each buffer
+      holding exactly that many samples with the timestamp of its first one,
+      except for the last buffer of the stream. When nil, each buffer holds a
+      frame as produced by the codec, e.g. 1024 samples for AAC.
+      """
+    ],
+    memory_limit: [
+      spec: pos_integer() | nil,
+      default: nil,
+      description: """
+      Upper bound of the native memory of the decoder, in bytes, see
+      `Membrane.LibAV.decoder_memory/1`. It covers the packets waiting in the
+      pool in `:async` mode, the samples regrouped in chunks and the buffers
+      of the converted frames, exported ones included, but not the memory of
+      the codec itself. The decoder raises when it is exceeded. When nil,
+      memory is not capped.
+      """
+    ],
+    telemetry_interval: [
+      spec: Membrane.Time.t() | nil,
+      default: Membrane.Time.seconds(10),
+      description: "Interval of the stats telemetry events, see `Membrane.LibAV.Telemetry`."
     ]
   )
 
@@ -18,97 +104,207 @@ defmodule Membrane.LibAV.Decoder do
 
   def_output_pad(:output,
     availability: :always,
-    accepted_format: Membrane.RawAudio,
+    accepted_format: any_of(Membrane.RawAudio, Membrane.RawVideo),
     flow_control: :auto
   )
 
   @impl true
   def handle_init(_ctx, opts) do
-    if opts.stream.codec_type != :audio do
-      raise "Unsupported codec_type != :audio"
+    if opts.stream.codec_type not in [:audio, :video] do
+      raise "Unsupported codec_type #{inspect(opts.stream.codec_type)}"
     end
 
+    pool =
+      if opts.mode == :async do
+        opts.pool || LibAV.WorkerPool.default()
+      end
+
+    {:ok, ctx} =
+      LibAV.decoder_alloc_context(
+        opts.stream.codec_id,
+        opts.stream.codec_params,
+        nif_options(opts.stream, opts)
+      )
+
     {[],
      %{
        stream: opts.stream,
-       ctx: LibAV.decoder_alloc_context(opts.stream.codec_id, opts.stream.codec_params)
+       mode: opts.mode,
+       pool: pool,
+       ctx: ctx,
+       telemetry_interval: opts.telemetry_interval,
+       # Seek events waiting for the pool to flush the decoder.
+       pending_seeks: :queue.new(),
+       # Packets waiting for room in the queue of the pool.
+       backlog: %LibAV.Backlog{}
      }}
   end
 
+  @impl true
+  def handle_playing(_ctx, state) do
+    {LibAV.Telemetry.start_timer_actions(state.telemetry_interval), state}
+  end
+
+  @impl true
+  def handle_tick(:telemetry, ctx, state) do
+    emit_stats(ctx, state)
+    {[], state}
+  end
+
   @impl true
   def handle_stream_format(:input, _format, _ctx, state) do
     stream_format = LibAV.decoder_stream_format(state.ctx)
 
-    {[
-       # {:output, %Membrane.RemoteStream{content_format: to_raw_audio_format(stream_format)}}
-       stream_format: {:output, to_raw_audio_format(stream_format)}
-     ], state}
+    {[stream_format: {:output, LibAV.Format.raw!(stream_format)}], state}
+  end
+
+  @impl true
+  def handle_event(:input, event = %LibAV.SeekEvent{}, _ctx, state = %{mode: :async}) do
+    # Frames decoded before the seek are still on their way.
+    state = submit(state, :flush)
+    {[], %{state | pending_seeks: :queue.in(event, state.pending_seeks)}}
+  end
+
+  def handle_event(:input, event = %LibAV.SeekEvent{}, _ctx, state) do
+    {:flushed, []} = flush(state)
+    {[forward: event], state}
   end
 
+  def handle_event(pad, event, ctx, state), do: super(pad, event, ctx, state)
+
   @impl true
-  def handle_end_of_stream(:input, _ctx, state) do
+  def handle_end_of_stream(:input, _ctx, state = %{mode: :async}) do
+    # The end of stream is forwarded once the pool has drained the decoder.
+    {[], submit(state, nil)}
+  end
+
+  def handle_end_of_stream(:input, ctx, state) do
     # Turns the decoder into drain mode.
     {:eof, buffers} = decode(nil, state)
+    emit_stats(ctx, state)
     {[buffer: {:output, buffers}, end_of_stream: :output], state}
   end
 
   @impl true
+  def handle_buffer(:input, buffer, _ctx, state = %{mode: :async}) do
+    {[], submit(state, LibAV.Frame.packet(buffer))}
+  end
+
   def handle_buffer(:input, buffer, _ctx, state) do
     {:ok, buffers} = decode(buffer, state)
     {[buffer: {:output, buffers}], state}
   end
 
-  defp decode(buffer, state) do
-    packet =
-      if buffer != nil do
-        %{
-          data: buffer.payload,
-          pts: buffer.pts,
-          dts: buffer.dts
-        }
-      else
-        nil
+  @impl true
+  def handle_buffers_batch(:input, buffers, ctx, state = %{mode: :async}) do
+    super(:input, buffers, ctx, state)
+  end
+
+  def handle_buffers_batch(:input, buffers, _ctx, state) do
+    # One native call decodes the whole batch.
+    packets = Enum.map(buffers, &LibAV.Frame.packet/1)
+
+    result =
+      case state.mode do
+        :sync -> LibAV.decoder_add_packets(state.ctx, packets)
+        :dirty -> LibAV.decoder_add_packets_dirty(state.ctx, packets)
       end
 
-    case LibAV.decoder_add_data(state.ctx, packet) do
-      {key, frames} when key in [:ok, :eof] ->
-        buffers =
-          Enum.map(frames, fn frame ->
-            %Membrane.Buffer{
-              payload: frame.data,
-              pts: frame.pts
-            }
-          end)
+    {:ok, buffers} = LibAV.Frame.to_buffers(result)
+    {[buffer: {:output, buffers}], state}
+  end
 
-        {key, buffers}
+  @impl true
+  def handle_info(:libav_submit_backlog, _ctx, state) do
+    {[], %{state | backlog: LibAV.Backlog.retry(state.backlog, submit_fun(state))}}
+  end
 
-      {:error, error} ->
-        raise to_string(error)
+  def handle_info({:libav_decoder, decoder, {:flushed, []}}, _ctx, state = %{ctx: decoder}) do
+    {{:value, event}, pending_seeks} = :queue.out(state.pending_seeks)
+    {[event: {:output, event}], %{state | pending_seeks: pending_seeks}}
+  end
+
+  def handle_info({:libav_decoder, decoder, result}, ctx, state = %{ctx: decoder}) do
+    case LibAV.Frame.to_buffers(result) do
+      {:ok, buffers} ->
+        {[buffer: {:output, buffers}], state}
+
+      {:eof, buffers} ->
+        emit_stats(ctx, state)
+        {[buffer: {:output, buffers}, end_of_stream: :output], state}
     end
   end
 
-  defp to_raw_audio_format(stream_format) do
-    {sample_type, sample_size} =
-      case to_string(stream_format.sample_format) do
-        "u8" -> {:u, 8}
-        "s16" -> {:s, 16}
-        "s32" -> {:s, 32}
-        "flt" -> {:f, 32}
-        "dbl" -> {:f, 64}
-        other -> raise "Sample format #{inspect(other)} not supported"
-      end
+  defp emit_stats(ctx, state) do
+    LibAV.Telemetry.emit(:decoder, LibAV.decoder_stats(state.ctx), ctx, __MODULE__)
+  end
 
-    endianness =
-      case System.endianness() do
-        :little -> :le
-        :big -> :be
-      end
+  defp decode(buffer, state) do
+    state
+    |> add_data(LibAV.Frame.packet(buffer))
+    |> LibAV.Frame.to_buffers()
+  end
+
+  # Drops the packets and samples buffered by the decoder.
+  defp flush(state), do: add_data(state, :flush)
+
+  defp submit(state, packet) do
+    %{state | backlog: LibAV.Backlog.submit(state.backlog, packet, submit_fun(state))}
+  end
 
-    %Membrane.RawAudio{
-      sample_rate: stream_format.sample_rate,
-      channels: stream_format.channels,
-      sample_format:
-        Membrane.RawAudio.SampleFormat.from_tuple({sample_type, sample_size, endianness})
+  defp submit_fun(state) do
+    &LibAV.decoder_add_data_async(state.pool, state.ctx, &1)
+  end
+
+  defp add_data(state, packet) do
+    case state.mode do
+      :sync -> LibAV.decoder_add_data(state.ctx, packet)
+      :dirty -> LibAV.decoder_add_data_dirty(state.ctx, packet)
+    end
+  end
+
+  # Options of decoder_alloc_context/3, shared with
+  # `Membrane.LibAV.MultiDecoder`.
+  @doc false
+  def nif_options(stream, opts) do
+    Map.merge(
+      %{
+        time_base: Map.get(stream, :time_base),
+        thread_count: if(opts.thread_count == :auto, do: 0, else: opts.thread_count),
+        thread_type: opts.thread_type,
+        decoder_pool: opts.decoder_pool,
+        memory_limit: opts.memory_limit,
+        codec_options: Map.new(opts.codec_options, fn {k, v} -> {to_string(k), to_string(v)} end)
+      },
+      Map.merge(output_options(opts.output_format), chunk_options(opts.chunk_size))
+    )
+  end
+
+  defp chunk_options(nil), do: %{}
+  defp chunk_options({:samples, samples}), do: %{chunk_samples: samples}
+
+  defp chunk_options({:duration, duration}) do
+    %{chunk_duration: div(duration, Membrane.Time.microsecond())}
+  end
+
+  defp output_options(nil), do: %{}
+
+  defp output_options(format = %Membrane.RawAudio{}) do
+    %{
+      output_sample_format: LibAV.Format.sample_format!(format.sample_format),
+      output_sample_rate: format.sample_rate,
+      output_channels: format.channels
     }
   end
+
+  defp output_options(format = %Membrane.RawVideo{}) do
+    size = %{output_width: format.width || 0, output_height: format.height || 0}
+
+    case format.pixel_format do
+      nil -> size
+
+      pixel_format ->
+        Map.put(size, :output_pixel_format, LibAV.Format.pixel_format!(pixel_format))
+    end
+  end
 end
@@ -0,0 +1,40 @@
+defmodule Membrane.LibAV.DecoderPool do
+  @moduledoc """
+  A cache of opened codecs, shared by `Membrane.LibAV.Decoder` elements
+  through their `decoder_pool` option.
+
+  A decoder allocated with a pool goes back to it when its context is
+  garbage collected, e.g. when the element terminates, flushed but still
+  open. The next decoder with the same codec, stream parameters and
+  options takes it over instead of opening a new one, which saves the codec
+  and resampler setup to workloads made of many short streams.
+
+  Idle codecs are kept up to `max_idle`, the least recently returned ones
+  are closed first. They are all closed when the pool is garbage collected.
+  """
+
+  alias Membrane.LibAV
+
+  @type t :: reference()
+
+  @doc """
+  Starts a new pool keeping up to `max_idle` idle codecs.
+  """
+  @spec new(non_neg_integer()) :: {:ok, t()}
+  def new(max_idle \\ 64) do
+    LibAV.decoder_pool_alloc(max_idle)
+  end
+
+  @doc """
+  Returns the metrics of the pool:
+  * `idle`, `max_idle`: codecs waiting to be reused and the limit.
+  * `hits`, `misses`: decoders that took over an idle codec, and that
+    opened a new one.
+  * `returned`, `evicted`: codecs given back to the pool, and closed
+    because the pool was full.
+  """
+  @spec stats(t()) :: map()
+  def stats(pool) do
+    LibAV.decoder_pool_stats(pool)
+  end
+end
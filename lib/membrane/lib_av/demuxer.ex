@@ -1,6 +1,8 @@
 defmodule Membrane.LibAV.Demuxer do
   use Membrane.Filter
+  use Membrane.LibAV.DemuxerOutputs
   alias Membrane.LibAV
+  alias Membrane.LibAV.DemuxerOutputs
 
   require Membrane.Logger
 
@@ -11,31 +13,101 @@ defmodule Membrane.LibAV.Demuxer do
     demand_unit: :bytes
   )
 
-  def_output_pad(:output,
-    availability: :on_request,
-    accepted_format: Membrane.RemoteStream,
-    flow_control: :manual
-  )
-
   def_options(
     probe_size: [
       spec: pos_integer(),
-      doc: "Demuxer initial probe size. It will be doubled if the probe is not
-        capable of holding the header of the input stream. Do not shrink this value too
-        much or the demuxer will encouter a premature EOS while reading the stream.",
+      doc: "Demuxer initial probe size. It grows when the probe is not capable of
+        holding the header of the input stream: up to the end of the moov box for mp4
+        inputs, doubling otherwise. Do not shrink this value too much or the demuxer
+        will encouter a premature EOS while reading the stream.",
       default: 2048
+    ],
+    format: [
+      spec: String.t() | nil,
+      doc: "Name of the input format, as listed by `ffmpeg -demuxers`, e.g. `\"mpegts\"`
+        or `\"aac\"`. When set, the input is not probed to detect it. When nil, it is
+        detected from the first bytes of the input.",
+      default: nil
+    ],
+    max_probe_size: [
+      spec: pos_integer() | nil,
+      doc: "Upper bound of the bytes read to find the header. The demuxer raises when
+        the header cannot be found within them, instead of asking for more input.
+        When nil, the probe size grows as long as needed.",
+      default: nil
+    ],
+    max_analyze_duration: [
+      spec: Membrane.Time.t() | nil,
+      doc: "Upper bound of the input duration libav decodes to find the parameters of
+        the streams. When nil, the libav default is used.",
+      default: nil
+    ],
+    skip_stream_info: [
+      spec: boolean(),
+      doc: "When true, streams are described by the header alone, without decoding any
+        frame. This shortens the time to the first packet, but parameters the header
+        lacks are left unset, e.g. the sample format of some codecs. Formats with no
+        global header, such as MPEG-TS, might even announce no streams.",
+      default: false
+    ],
+    zero_copy: [
+      spec: boolean(),
+      doc: "When true, packet payloads are binaries pointing directly into the memory
+        allocated by libav, which is released when the binaries are garbage collected.
+        Otherwise, each payload is copied into a new binary.",
+      default: true
+    ],
+    memory_limit: [
+      spec: pos_integer() | nil,
+      doc: "Upper bound of the native memory of the demuxer, in bytes, see
+        `Membrane.LibAV.demuxer_memory/1`. It covers the queued input, the probe buffer
+        and the packets read ahead, not the memory libav allocates internally. The
+        demuxer raises when the input does not fit. When nil, memory is not capped.",
+      default: nil
+    ],
+    read_ahead: [
+      spec: boolean(),
+      doc: "When true, packets are parsed on a native thread as the input arrives, ahead
+        of the demand, instead of on the scheduler running the element. At most 256
+        packets or 4MiB are read ahead, past which no more input is demanded until the
+        element takes them.",
+      default: false
+    ],
+    telemetry_interval: [
+      spec: Membrane.Time.t() | nil,
+      default: Membrane.Time.seconds(10),
+      description: "Interval of the stats telemetry events, see `Membrane.LibAV.Telemetry`."
     ]
   )
 
   @impl true
   def handle_init(_ctx, opts) do
+    nif_opts = %{
+      zero_copy: opts.zero_copy,
+      format: opts.format,
+      max_probe_size: opts.max_probe_size,
+      max_analyze_duration:
+        opts.max_analyze_duration && div(opts.max_analyze_duration, Membrane.Time.microsecond()),
+      skip_stream_info: opts.skip_stream_info,
+      memory_limit: opts.memory_limit
+    }
+
+    ctx =
+      case LibAV.demuxer_alloc_context(opts.probe_size, nif_opts) do
+        {:ok, ctx} -> ctx
+        {:error, reason} -> raise "Cannot allocate the demuxer: #{reason}"
+      end
+
     {[],
      %{
-       ctx: LibAV.demuxer_alloc_context(opts.probe_size),
+       ctx: ctx,
        ctx_eof: false,
+       read_ahead: opts.read_ahead,
+       read_ahead_tag: nil,
        format_detected?: false,
        available_streams: [],
-       streams: %{}
+       streams: %{},
+       telemetry_interval: opts.telemetry_interval
      }}
   end
 
@@ -43,7 +115,17 @@ defmodule Membrane.LibAV.Demuxer do
   def handle_playing(_ctx, state) do
     # Start by asking some buffers, which are going to be used
     # to discover the available streams.
-    {[demand: {:input, LibAV.demuxer_demand(state.ctx)}], state}
+    actions =
+      [demand: {:input, LibAV.demuxer_demand(state.ctx)}] ++
+        LibAV.Telemetry.start_timer_actions(state.telemetry_interval)
+
+    {actions, state}
+  end
+
+  @impl true
+  def handle_tick(:telemetry, ctx, state) do
+    emit_stats(ctx, state)
+    {[], state}
   end
 
   @impl true
@@ -54,10 +136,18 @@ defmodule Membrane.LibAV.Demuxer do
     publish_streams(state)
   end
 
+  def handle_end_of_stream(:input, _ctx, state = %{read_ahead: true}) do
+    # The thread reads the remaining packets and notifies the end of them.
+    :ok = LibAV.demuxer_add_data(state.ctx, nil)
+    {[], state}
+  end
+
   def handle_end_of_stream(:input, ctx, state) do
     # EOS is controlled by the internal demuxer.
     :ok = LibAV.demuxer_add_data(state.ctx, nil)
-    demux_buffers(ctx, state)
+    result = demux_buffers(ctx, state)
+    emit_stats(ctx, state)
+    result
   end
 
   @impl true
@@ -67,12 +157,6 @@ defmodule Membrane.LibAV.Demuxer do
     {[], state}
   end
 
-  @impl true
-  def handle_pad_added(pad = {Membrane.Pad, :output, _stream_index}, _ctx, state) do
-    streams = Map.put_new(state.streams, pad, [])
-    {[stream_format: {pad, %Membrane.RemoteStream{}}], %{state | streams: streams}}
-  end
-
   # NOTE
   # We expect each output pad to be attached before demand comes in.
   # The stream_index filtering process makes the filter throw away buffers
@@ -83,13 +167,43 @@ defmodule Membrane.LibAV.Demuxer do
   # probably throw away data that is needed for the second output.
 
   @impl true
+  def handle_demand(
+        {Membrane.Pad, :output, _stream_index},
+        _size,
+        :buffers,
+        ctx,
+        state = %{read_ahead: true}
+      ) do
+    # Reading ahead starts with the first demand, once the output pads are
+    # linked.
+    state =
+      if state.read_ahead_tag do
+        state
+      else
+        tag = make_ref()
+        :ok = LibAV.demuxer_start_read_ahead(state.ctx, tag)
+        %{state | read_ahead_tag: tag}
+      end
+
+    read_ahead(ctx, state)
+  end
+
   def handle_demand({Membrane.Pad, :output, _stream_index}, _size, :buffers, ctx, state) do
     demux_buffers(ctx, state)
   end
 
+  @impl true
+  def handle_info({:libav_demuxer, tag}, ctx, state = %{read_ahead_tag: tag}) do
+    read_ahead(ctx, state)
+  end
+
   @impl true
   def handle_buffer(:input, buffer, _ctx, state = %{format_detected?: false}) do
-    :ok = LibAV.demuxer_add_data(state.ctx, buffer.payload)
+    case LibAV.demuxer_add_data(state.ctx, buffer.payload) do
+      :ok -> :ok
+      {:error, :memory_limit} -> raise "Demuxer memory limit exceeded"
+      {:error, reason} -> raise "Cannot read the header: #{reason}"
+    end
 
     if LibAV.demuxer_is_ready(state.ctx) do
       publish_streams(state)
@@ -98,11 +212,57 @@ defmodule Membrane.LibAV.Demuxer do
     end
   end
 
+  def handle_buffer(:input, buffer, _ctx, state = %{read_ahead: true}) do
+    # The thread notifies the element when it needs more input.
+    add_data!(state, buffer.payload)
+    {[], state}
+  end
+
   def handle_buffer(:input, buffer, ctx, state) do
-    :ok = LibAV.demuxer_add_data(state.ctx, buffer.payload)
+    add_data!(state, buffer.payload)
     demux_buffers(ctx, state)
   end
 
+  defp add_data!(state, payload) do
+    case LibAV.demuxer_add_data(state.ctx, payload) do
+      :ok -> :ok
+      {:error, :memory_limit} -> raise "Demuxer memory limit exceeded"
+    end
+  end
+
+  # Packets are only taken from the thread while few are waiting for
+  # demand. Otherwise the thread fills up and stops consuming the input,
+  # which stops the demand on the input pad.
+  defp read_ahead(ctx, state) do
+    queued = state.streams |> Map.values() |> Enum.map(&length/1) |> Enum.sum()
+
+    if queued < @batch_packets do
+      take_buffers(ctx, state)
+    else
+      dispatch_buffers(ctx, state)
+    end
+  end
+
+  defp take_buffers(ctx, state) do
+    {actions, state} =
+      case LibAV.demuxer_take_packets(state.ctx) do
+        {:ok, packets} ->
+          demand = LibAV.demuxer_demand(state.ctx)
+          actions = if demand > 0, do: [demand: {:input, demand}], else: []
+          {actions, load_packets(ctx, state, packets)}
+
+        {:eof, packets} ->
+          unless state.ctx_eof, do: emit_stats(ctx, state)
+          {[], %{load_packets(ctx, state, packets) | ctx_eof: true}}
+
+        {:error, error} ->
+          raise to_string(error)
+      end
+
+    {buffer_actions, state} = dispatch_buffers(ctx, state)
+    {actions ++ buffer_actions, state}
+  end
+
   defp demux_buffers(ctx, state) do
     {actions, state} =
       case read_packets(state, []) do
@@ -123,31 +283,13 @@ defmodule Membrane.LibAV.Demuxer do
   end
 
   defp dispatch_buffers(ctx, state) do
-    ctx
-    |> output_pads()
-    |> Enum.flat_map_reduce(state, fn pad, state ->
-      demand = get_in(ctx, [:pads, pad, :demand])
-
-      {buffers, state} =
-        get_and_update_in(state, [:streams, pad], fn buffers ->
-          Enum.split(buffers, demand)
-        end)
-
-      emit_eos? =
-        ctx.pads.input.end_of_stream? and length(get_in(state, [:streams, pad])) == 0
-
-      actions =
-        List.flatten([
-          [buffer: {pad, buffers}],
-          if(emit_eos?, do: [end_of_stream: pad], else: [])
-        ])
-
-      {actions, state}
-    end)
+    # With a read-ahead thread, the input is over once it reached the end.
+    input_eos? = if state.read_ahead, do: state.ctx_eof, else: ctx.pads.input.end_of_stream?
+    DemuxerOutputs.dispatch_buffers(ctx, state, input_eos?)
   end
 
   defp load_packets(ctx, state, packets) do
-    pads = output_pads(ctx)
+    pads = DemuxerOutputs.output_pads(ctx)
     streams = Enum.map(pads, fn {_, _, index} -> index end)
 
     Enum.reduce(packets, state, fn packet, state ->
@@ -158,12 +300,7 @@ defmodule Membrane.LibAV.Demuxer do
 
         state
       else
-        buffer =
-          %Membrane.Buffer{
-            pts: packet.pts,
-            dts: packet.pts,
-            payload: packet.data
-          }
+        buffer = LibAV.Packet.to_buffer(packet)
 
         update_in(state, [:streams, {Membrane.Pad, :output, packet.stream_index}], fn acc ->
           acc ++ [buffer]
@@ -173,24 +310,32 @@ defmodule Membrane.LibAV.Demuxer do
   end
 
   defp read_packets(state, acc) do
-    case LibAV.demuxer_read_packet(state.ctx) do
-      :eof ->
-        {:eof, Enum.reverse(acc)}
+    case LibAV.demuxer_read_packets(state.ctx, @batch_packets, @batch_bytes) do
+      {:eof, packets} ->
+        {:eof, Enum.concat(Enum.reverse([packets | acc]))}
 
       {:error, other} ->
         {:error, inspect(other)}
 
-      {:demand, demand} ->
-        {:demand, demand, Enum.reverse(acc)}
+      {:demand, demand, packets} ->
+        {:demand, demand, Enum.concat(Enum.reverse([packets | acc]))}
 
-      {:ok, packet} ->
-        read_packets(state, [packet | acc])
+      {:ok, packets} ->
+        read_packets(state, [packets | acc])
     end
   end
 
   defp publish_streams(state) do
     case LibAV.demuxer_streams(state.ctx) do
       {:ok, streams} ->
+        probe = LibAV.demuxer_probe_stats(state.ctx)
+
+        Membrane.Logger.debug(
+          "Found #{probe.format} header after #{probe.attempts} attempt(s), " <>
+            "#{probe.bytes_probed} bytes probed, probe size #{probe.queue_size}, " <>
+            "in #{div(probe.time_to_header, 1_000)}us (#{div(probe.nif_time, 1_000)}us in NIFs)"
+        )
+
         streams =
           Enum.map(streams, fn stream ->
             %{stream | codec_name: to_string(stream.codec_name)}
@@ -201,6 +346,9 @@ defmodule Membrane.LibAV.Demuxer do
             {:notify_parent, {:new_stream, stream}}
           end)
 
+        # Apply the selection of the pads linked before the header.
+        state = if state.streams == %{}, do: state, else: DemuxerOutputs.select_streams(state)
+
         {actions, %{state | format_detected?: true, available_streams: streams}}
 
       {:error, reason} ->
@@ -208,11 +356,7 @@ defmodule Membrane.LibAV.Demuxer do
     end
   end
 
-  defp output_pads(ctx) do
-    ctx.pads
-    |> Enum.flat_map(fn
-      {pad = {Membrane.Pad, :output, _stream_index}, _} -> [pad]
-      _ -> []
-    end)
+  defp emit_stats(ctx, state) do
+    LibAV.Telemetry.emit(:demuxer, LibAV.demuxer_stats(state.ctx), ctx, __MODULE__)
   end
 end
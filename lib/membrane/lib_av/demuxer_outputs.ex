@@ -0,0 +1,76 @@
+defmodule Membrane.LibAV.DemuxerOutputs do
+  @moduledoc false
+  # The output side shared by `Membrane.LibAV.Demuxer` and
+  # `Membrane.LibAV.FileDemuxer`. Each stream has its own output pad, linked
+  # with `Pad.ref(:output, stream_index)`, whose buffers wait for demand in
+  # `state.streams`. The state also holds the demuxer context in `state.ctx`.
+
+  alias Membrane.LibAV
+
+  defmacro __using__(_opts) do
+    quote do
+      # Upper bounds of the packets read by each NIF call.
+      @batch_packets 256
+      @batch_bytes 4 * 1024 * 1024
+
+      def_output_pad(:output,
+        availability: :on_request,
+        accepted_format: Membrane.RemoteStream,
+        flow_control: :manual
+      )
+
+      @impl true
+      def handle_pad_added(pad = {Membrane.Pad, :output, _stream_index}, _ctx, state) do
+        state = %{state | streams: Map.put_new(state.streams, pad, [])}
+        state = Membrane.LibAV.DemuxerOutputs.select_streams(state)
+        {[stream_format: {pad, %Membrane.RemoteStream{}}], state}
+      end
+
+      @impl true
+      def handle_pad_removed(pad = {Membrane.Pad, :output, _stream_index}, _ctx, state) do
+        state = %{state | streams: Map.delete(state.streams, pad)}
+        {[], Membrane.LibAV.DemuxerOutputs.select_streams(state)}
+      end
+    end
+  end
+
+  # Streams without a linked pad are discarded by libav, their packets are
+  # not even read. Pads linked before the header is read are selected once
+  # it is.
+  def select_streams(state) do
+    indices = Enum.map(state.streams, fn {{Membrane.Pad, :output, index}, _} -> index end)
+
+    case LibAV.demuxer_select_streams(state.ctx, indices) do
+      :ok -> state
+      {:error, :eagain} -> state
+    end
+  end
+
+  # Sends the buffers waiting for each pad, up to its demand. Pads are ended
+  # once the input is over and they have no buffers left.
+  def dispatch_buffers(ctx, state, input_eos?) do
+    ctx
+    |> output_pads()
+    |> Enum.reject(&ctx.pads[&1].end_of_stream?)
+    |> Enum.flat_map_reduce(state, fn pad, state ->
+      {buffers, rest} = Enum.split(state.streams[pad], ctx.pads[pad].demand)
+      emit_eos? = input_eos? and rest == []
+
+      actions =
+        List.flatten([
+          [buffer: {pad, buffers}],
+          if(emit_eos?, do: [end_of_stream: pad], else: [])
+        ])
+
+      {actions, put_in(state, [:streams, pad], rest)}
+    end)
+  end
+
+  def output_pads(ctx) do
+    ctx.pads
+    |> Enum.flat_map(fn
+      {pad = {Membrane.Pad, :output, _stream_index}, _} -> [pad]
+      _ -> []
+    end)
+  end
+end
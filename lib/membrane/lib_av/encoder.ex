@@ -0,0 +1,205 @@
+defmodule Membrane.LibAV.Encoder do
+  @moduledoc """
+  Encodes raw audio or video with one of the encoders built in libav, e.g.
+  `"aac"`, `"opus"`, `"flac"` and `"pcm_s16le"` for audio or `"mpeg4"` for
+  video. Audio samples are converted to a format supported by the codec
+  and regrouped in frames of the size it expects. Pictures are passed as
+  they are, the codec must support their pixel format.
+
+  The encoder is opened when the input stream format is received. It then
+  notifies the parent with `{:new_stream, stream}`, where the stream has the
+  same shape as the ones announced by `Membrane.LibAV.Demuxer`. Output
+  buffers hold one packet each, with timestamps in the time base of the
+  stream.
+  """
+  use Membrane.Filter
+
+  alias Membrane.LibAV
+
+  def_options(
+    codec: [
+      spec: String.t(),
+      description: "Name of the libav encoder, as listed by `ffmpeg -encoders`."
+    ],
+    bit_rate: [
+      spec: pos_integer() | nil,
+      default: nil,
+      description: "Target bitrate in bits per second. When nil, the codec default is used."
+    ],
+    mode: [
+      spec: :sync | :dirty,
+      default: :sync,
+      description: """
+      Where encoding takes place. `:sync` encodes on the scheduler running the
+      element, `:dirty` on a dirty CPU scheduler.
+      """
+    ],
+    thread_count: [
+      spec: non_neg_integer() | :auto,
+      default: :auto,
+      description: """
+      Threads used by the codec. With `:auto` libav uses one thread per core,
+      for the codecs that support threading.
+      """
+    ],
+    thread_type: [
+      spec: :frame | :slice | :auto,
+      default: :auto,
+      description: """
+      Restricts codec threading to frame or slice threading. With `:auto` libav
+      picks what the codec supports, preferring frame threading.
+      """
+    ],
+    global_header: [
+      spec: boolean(),
+      default: false,
+      description: """
+      Places the codec headers in the stream parameters instead of repeating
+      them in the packets, as required by containers such as mp4.
+      """
+    ],
+    codec_options: [
+      spec: %{optional(atom() | String.t()) => String.Chars.t()},
+      default: %{},
+      description: "Private options of the codec, as accepted by the ffmpeg command line."
+    ],
+    time_base: [
+      spec: {pos_integer(), pos_integer()},
+      default: {1, Membrane.Time.second()},
+      description: "Time base of the timestamps of the input buffers."
+    ],
+    telemetry_interval: [
+      spec: Membrane.Time.t() | nil,
+      default: Membrane.Time.seconds(10),
+      description: "Interval of the stats telemetry events, see `Membrane.LibAV.Telemetry`."
+    ]
+  )
+
+  def_input_pad(:input,
+    availability: :always,
+    accepted_format: any_of(Membrane.RawAudio, Membrane.RawVideo),
+    flow_control: :auto
+  )
+
+  def_output_pad(:output,
+    availability: :always,
+    accepted_format: Membrane.RemoteStream,
+    flow_control: :auto
+  )
+
+  @impl true
+  def handle_init(_ctx, opts) do
+    nif_opts = %{
+      time_base: opts.time_base,
+      bit_rate: opts.bit_rate || 0,
+      global_header: opts.global_header,
+      thread_count: if(opts.thread_count == :auto, do: 0, else: opts.thread_count),
+      thread_type: opts.thread_type,
+      codec_options: Map.new(opts.codec_options, fn {k, v} -> {to_string(k), to_string(v)} end)
+    }
+
+    {[],
+     %{
+       codec: opts.codec,
+       mode: opts.mode,
+       nif_opts: nif_opts,
+       ctx: nil,
+       input_format: nil,
+       telemetry_interval: opts.telemetry_interval
+     }}
+  end
+
+  @impl true
+  def handle_playing(_ctx, state) do
+    {LibAV.Telemetry.start_timer_actions(state.telemetry_interval), state}
+  end
+
+  @impl true
+  def handle_tick(:telemetry, ctx, state) do
+    emit_stats(ctx, state)
+    {[], state}
+  end
+
+  @impl true
+  def handle_stream_format(:input, format, _ctx, state = %{ctx: nil}) do
+    opts = Map.merge(state.nif_opts, input_options(format))
+
+    ctx =
+      case LibAV.encoder_alloc_context(state.codec, opts) do
+        {:ok, ctx} -> ctx
+        {:error, reason} -> raise "Cannot open encoder #{state.codec}: #{inspect(reason)}"
+      end
+
+    stream = LibAV.encoder_stream(ctx)
+
+    {[
+       notify_parent: {:new_stream, %{stream | codec_name: to_string(stream.codec_name)}},
+       stream_format: {:output, %Membrane.RemoteStream{type: :packetized}}
+     ], %{state | ctx: ctx, input_format: format}}
+  end
+
+  def handle_stream_format(:input, format, _ctx, state = %{input_format: format}) do
+    {[], state}
+  end
+
+  def handle_stream_format(:input, format, _ctx, state) do
+    raise "Input format changed from #{inspect(state.input_format)} to #{inspect(format)}"
+  end
+
+  @impl true
+  def handle_buffer(:input, buffer, _ctx, state) do
+    {:ok, buffers} = encode(%{data: buffer.payload, pts: buffer.pts}, state)
+    {[buffer: {:output, buffers}], state}
+  end
+
+  @impl true
+  def handle_end_of_stream(:input, _ctx, state = %{ctx: nil}) do
+    {[end_of_stream: :output], state}
+  end
+
+  def handle_end_of_stream(:input, ctx, state) do
+    # Turns the encoder into drain mode.
+    {:eof, buffers} = encode(nil, state)
+    emit_stats(ctx, state)
+    {[buffer: {:output, buffers}, end_of_stream: :output], state}
+  end
+
+  defp encode(frame, state) do
+    result =
+      case state.mode do
+        :sync -> LibAV.encoder_add_data(state.ctx, frame)
+        :dirty -> LibAV.encoder_add_data_dirty(state.ctx, frame)
+      end
+
+    case result do
+      {key, packets} when key in [:ok, :eof] ->
+        {key, Enum.map(packets, &LibAV.Packet.to_buffer/1)}
+
+      {:error, error} ->
+        raise to_string(error)
+    end
+  end
+
+  defp emit_stats(_ctx, %{ctx: nil}), do: :ok
+
+  defp emit_stats(ctx, state) do
+    LibAV.Telemetry.emit(:encoder, LibAV.encoder_stats(state.ctx), ctx, __MODULE__)
+  end
+
+  defp input_options(format = %Membrane.RawAudio{}) do
+    %{
+      sample_format: LibAV.Format.sample_format!(format.sample_format),
+      sample_rate: format.sample_rate,
+      channels: format.channels
+    }
+  end
+
+  defp input_options(format = %Membrane.RawVideo{}) do
+    %{
+      pixel_format: LibAV.Format.pixel_format!(format.pixel_format),
+      width: format.width,
+      height: format.height,
+      framerate: format.framerate
+    }
+  end
+end
@@ -0,0 +1,181 @@
+defmodule Membrane.LibAV.FileDemuxer do
+  @moduledoc """
+  Demuxes a local file. Unlike `Membrane.LibAV.Demuxer`, which is fed by an
+  upstream element and can only move forward, the file is mapped in memory
+  and libav is free to seek in it: the header of mp4 files with the moov box
+  at the end is read directly, without buffering the whole input. Startup
+  time does not depend on the file size.
+
+  Streams are announced to the parent with `{:new_stream, stream}`
+  notifications once the element is playing, output pads are then linked
+  with `Pad.ref(:output, stream_index)`.
+
+  Demuxing can be moved to another position with a
+  `Membrane.LibAV.SeekEvent`, see its documentation.
+  """
+  use Membrane.Source
+  use Membrane.LibAV.DemuxerOutputs
+  alias Membrane.LibAV
+  alias Membrane.LibAV.DemuxerOutputs
+
+  require Membrane.Logger
+
+  def_options(
+    location: [
+      spec: Path.t(),
+      description: "Path of the file to demux."
+    ],
+    zero_copy: [
+      spec: boolean(),
+      description: "See `Membrane.LibAV.Demuxer`.",
+      default: true
+    ],
+    memory_limit: [
+      spec: pos_integer() | nil,
+      description: "See `Membrane.LibAV.Demuxer`.",
+      default: nil
+    ],
+    telemetry_interval: [
+      spec: Membrane.Time.t() | nil,
+      default: Membrane.Time.seconds(10),
+      description: "Interval of the stats telemetry events, see `Membrane.LibAV.Telemetry`."
+    ]
+  )
+
+  @impl true
+  def handle_init(_ctx, opts) do
+    {[],
+     %{
+       location: opts.location,
+       zero_copy: opts.zero_copy,
+       memory_limit: opts.memory_limit,
+       ctx: nil,
+       eof?: false,
+       streams: %{},
+       telemetry_interval: opts.telemetry_interval
+     }}
+  end
+
+  @impl true
+  def handle_setup(_ctx, state) do
+    path = Path.expand(state.location)
+
+    nif_opts = %{zero_copy: state.zero_copy, memory_limit: state.memory_limit}
+
+    case LibAV.demuxer_open_file(path, nif_opts) do
+      {:ok, ctx} -> {[], %{state | ctx: ctx}}
+      {:error, reason} -> raise "Cannot demux #{path}: #{reason}"
+    end
+  end
+
+  @impl true
+  def handle_playing(_ctx, state) do
+    {:ok, streams} = LibAV.demuxer_streams(state.ctx)
+    probe = LibAV.demuxer_probe_stats(state.ctx)
+
+    Membrane.Logger.debug("Found #{probe.format} header, #{probe.bytes_probed} bytes read")
+
+    actions =
+      Enum.map(streams, fn stream ->
+        {:notify_parent, {:new_stream, %{stream | codec_name: to_string(stream.codec_name)}}}
+      end)
+
+    {actions ++ LibAV.Telemetry.start_timer_actions(state.telemetry_interval), state}
+  end
+
+  @impl true
+  def handle_tick(:telemetry, ctx, state) do
+    emit_stats(ctx, state)
+    {[], state}
+  end
+
+  @impl true
+  def handle_event(
+        {Membrane.Pad, :output, _stream_index},
+        event = %LibAV.SeekEvent{},
+        ctx,
+        state
+      ) do
+    seek(event, ctx, state)
+  end
+
+  def handle_event(pad, event, ctx, state), do: super(pad, event, ctx, state)
+
+  @impl true
+  def handle_parent_notification({:seek, stream_index, pts}, ctx, state) do
+    seek(%LibAV.SeekEvent{stream_index: stream_index, pts: pts}, ctx, state)
+  end
+
+  def handle_parent_notification(notification, ctx, state),
+    do: super(notification, ctx, state)
+
+  defp seek(event, ctx, state) do
+    pads = DemuxerOutputs.output_pads(ctx)
+
+    with {:ended, false} <- {:ended, Enum.any?(pads, &ctx.pads[&1].end_of_stream?)},
+         :ok <- LibAV.demuxer_seek(state.ctx, event.stream_index, event.pts) do
+      # Packets read before the seek are dropped, downstream elements are
+      # told to do the same before receiving the new ones.
+      streams = Map.new(state.streams, fn {pad, _buffers} -> {pad, []} end)
+      actions = Enum.map(pads, &{:event, {&1, event}}) ++ Enum.map(pads, &{:redemand, &1})
+      {actions, %{state | streams: streams, eof?: false}}
+    else
+      {:ended, true} ->
+        Membrane.Logger.warning("Cannot seek after the end of stream, ignoring #{inspect(event)}")
+        {[], state}
+
+      {:error, reason} ->
+        Membrane.Logger.warning("Cannot seek to #{inspect(event)}: #{reason}")
+        {[], state}
+    end
+  end
+
+  @impl true
+  def handle_demand({Membrane.Pad, :output, _stream_index}, _size, :buffers, ctx, state) do
+    state = read_packets(ctx, state)
+    DemuxerOutputs.dispatch_buffers(ctx, state, state.eof?)
+  end
+
+  # Reads until the demand of every linked pad can be satisfied. Packets of
+  # streams without a pad are dropped.
+  defp read_packets(ctx, state) do
+    hungry? =
+      Enum.any?(DemuxerOutputs.output_pads(ctx), fn pad ->
+        length(state.streams[pad]) < ctx.pads[pad].demand
+      end)
+
+    if state.eof? or not hungry? do
+      state
+    else
+      case LibAV.demuxer_read_packets(state.ctx, @batch_packets, @batch_bytes) do
+        {:ok, packets} ->
+          read_packets(ctx, load_packets(state, packets))
+
+        {:eof, packets} ->
+          emit_stats(ctx, state)
+          %{load_packets(state, packets) | eof?: true}
+
+        {:error, reason} ->
+          raise to_string(reason)
+      end
+    end
+  end
+
+  defp load_packets(state, packets) do
+    packets
+    |> Enum.group_by(&{Membrane.Pad, :output, &1.stream_index})
+    |> Enum.reduce(state, fn {pad, packets}, state ->
+      if Map.has_key?(state.streams, pad) do
+        buffers = Enum.map(packets, &LibAV.Packet.to_buffer/1)
+
+        update_in(state, [:streams, pad], &(&1 ++ buffers))
+      else
+        state
+      end
+    end)
+  end
+
+  defp emit_stats(ctx, state) do
+    LibAV.Telemetry.emit(:demuxer, LibAV.demuxer_stats(state.ctx), ctx, __MODULE__)
+  end
+end
@@ -0,0 +1,127 @@
+defmodule Membrane.LibAV.Format do
+  @moduledoc false
+  # Translates the raw formats of Membrane to the names used by libav, and
+  # the stream formats of the decoders back to Membrane formats.
+
+  @doc """
+  Returns the libav sample format of a `Membrane.RawAudio` sample format.
+  libav only handles samples in the native byte order.
+  """
+  @spec sample_format!(Membrane.RawAudio.SampleFormat.t()) :: atom()
+  def sample_format!(sample_format) do
+    case Membrane.RawAudio.SampleFormat.to_tuple(sample_format) do
+      {:u, 8, _endianness} -> :u8
+      {:s, 16, endianness} -> native!(:s16, endianness)
+      {:s, 32, endianness} -> native!(:s32, endianness)
+      {:f, 32, endianness} -> native!(:flt, endianness)
+      {:f, 64, endianness} -> native!(:dbl, endianness)
+      _other -> raise "Sample format #{inspect(sample_format)} not supported"
+    end
+  end
+
+  @doc """
+  Returns the libav pixel format of a `Membrane.RawVideo` pixel format.
+  """
+  @spec pixel_format!(Membrane.RawVideo.pixel_format_t()) :: atom()
+  def pixel_format!(pixel_format) do
+    case pixel_format do
+      :I420 -> :yuv420p
+      :I422 -> :yuv422p
+      :I444 -> :yuv444p
+      :NV12 -> :nv12
+      :NV21 -> :nv21
+      :YUY2 -> :yuyv422
+      :RGB -> :rgb24
+      :RGBA -> :rgba
+      :BGRA -> :bgra
+      other -> raise "Pixel format #{inspect(other)} not supported"
+    end
+  end
+
+  @doc """
+  Returns the `Membrane.RawAudio` format of the frames described by the
+  stream format of a decoder.
+  """
+  @spec raw_audio!(map()) :: Membrane.RawAudio.t()
+  def raw_audio!(stream_format) do
+    {sample_type, sample_size} =
+      case to_string(stream_format.sample_format) do
+        "u8" -> {:u, 8}
+        "s16" -> {:s, 16}
+        "s32" -> {:s, 32}
+        "flt" -> {:f, 32}
+        "dbl" -> {:f, 64}
+        other -> raise "Sample format #{inspect(other)} not supported"
+      end
+
+    endianness =
+      case System.endianness() do
+        :little -> :le
+        :big -> :be
+      end
+
+    %Membrane.RawAudio{
+      sample_rate: stream_format.sample_rate,
+      channels: stream_format.channels,
+      sample_format:
+        Membrane.RawAudio.SampleFormat.from_tuple({sample_type, sample_size, endianness})
+    }
+  end
+
+  @doc """
+  Returns the `Membrane.RawVideo` format of the pictures described by the
+  stream format of a decoder.
+  """
+  @spec raw_video!(map()) :: Membrane.RawVideo.t()
+  def raw_video!(stream_format) do
+    pixel_format =
+      case to_string(stream_format.pixel_format) do
+        "yuv420p" -> :I420
+        "yuv422p" -> :I422
+        "yuv444p" -> :I444
+        "nv12" -> :NV12
+        "nv21" -> :NV21
+        "yuyv422" -> :YUY2
+        "rgb24" -> :RGB
+        "rgba" -> :RGBA
+        "bgra" -> :BGRA
+        other -> raise "Pixel format #{inspect(other)} not supported"
+      end
+
+    framerate =
+      case stream_format.framerate do
+        {0, _den} -> nil
+        framerate -> framerate
+      end
+
+    %Membrane.RawVideo{
+      width: stream_format.width,
+      height: stream_format.height,
+      pixel_format: pixel_format,
+      framerate: framerate,
+      aligned: true
+    }
+  end
+
+  @doc """
+  Returns the raw format of the frames described by the stream format of a
+  decoder, audio or video.
+  """
+  @spec raw!(map()) :: Membrane.RawAudio.t() | Membrane.RawVideo.t()
+  def raw!(stream_format = %{pixel_format: _pixel_format}), do: raw_video!(stream_format)
+  def raw!(stream_format), do: raw_audio!(stream_format)
+
+  defp native!(sample_format, endianness) do
+    native =
+      case System.endianness() do
+        :little -> :le
+        :big -> :be
+      end
+
+    if endianness not in [native, :any] do
+      raise "Only #{native} samples are supported, got #{endianness}"
+    end
+
+    sample_format
+  end
+end
@@ -0,0 +1,38 @@
+defmodule Membrane.LibAV.Frame do
+  @moduledoc false
+  # Conversions between Membrane buffers and the packets and frames of the
+  # decoding NIFs. Timestamps are left in the time base of the stream.
+
+  def packet(nil), do: nil
+
+  def packet(buffer) do
+    %{
+      data: buffer.payload,
+      pts: buffer.pts,
+      dts: buffer.dts
+    }
+  end
+
+  # Turns the result of a decoding NIF into buffers, raising on errors.
+  def to_buffers(result) do
+    case result do
+      {key, frames} when key in [:ok, :eof] ->
+        buffers =
+          Enum.map(frames, fn frame ->
+            %Membrane.Buffer{
+              payload: frame.data,
+              pts: frame.pts
+            }
+          end)
+
+        {key, buffers}
+
+      {:error, error} ->
+        raise to_string(error)
+
+      # A batch that failed midway, see decoder_add_packets/2.
+      {:error, error, _frames} ->
+        raise to_string(error)
+    end
+  end
+end
@@ -0,0 +1,238 @@
+defmodule Membrane.LibAV.MultiDecoder do
+  @moduledoc """
+  Decodes several audio streams of the same input in a single element, e.g.
+  the language tracks of a movie, instead of one `Membrane.LibAV.Decoder`
+  per stream. Each stream gets its own decoder and all of them run on the
+  threads of a `Membrane.LibAV.WorkerPool`: the streams are decoded in
+  parallel, while the frames of each one keep their order.
+
+  Pads are referenced by the index of their stream, as the outputs of
+  `Membrane.LibAV.Demuxer`. The packets received on
+  `Pad.ref(:input, stream_index)`, linked with the `stream` announced by the
+  demuxer, are decoded to `Pad.ref(:output, stream_index)`.
+  """
+  use Membrane.Filter
+
+  alias Membrane.LibAV
+
+  def_options(
+    pool: [
+      spec: Membrane.LibAV.WorkerPool.t() | nil,
+      default: nil,
+      description:
+        "Pool decoding the streams. When nil, `Membrane.LibAV.WorkerPool.default/0` is used."
+    ],
+    decoder_pool: [
+      spec: Membrane.LibAV.DecoderPool.t() | nil,
+      default: nil,
+      description: "Pool the codecs are taken from, see `Membrane.LibAV.Decoder`."
+    ],
+    thread_count: [
+      spec: non_neg_integer() | :auto,
+      default: :auto,
+      description: "Threads used by each codec, see `Membrane.LibAV.Decoder`."
+    ],
+    thread_type: [
+      spec: :frame | :slice | :auto,
+      default: :auto,
+      description: "Threading of each codec, see `Membrane.LibAV.Decoder`."
+    ],
+    codec_options: [
+      spec: %{optional(atom() | String.t()) => String.Chars.t()},
+      default: %{},
+      description: "Private options of every codec, as accepted by the ffmpeg command line."
+    ],
+    output_format: [
+      spec: Membrane.RawAudio.t() | nil,
+      default: nil,
+      description: "Format of the decoded audio of every stream, see `Membrane.LibAV.Decoder`."
+    ],
+    chunk_size: [
+      spec: {:samples, pos_integer()} | {:duration, Membrane.Time.t()} | nil,
+      default: nil,
+      description: "Size of the output buffers of every stream, see `Membrane.LibAV.Decoder`."
+    ],
+    memory_limit: [
+      spec: pos_integer() | nil,
+      default: nil,
+      description: "Memory limit of each decoder, see `Membrane.LibAV.Decoder`."
+    ],
+    telemetry_interval: [
+      spec: Membrane.Time.t() | nil,
+      default: Membrane.Time.seconds(10),
+      description: "Interval of the stats telemetry events, see `Membrane.LibAV.Telemetry`."
+    ]
+  )
+
+  def_input_pad(:input,
+    availability: :on_request,
+    accepted_format: Membrane.RemoteStream,
+    flow_control: :auto,
+    options: [
+      stream: [
+        spec: map(),
+        description: "Stream information as provided by the demuxer"
+      ]
+    ]
+  )
+
+  def_output_pad(:output,
+    availability: :on_request,
+    accepted_format: Membrane.RawAudio,
+    flow_control: :auto
+  )
+
+  @impl true
+  def handle_init(_ctx, opts) do
+    pool = opts.pool || LibAV.WorkerPool.default()
+    {:ok, ctx} = LibAV.multi_decoder_alloc(pool)
+
+    {[],
+     %{
+       ctx: ctx,
+       opts: opts,
+       # Packets the pool queues at most, larger batches are split.
+       max_jobs: LibAV.WorkerPool.stats(pool).max_jobs,
+       # Decoder contexts by stream index.
+       decoders: %{},
+       # Output formats by stream index, sent once the output pad is linked.
+       stream_formats: %{},
+       # Seek events waiting for the pool to flush the decoder, by stream
+       # index.
+       pending_seeks: %{},
+       # Batches waiting for room in the queue of the pool.
+       backlog: %LibAV.Backlog{},
+       telemetry_interval: opts.telemetry_interval
+     }}
+  end
+
+  @impl true
+  def handle_pad_added(pad = {Membrane.Pad, :input, index}, ctx, state) do
+    stream = ctx.pads[pad].options.stream
+
+    if stream.codec_type != :audio do
+      raise "Unsupported codec_type != :audio"
+    end
+
+    {:ok, decoder} =
+      LibAV.decoder_alloc_context(
+        stream.codec_id,
+        stream.codec_params,
+        LibAV.Decoder.nif_options(stream, state.opts)
+      )
+
+    :ok = LibAV.multi_decoder_add_stream(state.ctx, index, decoder)
+
+    state =
+      state
+      |> put_in([:decoders, index], decoder)
+      |> put_in([:pending_seeks, index], :queue.new())
+
+    {[], state}
+  end
+
+  def handle_pad_added(pad = {Membrane.Pad, :output, index}, _ctx, state) do
+    case state.stream_formats do
+      %{^index => stream_format} -> {[stream_format: {pad, stream_format}], state}
+      _formats -> {[], state}
+    end
+  end
+
+  @impl true
+  def handle_playing(_ctx, state) do
+    {LibAV.Telemetry.start_timer_actions(state.telemetry_interval), state}
+  end
+
+  @impl true
+  def handle_tick(:telemetry, ctx, state) do
+    Enum.each(state.decoders, fn {index, _decoder} -> emit_stats(ctx, state, index) end)
+    {[], state}
+  end
+
+  @impl true
+  def handle_stream_format({Membrane.Pad, :input, index}, _format, ctx, state) do
+    stream_format =
+      state.decoders[index]
+      |> LibAV.decoder_stream_format()
+      |> LibAV.Format.raw_audio!()
+
+    state = put_in(state, [:stream_formats, index], stream_format)
+
+    # The output pad might be linked later on, it then gets the format.
+    if Map.has_key?(ctx.pads, output(index)) do
+      {[stream_format: {output(index), stream_format}], state}
+    else
+      {[], state}
+    end
+  end
+
+  @impl true
+  def handle_event({Membrane.Pad, :input, index}, event = %LibAV.SeekEvent{}, _ctx, state) do
+    # Frames decoded before the seek are still on their way.
+    state = add_packets(state, [{index, :flush}])
+    {[], update_in(state, [:pending_seeks, index], &:queue.in(event, &1))}
+  end
+
+  def handle_event(pad, event, ctx, state), do: super(pad, event, ctx, state)
+
+  @impl true
+  def handle_end_of_stream({Membrane.Pad, :input, index}, _ctx, state) do
+    # The end of stream is forwarded once the pool has drained the decoder.
+    {[], add_packets(state, [{index, nil}])}
+  end
+
+  @impl true
+  def handle_buffer({Membrane.Pad, :input, index}, buffer, _ctx, state) do
+    {[], add_packets(state, [{index, LibAV.Frame.packet(buffer)}])}
+  end
+
+  @impl true
+  def handle_buffers_batch({Membrane.Pad, :input, index}, buffers, _ctx, state) do
+    # One native call queues each part of the batch that fits in the pool.
+    state =
+      buffers
+      |> Enum.map(&{index, LibAV.Frame.packet(&1)})
+      |> Enum.chunk_every(state.max_jobs)
+      |> Enum.reduce(state, &add_packets(&2, &1))
+
+    {[], state}
+  end
+
+  @impl true
+  def handle_info(:libav_submit_backlog, _ctx, state) do
+    {[], %{state | backlog: LibAV.Backlog.retry(state.backlog, add_packets_fun(state))}}
+  end
+
+  def handle_info({:libav_decoder, index, {:flushed, []}}, _ctx, state = %{decoders: decoders})
+      when is_map_key(decoders, index) do
+    {{:value, event}, pending_seeks} = :queue.out(state.pending_seeks[index])
+    {[event: {output(index), event}], put_in(state, [:pending_seeks, index], pending_seeks)}
+  end
+
+  def handle_info({:libav_decoder, index, result}, ctx, state = %{decoders: decoders})
+      when is_map_key(decoders, index) do
+    case LibAV.Frame.to_buffers(result) do
+      {:ok, buffers} ->
+        {[buffer: {output(index), buffers}], state}
+
+      {:eof, buffers} ->
+        emit_stats(ctx, state, index)
+        {[buffer: {output(index), buffers}, end_of_stream: output(index)], state}
+    end
+  end
+
+  defp add_packets(state, packets) do
+    %{state | backlog: LibAV.Backlog.submit(state.backlog, packets, add_packets_fun(state))}
+  end
+
+  defp add_packets_fun(state) do
+    &LibAV.multi_decoder_add_packets(state.ctx, &1)
+  end
+
+  defp emit_stats(ctx, state, index) do
+    stats = LibAV.decoder_stats(state.decoders[index])
+    LibAV.Telemetry.emit(:decoder, stats, ctx, __MODULE__, %{stream_index: index})
+  end
+
+  defp output(index), do: {Membrane.Pad, :output, index}
+end
@@ -0,0 +1,126 @@
+defmodule Membrane.LibAV.Muxer do
+  @moduledoc """
+  Writes encoded packets in a container without decoding them, e.g. to remux
+  the streams of `Membrane.LibAV.Demuxer` from mp4 to MPEG-TS or Matroska.
+
+  Each input pad carries one stream and is linked with the `stream` option,
+  the map announced by `Membrane.LibAV.Demuxer` or `Membrane.LibAV.Encoder`.
+  Every pad must be linked before the first buffer arrives, when the header
+  is written. The output is the byte stream of the container.
+
+  The output cannot be seeked, hence formats that need to rewrite data at
+  the end must be told not to, e.g. mp4 with
+  `options: %{"movflags" => "frag_keyframe+empty_moov"}`.
+  """
+  use Membrane.Filter
+
+  alias Membrane.LibAV
+
+  def_options(
+    format: [
+      spec: String.t(),
+      description: "Name of the libav muxer, as listed by `ffmpeg -muxers`."
+    ],
+    options: [
+      spec: %{optional(atom() | String.t()) => String.Chars.t()},
+      default: %{},
+      description: "Options of the muxer, as accepted by the ffmpeg command line."
+    ]
+  )
+
+  def_input_pad(:input,
+    availability: :on_request,
+    accepted_format: Membrane.RemoteStream,
+    flow_control: :auto,
+    options: [
+      stream: [
+        spec: map(),
+        description: "Stream information as provided by the demuxer or the encoder"
+      ]
+    ]
+  )
+
+  def_output_pad(:output,
+    availability: :always,
+    accepted_format: Membrane.RemoteStream,
+    flow_control: :auto
+  )
+
+  @impl true
+  def handle_init(_ctx, opts) do
+    options = Map.new(opts.options, fn {k, v} -> {to_string(k), to_string(v)} end)
+
+    ctx =
+      case LibAV.muxer_alloc_context(opts.format, %{options: options}) do
+        {:ok, ctx} -> ctx
+        {:error, reason} -> raise "Cannot open muxer #{opts.format}: #{inspect(reason)}"
+      end
+
+    {[], %{ctx: ctx, streams: %{}, header_written?: false}}
+  end
+
+  @impl true
+  def handle_pad_added(pad = {Membrane.Pad, :input, _id}, ctx, state) do
+    if state.header_written? do
+      raise "Cannot add #{inspect(pad)}, the header has already been written"
+    end
+
+    stream = ctx.pads[pad].options.stream
+
+    {:ok, index} = LibAV.muxer_add_stream(state.ctx, stream.codec_params, stream.time_base)
+
+    # Packets coming from other elements carry no keyframe flag, in which
+    # case only audio packets are assumed to be keyframes.
+    {[], put_in(state, [:streams, pad], {index, stream.codec_type == :audio})}
+  end
+
+  @impl true
+  def handle_playing(_ctx, state) do
+    {[stream_format: {:output, %Membrane.RemoteStream{type: :bytestream}}], state}
+  end
+
+  @impl true
+  def handle_stream_format({Membrane.Pad, :input, _id}, _format, _ctx, state) do
+    {[], state}
+  end
+
+  @impl true
+  def handle_buffer(pad = {Membrane.Pad, :input, _id}, buffer, _ctx, state) do
+    {header, state} = write_header(state)
+    {index, keyframe} = state.streams[pad]
+    packet = LibAV.Packet.from_buffer(buffer, index, keyframe)
+    output = write!(LibAV.muxer_write_packets(state.ctx, [packet]))
+
+    {[buffer: {:output, to_buffers([header, output])}], state}
+  end
+
+  @impl true
+  def handle_end_of_stream({Membrane.Pad, :input, _id}, ctx, state) do
+    if Enum.all?(input_pads(ctx), &ctx.pads[&1].end_of_stream?) do
+      {header, state} = write_header(state)
+      trailer = write!(LibAV.muxer_write_trailer(state.ctx))
+      {[buffer: {:output, to_buffers([header, trailer])}, end_of_stream: :output], state}
+    else
+      {[], state}
+    end
+  end
+
+  defp write_header(state = %{header_written?: true}), do: {<<>>, state}
+
+  defp write_header(state) do
+    {write!(LibAV.muxer_write_header(state.ctx)), %{state | header_written?: true}}
+  end
+
+  defp write!({:ok, output}), do: output
+  defp write!({:error, reason}), do: raise("Muxing failed: #{inspect(reason)}")
+
+  defp to_buffers(outputs) do
+    for output <- outputs, output != <<>>, do: %Membrane.Buffer{payload: output}
+  end
+
+  defp input_pads(ctx) do
+    ctx.pads
+    |> Map.keys()
+    |> Enum.filter(&match?({Membrane.Pad, :input, _id}, &1))
+  end
+end
@@ -0,0 +1,28 @@
+defmodule Membrane.LibAV.Packet do
+  @moduledoc false
+  # Conversions between the packet maps of the NIFs and Membrane buffers.
+  # Timestamps stay in the time base of the stream, the keyframe flag and
+  # the duration travel in the metadata.
+
+  def to_buffer(packet) do
+    %Membrane.Buffer{
+      pts: packet.pts,
+      dts: packet.dts,
+      payload: packet.data,
+      metadata: %{keyframe: packet.keyframe, duration: packet.duration}
+    }
+  end
+
+  # Buffers produced by other elements carry no flags: keyframe tells
+  # whether their packets are keyframes.
+  def from_buffer(buffer, stream_index, keyframe) do
+    %{
+      stream_index: stream_index,
+      data: buffer.payload,
+      pts: buffer.pts,
+      dts: buffer.dts || buffer.pts,
+      duration: Map.get(buffer.metadata, :duration, 0),
+      keyframe: Map.get(buffer.metadata, :keyframe, keyframe)
+    }
+  end
+end
@@ -0,0 +1,18 @@
+defmodule Membrane.LibAV.SeekEvent do
+  @moduledoc """
+  Makes `Membrane.LibAV.FileDemuxer` resume demuxing from the last keyframe
+  of `stream_index` at or before `pts`, expressed in the time base of the
+  stream. Send it upstream on any output pad of the demuxer, or have the
+  parent notify the demuxer with `{:seek, stream_index, pts}`.
+
+  Once the demuxer has seeked, the event is forwarded downstream on each of
+  its output pads, ahead of the first buffer read at the new position.
+  `Membrane.LibAV.Decoder` drops the data it buffered when receiving it.
+  """
+  @derive Membrane.EventProtocol
+
+  @enforce_keys [:stream_index, :pts]
+  defstruct @enforce_keys
+
+  @type t :: %__MODULE__{stream_index: non_neg_integer(), pts: integer()}
+end
@@ -0,0 +1,40 @@
+defmodule Membrane.LibAV.Telemetry do
+  @moduledoc """
+  `:telemetry` events emitted by the elements of this plugin, every
+  `telemetry_interval` and once more at the end of the stream. Each element
+  takes a `telemetry_interval` option, 10 seconds by default. When it is
+  nil, events are only emitted at the end of the stream.
+
+  * `[:membrane_libav, :demuxer, :stats]`, by `Membrane.LibAV.Demuxer` and
+    `Membrane.LibAV.FileDemuxer`, with the measurements returned by
+    `Membrane.LibAV.demuxer_stats/1`.
+  * `[:membrane_libav, :decoder, :stats]`, by `Membrane.LibAV.Decoder`, with
+    the measurements returned by `Membrane.LibAV.decoder_stats/1`, and by
+    `Membrane.LibAV.MultiDecoder`, once for each stream.
+  * `[:membrane_libav, :encoder, :stats]`, by `Membrane.LibAV.Encoder`, with
+    the measurements returned by `Membrane.LibAV.encoder_stats/1`.
+
+  Measurements are cumulative since the element started, `nif_time` is in
+  nanoseconds. The demuxer also reports `time_to_header`, the nanoseconds
+  elapsed from the first input byte to the header being read, 0 until then,
+  and `read_ahead_time`, the nanoseconds its read-ahead thread spent parsing
+  packets, 0 when it has none. Demuxers and decoders report `memory`, the
+  native bytes they currently hold, and `memory_peak`, the most they held.
+  The metadata holds the `element` name and the `module` that emitted the
+  event, plus the `stream_index` for the events of
+  `Membrane.LibAV.MultiDecoder`.
+  """
+
+  @doc false
+  def emit(kind, stats, ctx, module, metadata \\ %{}) do
+    :telemetry.execute(
+      [:membrane_libav, kind, :stats],
+      stats,
+      Map.merge(metadata, %{element: ctx.name, module: module})
+    )
+  end
+
+  @doc false
+  def start_timer_actions(nil), do: []
+  def start_timer_actions(interval), do: [start_timer: {:telemetry, interval}]
+end
@@ -0,0 +1,82 @@
+defmodule Membrane.LibAV.WorkerPool do
+  @moduledoc """
+  A pool of native threads decoding packets on behalf of
+  `Membrane.LibAV.Decoder` elements running in `:async` mode. Decoding
+  happens outside of the BEAM schedulers and the decoded frames are
+  delivered back to the decoder process as messages.
+
+  A pool queues a bounded number of packets: once it is full, submissions
+  fail with `{:error, :busy}` and the decoders hold their packets back
+  until it drains. Batches larger than the whole queue are refused with
+  `{:error, :batch_too_large}`, `Membrane.LibAV.MultiDecoder` splits them.
+
+  The threads of a pool are stopped by `close/1`, or when the pool is
+  garbage collected.
+  """
+
+  alias Membrane.LibAV
+
+  @type t :: reference()
+
+  @doc """
+  Starts a new pool with the given number of threads, one per online
+  scheduler by default.
+
+  Options:
+  * `max_jobs`: packets the pool queues at most, across every decoder.
+    Defaults to 1024.
+  """
+  @spec new(pos_integer(), max_jobs: pos_integer()) :: {:ok, t()} | {:error, atom()}
+  def new(threads \\ System.schedulers_online(), opts \\ []) do
+    LibAV.worker_pool_alloc(threads, Keyword.get(opts, :max_jobs, 1024))
+  end
+
+  @doc """
+  Stops the pool once the packets already queued are decoded, waiting for
+  its threads to exit. Packets submitted afterwards are refused with
+  `{:error, :closed}`.
+  """
+  @spec close(t()) :: :ok
+  def close(pool) do
+    LibAV.worker_pool_close(pool)
+  end
+
+  @doc """
+  Returns the pool shared by every decoder that does not provide its own,
+  starting it on first use.
+  """
+  @spec default() :: t()
+  def default() do
+    case :persistent_term.get(__MODULE__, nil) do
+      nil ->
+        :global.trans(
+          {__MODULE__, self()},
+          fn ->
+            with nil <- :persistent_term.get(__MODULE__, nil) do
+              {:ok, pool} = new()
+              :persistent_term.put(__MODULE__, pool)
+              pool
+            end
+          end,
+          [node()]
+        )
+
+      pool ->
+        pool
+    end
+  end
+
+  @doc """
+  Returns the metrics of the pool, useful to size it:
+  * `threads`, `busy_threads`: threads started and currently decoding.
+  * `queued`, `max_queued`: packets waiting to be decoded, now and at peak.
+  * `max_jobs`: packets the pool queues at most.
+  * `submitted`, `completed`, `frames`: packets and frames processed so far.
+  * `busy_time`, `wait_time`: cumulative nanoseconds spent decoding and
+    waiting in the queue.
+  """
+  @spec stats(t()) :: map()
+  def stats(pool) do
+    LibAV.worker_pool_stats(pool)
+  end
+end
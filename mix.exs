@@ -28,11 +28,13 @@ defmodule Membrane.LibAV.MixProject do
       {:membrane_file_plugin, "~> 0.15.0", only: :test},
       {:elixir_make, "~> 0.6", runtime: false},
       {:membrane_raw_audio_format, "~> 0.11.0"},
+      {:membrane_raw_video_format, "~> 0.3.0"},
+      {:telemetry, "~> 1.0"},
+      {:benchee, "~> 1.1", only: :dev},
 
       # TMP deps
       # {:membrane_aac_plugin, "~> 0.16.1"},
-      {:membrane_aac_fdk_plugin, "~> 0.16.0", only: :test},
-      {:membrane_ffmpeg_swresample_plugin, "~> 0.17.3", only: :test}
+      {:membrane_aac_fdk_plugin, "~> 0.16.0", only: [:dev, :test]}
     ]
   end
 
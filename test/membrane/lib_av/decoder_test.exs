@@ -0,0 +1,417 @@
+defmodule Membrane.LibAV.DecoderTest do
+  use ExUnit.Case
+  import Membrane.Testing.Assertions
+
+  alias Membrane.LibAV
+  alias Membrane.LibAV.Support.Demux
+
+  defmodule MultiDecoderPipeline do
+    use Membrane.Pipeline
+    import Membrane.ChildrenSpec
+
+    alias Membrane.LibAV
+
+    # The same file demuxed twice stands for two audio streams.
+    @impl true
+    def handle_init(_ctx, _opts) do
+      demuxers =
+        for index <- [1, 2] do
+          child({:demuxer, index}, %LibAV.FileDemuxer{location: "test/data/safari.mp4"})
+        end
+
+      {[spec: [child(:decoder, LibAV.MultiDecoder) | demuxers]], %{}}
+    end
+
+    @impl true
+    def handle_child_notification(
+          {:new_stream, stream = %{codec_type: :audio}},
+          {:demuxer, index},
+          _ctx,
+          state
+        ) do
+      spec =
+        get_child({:demuxer, index})
+        |> via_out(Pad.ref(:output, stream.stream_index))
+        |> via_in(Pad.ref(:input, index), options: [stream: stream])
+        |> get_child(:decoder)
+        |> via_out(Pad.ref(:output, index))
+        |> child({:sink, index}, Membrane.Testing.Sink)
+
+      {[spec: spec], state}
+    end
+
+    def handle_child_notification(_notification, _child, _ctx, state) do
+      {[], state}
+    end
+  end
+
+  setup_all do
+    {streams, packets} = Demux.demux("test/data/safari.mp4")
+    stream = Enum.find(streams, &(&1.codec_type == :audio))
+    packets = Enum.filter(packets, &(&1.stream_index == stream.stream_index))
+
+    %{stream: stream, packets: packets}
+  end
+
+  defp decode_sync(fun, stream, packets, opts \\ %{}) do
+    {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, opts)
+
+    frames =
+      Enum.flat_map(packets, fn packet ->
+        {:ok, frames} = fun.(ctx, packet)
+        frames
+      end)
+
+    {:eof, rest} = fun.(ctx, nil)
+    frames ++ rest
+  end
+
+  defp receive_frames(ctx, acc) do
+    receive do
+      {:libav_decoder, ^ctx, {:ok, frames}} -> receive_frames(ctx, acc ++ frames)
+      {:libav_decoder, ^ctx, {:eof, frames}} -> acc ++ frames
+    after
+      5_000 -> flunk("decoder did not drain")
+    end
+  end
+
+  describe "decoder" do
+    test "emits one buffer per frame", %{stream: stream, packets: packets} do
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+      %{channels: channels} = LibAV.decoder_stream_format(ctx)
+
+      frames =
+        Enum.flat_map(packets, fn packet ->
+          {:ok, frames} = LibAV.decoder_add_data(ctx, packet)
+          frames
+        end)
+
+      # AAC frames hold 1024 float samples per channel.
+      assert Enum.all?(frames, &(byte_size(&1.data) == 1024 * channels * 4))
+
+      pts = Enum.map(frames, & &1.pts)
+      assert pts == Enum.sort(pts)
+      assert pts == Enum.uniq(pts)
+    end
+
+    test "tracks runtime stats", %{stream: stream, packets: packets} do
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      frames =
+        Enum.flat_map(packets ++ [nil], fn packet ->
+          {_key, frames} = LibAV.decoder_add_data(ctx, packet)
+          frames
+        end)
+
+      assert %{packets: count, frames: decoded, errors: 0, nif_time: time} =
+               LibAV.decoder_stats(ctx)
+
+      assert count == length(packets)
+      assert decoded == length(frames)
+      assert time > 0
+    end
+
+    test "decodes again once flushed", %{stream: stream, packets: packets} do
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      decode = fn ->
+        Enum.flat_map(packets ++ [nil], fn packet ->
+          {_key, frames} = LibAV.decoder_add_data(ctx, packet)
+          frames
+        end)
+      end
+
+      frames = decode.()
+      assert {:flushed, []} = LibAV.decoder_add_data(ctx, :flush)
+      assert Enum.map(decode.(), & &1.pts) == Enum.map(frames, & &1.pts)
+    end
+
+    test "decodes batches of packets", %{stream: stream, packets: packets} do
+      frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets)
+
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+      {head, tail} = Enum.split(packets, 10)
+      assert {:ok, head_frames} = LibAV.decoder_add_packets(ctx, head)
+      assert {:ok, tail_frames} = LibAV.decoder_add_packets_dirty(ctx, tail)
+      assert {:eof, rest} = LibAV.decoder_add_data(ctx, nil)
+
+      assert Enum.map(head_frames ++ tail_frames ++ rest, &{&1.pts, &1.data}) ==
+               Enum.map(frames, &{&1.pts, &1.data})
+
+      assert %{packets: count} = LibAV.decoder_stats(ctx)
+      assert count == length(packets)
+
+      # The end of stream is not part of a batch.
+      assert_raise ArgumentError, fn -> LibAV.decoder_add_packets(ctx, [nil]) end
+    end
+
+    test "yields during long batches", %{stream: stream, packets: packets} do
+      # Long enough to use up several timeslices, the call is then
+      # rescheduled with the frames decoded so far.
+      batch = packets |> List.duplicate(20) |> List.flatten()
+
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+      assert {:ok, frames} = LibAV.decoder_add_packets(ctx, batch)
+      assert {:eof, rest} = LibAV.decoder_add_data(ctx, nil)
+
+      expected = decode_sync(&LibAV.decoder_add_data/2, stream, batch)
+      assert length(frames ++ rest) == length(expected)
+
+      assert Enum.map(frames ++ rest, &{&1.pts, &1.data}) ==
+               Enum.map(expected, &{&1.pts, &1.data})
+    end
+
+    test "checks the packets it decodes", %{stream: stream, packets: [packet | _]} do
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      assert_raise ArgumentError, fn -> LibAV.decoder_add_data(ctx, %{packet | data: nil}) end
+      assert_raise ArgumentError, fn -> LibAV.decoder_add_packets(ctx, [%{pts: 0}]) end
+
+      # Unknown timestamps are not an error.
+      assert {:ok, _frames} = LibAV.decoder_add_data(ctx, %{packet | pts: nil, dts: nil})
+      assert {:eof, _frames} = LibAV.decoder_add_data(ctx, nil)
+      assert {:eof, []} = LibAV.decoder_add_data(ctx, nil)
+    end
+
+    test "reuses pooled decoders", %{stream: stream, packets: packets} do
+      {:ok, pool} = LibAV.DecoderPool.new(1)
+
+      decode = fn opts ->
+        opts = Map.put(opts, :decoder_pool, pool)
+        frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets, opts)
+
+        # Decoders go back to the pool once their context is collected.
+        :erlang.garbage_collect()
+        Enum.map(frames, &{&1.pts, &1.data})
+      end
+
+      frames = decode.(%{})
+      assert %{hits: 0, misses: 1, returned: 1, idle: 1} = LibAV.DecoderPool.stats(pool)
+
+      assert decode.(%{}) == frames
+      assert %{hits: 1, misses: 1, returned: 2, idle: 1} = LibAV.DecoderPool.stats(pool)
+
+      # Another configuration needs another decoder, the idle one is closed
+      # to make room for it.
+      assert decode.(%{thread_count: 1}) == frames
+      assert %{hits: 1, misses: 2, evicted: 1, idle: 1} = LibAV.DecoderPool.stats(pool)
+    end
+
+    test "reports the threading configuration", %{stream: stream} do
+      {:ok, ctx} =
+        LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{thread_count: 2})
+
+      # AAC does not support threading, libav falls back to a single thread.
+      assert %{thread_count: 1, thread_type: :none} = LibAV.decoder_stream_format(ctx)
+
+      assert {:error, {:unknown_option, ~c"no_such_option"}} =
+               LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{
+                 codec_options: %{"no_such_option" => "1"}
+               })
+    end
+
+    test "converts to the requested output format", %{stream: stream, packets: packets} do
+      opts = %{
+        time_base: stream.time_base,
+        output_sample_format: :s16,
+        output_sample_rate: 48_000,
+        output_channels: 1
+      }
+
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, opts)
+      {:ok, native} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      assert %{channels: 1, sample_rate: 48_000, sample_format: ~c"s16"} =
+               LibAV.decoder_stream_format(ctx)
+
+      %{channels: channels, sample_rate: sample_rate} = LibAV.decoder_stream_format(native)
+
+      frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets, opts)
+      samples = frames |> Enum.map(&div(byte_size(&1.data), 2)) |> Enum.sum()
+
+      native_frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets)
+
+      native_samples =
+        native_frames |> Enum.map(&div(byte_size(&1.data), channels * 4)) |> Enum.sum()
+
+      # The samples buffered by the resampler are flushed on drain.
+      assert_in_delta samples, native_samples * 48_000 / sample_rate, 4
+
+      # Timestamps account for the samples held back by the resampler, so
+      # that frames stay back to back.
+      {num, den} = stream.time_base
+      assert hd(frames).pts <= hd(native_frames).pts
+
+      frames
+      |> Enum.chunk_every(2, 1, :discard)
+      |> Enum.each(fn [frame, next] ->
+        duration = div(byte_size(frame.data), 2) * den / (48_000 * num)
+        assert_in_delta next.pts, frame.pts + duration, 1
+      end)
+    end
+
+    test "decodes on dirty schedulers", %{stream: stream, packets: packets} do
+      assert decode_sync(&LibAV.decoder_add_data_dirty/2, stream, packets) ==
+               decode_sync(&LibAV.decoder_add_data/2, stream, packets)
+    end
+
+    test "regroups samples in chunks", %{stream: stream, packets: packets} do
+      opts = %{time_base: stream.time_base, output_sample_format: :s16}
+      chunk_opts = Map.put(opts, :chunk_samples, 480)
+      frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets, opts)
+      chunks = decode_sync(&LibAV.decoder_add_data/2, stream, packets, chunk_opts)
+
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, chunk_opts)
+
+      assert %{chunk_samples: 480, channels: channels, sample_rate: sample_rate} =
+               LibAV.decoder_stream_format(ctx)
+
+      chunk_size = 480 * channels * 2
+      {last, full} = List.pop_at(chunks, -1)
+      assert Enum.all?(full, &(byte_size(&1.data) == chunk_size))
+      assert byte_size(last.data) in 1..chunk_size
+      assert Enum.map_join(chunks, & &1.data) == Enum.map_join(frames, & &1.data)
+
+      # Timestamps are interpolated from the first sample.
+      {num, den} = stream.time_base
+      [first, second | _] = chunks
+      assert first.pts == hd(frames).pts
+      assert second.pts - first.pts == round(480 * den / (sample_rate * num))
+    end
+
+    test "decodes on a worker pool", %{stream: stream, packets: packets} do
+      {:ok, pool} = LibAV.WorkerPool.new(2)
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      for packet <- packets ++ [nil] do
+        :ok = LibAV.decoder_add_data_async(pool, ctx, packet)
+      end
+
+      assert receive_frames(ctx, []) == decode_sync(&LibAV.decoder_add_data/2, stream, packets)
+
+      assert %{threads: 2, submitted: submitted} = LibAV.WorkerPool.stats(pool)
+      assert submitted == length(packets) + 1
+    end
+
+    test "bounds the queue of a worker pool", %{stream: stream, packets: packets} do
+      {:ok, pool} = LibAV.WorkerPool.new(1, max_jobs: 2)
+      {:ok, multi} = LibAV.multi_decoder_alloc(pool)
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+      :ok = LibAV.multi_decoder_add_stream(multi, 0, ctx)
+
+      # A batch is taken whole or not at all, it never fits when larger
+      # than the queue.
+      batch = for packet <- Enum.take(packets, 3), do: {0, packet}
+      assert {:error, :batch_too_large} = LibAV.multi_decoder_add_packets(multi, batch)
+      assert %{max_jobs: 2, submitted: 0} = LibAV.WorkerPool.stats(pool)
+
+      :ok = LibAV.WorkerPool.close(pool)
+      assert {:error, :closed} = LibAV.decoder_add_data_async(pool, ctx, hd(packets))
+    end
+
+    test "accounts and caps native memory", %{stream: stream, packets: packets} do
+      opts = %{chunk_samples: 480, memory_limit: 1_000_000}
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, opts)
+
+      assert %{current: current, peak: peak, limit: 1_000_000} = LibAV.decoder_memory(ctx)
+      assert current > 0 and peak == current
+
+      # Packets that do not fit are refused before being queued.
+      {:ok, pool} = LibAV.WorkerPool.new(1)
+      packet = %{hd(packets) | data: :binary.copy(<<0>>, 1_000_000)}
+      assert {:error, :memory_limit} = LibAV.decoder_add_data_async(pool, ctx, packet)
+      assert LibAV.decoder_memory(ctx).current == current
+
+      # The buffers of the chunks stay charged to the decoder.
+      {:ok, [_ | _] = chunks} = LibAV.decoder_add_packets(ctx, Enum.take(packets, 10))
+      chunk_bytes = chunks |> Enum.map(&byte_size(&1.data)) |> Enum.sum()
+      assert LibAV.decoder_memory(ctx).current >= current + chunk_bytes
+
+      assert {:error, :memory_limit} =
+               LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{
+                 memory_limit: 1
+               })
+    end
+
+    test "decodes several streams on a worker pool", %{stream: stream, packets: packets} do
+      {:ok, pool} = LibAV.WorkerPool.new(2)
+      {:ok, multi} = LibAV.multi_decoder_alloc(pool)
+
+      # The same track decoded twice stands for two streams of a file.
+      for index <- [1, 2] do
+        {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+        :ok = LibAV.multi_decoder_add_stream(multi, index, ctx)
+      end
+
+      assert_raise ArgumentError, fn -> LibAV.multi_decoder_add_packets(multi, [{0, nil}]) end
+
+      entries = for packet <- packets ++ [nil], index <- [1, 2], do: {index, packet}
+      :ok = LibAV.multi_decoder_add_packets(multi, entries)
+
+      expected = decode_sync(&LibAV.decoder_add_data/2, stream, packets)
+      assert receive_frames(1, []) == expected
+      assert receive_frames(2, []) == expected
+    end
+
+    test "decodes several streams in a pipeline" do
+      pid = Membrane.Testing.Pipeline.start_link_supervised!(module: MultiDecoderPipeline)
+
+      for index <- [1, 2] do
+        assert_sink_stream_format(pid, {:sink, index}, %Membrane.RawAudio{}, 5_000)
+        assert_sink_buffer(pid, {:sink, index}, %Membrane.Buffer{}, 5_000)
+        assert_end_of_stream(pid, {:sink, index}, :input, 10_000)
+      end
+
+      :ok = Membrane.Testing.Pipeline.terminate(pid)
+    end
+
+    test "decodes and converts video" do
+      {width, height} = {64, 48}
+      # A gray I420 picture.
+      picture = :binary.copy(<<128>>, div(width * height * 3, 2))
+
+      {:ok, encoder} =
+        LibAV.encoder_alloc_context("mpeg4", %{
+          pixel_format: :yuv420p,
+          width: width,
+          height: height,
+          framerate: {25, 1},
+          time_base: {1, 25}
+        })
+
+      stream = LibAV.encoder_stream(encoder)
+
+      packets =
+        Enum.flat_map(0..9, fn pts ->
+          {:ok, packets} = LibAV.encoder_add_data(encoder, %{data: picture, pts: pts})
+          packets
+        end)
+
+      {:eof, rest} = LibAV.encoder_add_data(encoder, nil)
+      packets = packets ++ rest
+
+      opts = %{time_base: stream.time_base, thread_type: :frame, thread_count: 2}
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, opts)
+
+      assert %{width: ^width, height: ^height, pixel_format: ~c"yuv420p"} =
+               LibAV.decoder_stream_format(ctx)
+
+      frames = decode_sync(&LibAV.decoder_add_data/2, stream, packets, opts)
+      assert Enum.map(frames, & &1.pts) == Enum.to_list(0..9)
+      assert Enum.all?(frames, &(byte_size(&1.data) == byte_size(picture)))
+
+      # Converted pictures are packed, without padding.
+      scaled_opts =
+        Map.merge(opts, %{output_pixel_format: :rgba, output_width: 32, output_height: 24})
+
+      {:ok, ctx} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, scaled_opts)
+
+      assert %Membrane.RawVideo{pixel_format: :RGBA, width: 32, height: 24} =
+               LibAV.Format.raw!(LibAV.decoder_stream_format(ctx))
+
+      scaled = decode_sync(&LibAV.decoder_add_data/2, stream, packets, scaled_opts)
+      assert length(scaled) == 10
+      assert Enum.all?(scaled, &(byte_size(&1.data) == 32 * 24 * 4))
+    end
+  end
+end
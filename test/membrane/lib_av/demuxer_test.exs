@@ -3,6 +3,9 @@ defmodule Membrane.LibAV.DemuxerTest do
   import Membrane.Testing.Assertions
   import Membrane.ChildrenSpec
 
+  alias Membrane.LibAV
+  alias Membrane.LibAV.Support
+
   @testfiles [
     {"test/data/safari.mp4", "aac"},
     {"/Users/dmorn/projects/video-taxi-pepe-demo/test/data/babylon-30s-talk.mp4", "aac"},
@@ -11,6 +14,199 @@ defmodule Membrane.LibAV.DemuxerTest do
   ]
 
   describe "demuxer" do
+    test "probes the header incrementally" do
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+
+      "test/data/safari.mp4"
+      |> File.stream!([], 1024)
+      |> Enum.find(fn chunk ->
+        :ok = LibAV.demuxer_add_data(ctx, chunk)
+        LibAV.demuxer_is_ready(ctx)
+      end)
+
+      assert LibAV.demuxer_is_ready(ctx)
+
+      assert %{format: format, attempts: attempts, bytes_probed: probed} =
+               LibAV.demuxer_probe_stats(ctx)
+
+      # The header is only parsed once the moov box is complete.
+      assert to_string(format) =~ "mp4"
+      assert attempts == 1
+      assert probed > 0
+    end
+
+    test "honours format hints and probe limits" do
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{format: "mp4", skip_stream_info: true})
+      :ok = LibAV.demuxer_add_data(ctx, File.read!("test/data/safari.mp4"))
+      :ok = LibAV.demuxer_add_data(ctx, nil)
+      assert {:ok, [_ | _]} = LibAV.demuxer_streams(ctx)
+
+      assert %{format: format, score: 100, time_to_header: time, nif_time: nif_time} =
+               LibAV.demuxer_probe_stats(ctx)
+
+      assert to_string(format) =~ "mp4"
+      assert time >= nif_time and nif_time > 0
+
+      # No format is found in the allowed bytes, more data would not help.
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{max_probe_size: 1024})
+      assert {:error, _reason} = LibAV.demuxer_add_data(ctx, :binary.copy(<<0>>, 4096))
+
+      assert_raise ArgumentError, fn ->
+        LibAV.demuxer_alloc_context(2048, %{format: "no_such_format"})
+      end
+    end
+
+    test "exports the same packets with and without copying" do
+      {_streams, copied} = Support.Demux.demux("test/data/safari.mp4", zero_copy: false)
+      {_streams, exported} = Support.Demux.demux("test/data/safari.mp4", zero_copy: true)
+
+      assert length(exported) == length(copied)
+      assert Enum.map(exported, & &1.data) == Enum.map(copied, & &1.data)
+      metadata = fn packets -> Enum.map(packets, &Map.delete(&1, :data)) end
+      assert metadata.(exported) == metadata.(copied)
+    end
+
+    test "reads packets in batches" do
+      {_streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+      data = File.read!("test/data/safari.mp4")
+      :ok = LibAV.demuxer_add_data(ctx, data)
+      :ok = LibAV.demuxer_add_data(ctx, nil)
+      {:ok, _streams} = LibAV.demuxer_streams(ctx)
+
+      assert {:ok, batch} = LibAV.demuxer_read_packets(ctx, 3, 1_000_000)
+      assert length(batch) == 3
+      assert {:eof, rest} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+      assert batch ++ rest == packets
+    end
+
+    test "tracks runtime stats" do
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+      data = File.read!("test/data/safari.mp4")
+      :ok = LibAV.demuxer_add_data(ctx, data)
+      :ok = LibAV.demuxer_add_data(ctx, nil)
+      {:ok, _streams} = LibAV.demuxer_streams(ctx)
+      {:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+
+      stats = LibAV.demuxer_stats(ctx)
+      assert stats.bytes_in == byte_size(data)
+      assert stats.queue_high_water == byte_size(data)
+      assert stats.probe_attempts >= 1
+      assert stats.packets == length(packets)
+      assert stats.packet_bytes == Enum.reduce(packets, 0, &(byte_size(&1.data) + &2))
+      assert stats.nif_time > 0
+    end
+
+    test "accounts and caps native memory" do
+      data = File.read!("test/data/safari.mp4")
+      <<head::binary-size(1024), rest::binary>> = data
+
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+      :ok = LibAV.demuxer_add_data(ctx, head)
+
+      # Queued input is charged until it is read.
+      assert %{current: queued, limit: nil} = LibAV.demuxer_memory(ctx)
+      assert queued > byte_size(head)
+
+      :ok = LibAV.demuxer_add_data(ctx, rest)
+      :ok = LibAV.demuxer_add_data(ctx, nil)
+      {:ok, _streams} = LibAV.demuxer_streams(ctx)
+      {:eof, _packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+
+      assert %{memory: current, memory_peak: peak} = LibAV.demuxer_stats(ctx)
+      assert peak > byte_size(data)
+      assert current < peak
+
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{memory_limit: div(byte_size(data), 2)})
+      assert {:error, :memory_limit} = LibAV.demuxer_add_data(ctx, data)
+      assert {:error, :memory_limit} = LibAV.demuxer_alloc_context(2048, %{memory_limit: 1})
+    end
+
+    test "reads seekable files" do
+      {streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+
+      assert {:ok, ctx} = LibAV.demuxer_open_file("test/data/safari.mp4", %{})
+      assert LibAV.demuxer_is_ready(ctx)
+      assert LibAV.demuxer_demand(ctx) == 0
+
+      assert {:ok, file_streams} = LibAV.demuxer_streams(ctx)
+      assert Enum.map(file_streams, & &1.codec_name) == Enum.map(streams, & &1.codec_name)
+
+      assert {:eof, ^packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+
+      assert {:error, _reason} = LibAV.demuxer_open_file("test/data/missing.mp4", %{})
+    end
+
+    test "discards unselected streams" do
+      {streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+      audio = Enum.find(streams, &(&1.codec_type == :audio))
+
+      {:ok, ctx} = LibAV.demuxer_open_file("test/data/safari.mp4", %{})
+      :ok = LibAV.demuxer_select_streams(ctx, [audio.stream_index])
+
+      assert {:eof, selected} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+      assert selected == Enum.filter(packets, &(&1.stream_index == audio.stream_index))
+    end
+
+    test "seeks files to the preceding keyframe" do
+      {streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+      audio = Enum.find(streams, &(&1.codec_type == :audio))
+      packets = Enum.filter(packets, &(&1.stream_index == audio.stream_index))
+      target = Enum.at(packets, div(length(packets), 2))
+
+      {:ok, ctx} = LibAV.demuxer_open_file("test/data/safari.mp4", %{})
+      :ok = LibAV.demuxer_select_streams(ctx, [audio.stream_index])
+
+      # The mp4 index is available before reading any packet.
+      assert {:ok, [_ | _] = keyframes} = LibAV.demuxer_keyframes(ctx, audio.stream_index)
+      assert Enum.map(keyframes, & &1.pts) == Enum.sort(Enum.map(keyframes, & &1.pts))
+
+      assert {:ok, _batch} = LibAV.demuxer_read_packets(ctx, 10, 1_000_000)
+      assert :ok = LibAV.demuxer_seek(ctx, audio.stream_index, target.pts)
+      assert {:eof, [first | _] = rest} =
+               LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+      assert first.pts <= target.pts
+      assert rest == Enum.drop_while(packets, &(&1.pts < first.pts))
+
+      # Data fed by upstream elements is gone once read.
+      {:ok, stream_ctx} = LibAV.demuxer_alloc_context(2048, %{})
+      :ok = LibAV.demuxer_add_data(stream_ctx, File.read!("test/data/safari.mp4"))
+      assert {:error, _reason} = LibAV.demuxer_seek(stream_ctx, audio.stream_index, target.pts)
+    end
+
+    test "reads packets ahead on a native thread" do
+      {_streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+
+      {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+      tag = make_ref()
+      assert {:error, _reason} = LibAV.demuxer_start_read_ahead(ctx, tag)
+
+      :ok = LibAV.demuxer_add_data(ctx, File.read!("test/data/safari.mp4"))
+      assert LibAV.demuxer_is_ready(ctx)
+      :ok = LibAV.demuxer_start_read_ahead(ctx, tag)
+      :ok = LibAV.demuxer_add_data(ctx, nil)
+
+      # Packets are only handed out by the thread.
+      assert_raise ArgumentError, fn -> LibAV.demuxer_read_packets(ctx, 1, 1_000) end
+
+      assert take_packets(ctx, tag, []) == packets
+      assert {:eof, []} = LibAV.demuxer_take_packets(ctx)
+      assert LibAV.demuxer_stats(ctx).read_ahead_time > 0
+    end
+
+    test "demuxes files in a pipeline" do
+      spec = [
+        child(:demuxer, %Membrane.LibAV.FileDemuxer{location: "test/data/safari.mp4"})
+      ]
+
+      pid = Membrane.Testing.Pipeline.start_link_supervised!(spec: spec)
+
+      assert_pipeline_notified(pid, :demuxer, {:new_stream, %{codec_name: "aac"}}, 1_000)
+
+      :ok = Membrane.Testing.Pipeline.terminate(pid)
+    end
+
     for {path, codec_name} <- @testfiles do
       test "detects #{codec_name} in #{path}" do
         spec = [
@@ -33,4 +229,13 @@ defmodule Membrane.LibAV.DemuxerTest do
       end
     end
   end
+
+  defp take_packets(ctx, tag, acc) do
+    assert_receive {:libav_demuxer, ^tag}, 1_000
+
+    case LibAV.demuxer_take_packets(ctx) do
+      {:ok, packets} -> take_packets(ctx, tag, [packets | acc])
+      {:eof, packets} -> Enum.concat(Enum.reverse([packets | acc]))
+    end
+  end
 end
@@ -0,0 +1,116 @@
+defmodule Membrane.LibAV.EncoderTest do
+  use ExUnit.Case
+
+  alias Membrane.LibAV
+
+  @sample_rate 48_000
+  @audio_opts %{
+    sample_format: :s16,
+    sample_rate: @sample_rate,
+    channels: 1,
+    time_base: {1, @sample_rate}
+  }
+
+  # One second of a 440 Hz tone, in chunks of 100 ms.
+  defp sine_chunks() do
+    samples =
+      for i <- 0..(@sample_rate - 1), into: <<>> do
+        value = round(:math.sin(2 * :math.pi() * 440 * i / @sample_rate) * 10_000)
+        <<value::signed-native-16>>
+      end
+
+    chunk_samples = div(@sample_rate, 10)
+
+    chunks = for <<chunk::binary-size(chunk_samples * 2) <- samples>>, do: chunk
+    Enum.with_index(chunks, fn chunk, index -> %{data: chunk, pts: index * chunk_samples} end)
+  end
+
+  defp encode(ctx, frames) do
+    packets =
+      Enum.flat_map(frames, fn frame ->
+        {:ok, packets} = LibAV.encoder_add_data(ctx, frame)
+        packets
+      end)
+
+    {:eof, rest} = LibAV.encoder_add_data(ctx, nil)
+    packets ++ rest
+  end
+
+  describe "encoder" do
+    for codec <- ["aac", "opus", "flac", "pcm_s16le"] do
+      test "encodes audio with #{codec}" do
+        {:ok, ctx} = LibAV.encoder_alloc_context(unquote(codec), @audio_opts)
+
+        assert %{codec_type: :audio, codec_name: codec_name} = LibAV.encoder_stream(ctx)
+        assert to_string(codec_name) == unquote(codec)
+
+        assert [_ | _] = packets = encode(ctx, sine_chunks())
+        dts = Enum.map(packets, & &1.dts)
+        assert dts == Enum.sort(dts)
+      end
+    end
+
+    test "round trips through the decoder" do
+      chunks = sine_chunks()
+      {:ok, ctx} = LibAV.encoder_alloc_context("pcm_s16le", @audio_opts)
+      packets = encode(ctx, chunks)
+
+      stream = LibAV.encoder_stream(ctx)
+      {:ok, decoder} = LibAV.decoder_alloc_context(stream.codec_id, stream.codec_params, %{})
+
+      decoded =
+        Enum.map_join(packets, fn packet ->
+          {:ok, frames} = LibAV.decoder_add_data(decoder, packet)
+          Enum.map_join(frames, & &1.data)
+        end)
+
+      assert decoded == Enum.map_join(chunks, & &1.data)
+    end
+
+    test "tracks runtime stats" do
+      chunks = sine_chunks()
+      {:ok, ctx} = LibAV.encoder_alloc_context("aac", Map.put(@audio_opts, :bit_rate, 64_000))
+      packets = encode(ctx, chunks)
+
+      assert %{frames: frames, bytes_in: bytes_in, packets: count, errors: 0, nif_time: time} =
+               LibAV.encoder_stats(ctx)
+
+      assert frames == length(chunks)
+      assert bytes_in == Enum.reduce(chunks, 0, &(byte_size(&1.data) + &2))
+      assert count == length(packets)
+      assert time > 0
+    end
+
+    test "encodes video" do
+      {width, height} = {64, 48}
+      # A gray I420 picture.
+      picture = :binary.copy(<<128>>, div(width * height * 3, 2))
+
+      {:ok, ctx} =
+        LibAV.encoder_alloc_context("mpeg4", %{
+          pixel_format: :yuv420p,
+          width: width,
+          height: height,
+          framerate: {25, 1},
+          time_base: {1, 25},
+          thread_count: 2
+        })
+
+      assert %{codec_type: :video, time_base: {1, 25}} = LibAV.encoder_stream(ctx)
+
+      packets = encode(ctx, for(pts <- 0..9, do: %{data: picture, pts: pts}))
+      assert Enum.map(packets, & &1.pts) |> Enum.sort() == Enum.to_list(0..9)
+    end
+
+    test "rejects invalid configurations" do
+      assert {:error, _reason} = LibAV.encoder_alloc_context("no_such_codec", @audio_opts)
+      assert {:error, _reason} = LibAV.encoder_alloc_context("aac", %{})
+
+      assert {:error, {:unknown_option, ~c"no_such_option"}} =
+               LibAV.encoder_alloc_context(
+                 "aac",
+                 Map.put(@audio_opts, :codec_options, %{"no_such_option" => "1"})
+               )
+    end
+  end
+end
@@ -0,0 +1,145 @@
+defmodule Membrane.LibAV.MuxerTest do
+  use ExUnit.Case
+  import Membrane.Testing.Assertions
+
+  alias Membrane.LibAV
+  alias Membrane.LibAV.Support
+
+  defmodule RemuxPipeline do
+    use Membrane.Pipeline
+    import Membrane.ChildrenSpec
+
+    alias Membrane.LibAV
+
+    @impl true
+    def handle_init(_ctx, opts) do
+      spec = [
+        child(:demuxer, %LibAV.FileDemuxer{location: "test/data/safari.mp4"}),
+        child(:muxer, %LibAV.Muxer{format: "matroska"})
+        |> child(:sink, %Membrane.File.Sink{location: opts[:output_path]})
+      ]
+
+      {[spec: spec], %{nb_streams: opts[:nb_streams], streams: []}}
+    end
+
+    @impl true
+    def handle_child_notification({:new_stream, stream}, :demuxer, _ctx, state) do
+      state = %{state | streams: [stream | state.streams]}
+
+      # The muxer writes its header with the first buffer, hence every
+      # stream is linked at once.
+      if length(state.streams) == state.nb_streams do
+        spec =
+          for stream <- state.streams do
+            get_child(:demuxer)
+            |> via_out(Pad.ref(:output, stream.stream_index))
+            |> via_in(Pad.ref(:input, stream.stream_index), options: [stream: stream])
+            |> get_child(:muxer)
+          end
+
+        {[spec: spec], state}
+      else
+        {[], state}
+      end
+    end
+  end
+
+  setup_all do
+    {streams, packets} = Support.Demux.demux("test/data/safari.mp4")
+    %{streams: streams, packets: packets}
+  end
+
+  defp remux(streams, packets, format, options \\ %{}) do
+    {:ok, ctx} = LibAV.muxer_alloc_context(format, %{options: options})
+
+    for stream <- streams do
+      assert {:ok, stream.stream_index} ==
+               LibAV.muxer_add_stream(ctx, stream.codec_params, stream.time_base)
+    end
+
+    {:ok, header} = LibAV.muxer_write_header(ctx)
+    {:ok, body} = LibAV.muxer_write_packets(ctx, packets)
+    {:ok, trailer} = LibAV.muxer_write_trailer(ctx)
+
+    {ctx, header <> body <> trailer}
+  end
+
+  defp demux(data) do
+    {:ok, ctx} = LibAV.demuxer_alloc_context(2048, %{})
+    :ok = LibAV.demuxer_add_data(ctx, data)
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {:ok, streams} = LibAV.demuxer_streams(ctx)
+    {:eof, packets} = LibAV.demuxer_read_packets(ctx, 1_000_000, 1_000_000_000)
+    {streams, packets}
+  end
+
+  describe "muxer" do
+    test "remuxes to matroska without touching the payloads", %{
+      streams: streams,
+      packets: packets
+    } do
+      {ctx, output} = remux(streams, packets, "matroska")
+
+      assert %{packets: count, bytes_in: bytes_in, bytes_out: bytes_out} =
+               LibAV.muxer_stats(ctx)
+
+      assert count == length(packets)
+      assert bytes_in == Enum.reduce(packets, 0, &(byte_size(&1.data) + &2))
+      assert bytes_out == byte_size(output)
+
+      {remuxed_streams, remuxed} = demux(output)
+      assert Enum.map(remuxed_streams, & &1.codec_name) == Enum.map(streams, & &1.codec_name)
+      assert Enum.map(remuxed, & &1.data) == Enum.map(packets, & &1.data)
+    end
+
+    test "remuxes to fragmented mp4", %{streams: streams, packets: packets} do
+      options = %{"movflags" => "frag_keyframe+empty_moov"}
+      {_ctx, output} = remux(streams, packets, "mp4", options)
+      {_streams, remuxed} = demux(output)
+      assert Enum.map(remuxed, & &1.data) == Enum.map(packets, & &1.data)
+    end
+
+    test "remuxes to mpegts", %{streams: streams, packets: packets} do
+      {_ctx, output} = remux(streams, packets, "mpegts")
+
+      # AAC is framed with ADTS headers in MPEG-TS.
+      assert {[%{codec_name: ~c"aac"} | _], [_ | _]} = demux(output)
+    end
+
+    @tag :tmp_dir
+    test "remuxes the streams of a demuxer in a pipeline", %{
+      streams: streams,
+      packets: packets,
+      tmp_dir: dir
+    } do
+      output = Path.join(dir, "output.mkv")
+
+      pid =
+        Membrane.Testing.Pipeline.start_link_supervised!(
+          module: RemuxPipeline,
+          custom_args: [output_path: output, nb_streams: length(streams)]
+        )
+
+      assert_end_of_stream(pid, :sink, :input, 10_000)
+      :ok = Membrane.Testing.Pipeline.terminate(pid)
+
+      # Packets of different streams might be interleaved in another order.
+      {remuxed_streams, remuxed} = demux(File.read!(output))
+      assert length(remuxed_streams) == length(streams)
+      assert Enum.sort(Enum.map(remuxed, & &1.data)) == Enum.sort(Enum.map(packets, & &1.data))
+    end
+
+    test "rejects invalid configurations", %{streams: [stream | _]} do
+      assert {:error, _reason} = LibAV.muxer_alloc_context("no_such_format", %{})
+
+      # mp4 needs a seekable output unless fragmented.
+      {:ok, ctx} = LibAV.muxer_alloc_context("mp4", %{})
+      {:ok, _index} = LibAV.muxer_add_stream(ctx, stream.codec_params, stream.time_base)
+      assert {:error, _reason} = LibAV.muxer_write_header(ctx)
+
+      {:ok, ctx} = LibAV.muxer_alloc_context("matroska", %{options: %{"no_such_option" => "1"}})
+      {:ok, _index} = LibAV.muxer_add_stream(ctx, stream.codec_params, stream.time_base)
+      assert {:error, {:unknown_option, ~c"no_such_option"}} = LibAV.muxer_write_header(ctx)
+    end
+  end
+end
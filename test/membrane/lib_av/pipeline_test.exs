@@ -18,7 +18,13 @@ defmodule Membrane.LibAV.PipelineTest do
         |> child(:demuxer, Membrane.LibAV.Demuxer)
       ]
 
-      {[spec: spec], %{output_path: opts[:output_path], has_stream: false}}
+      encoder =
+        Keyword.get(opts, :encoder, %Membrane.AAC.FDK.Encoder{
+          aot: :mpeg4_he,
+          bitrate_mode: 0
+        })
+
+      {[spec: spec], %{output_path: opts[:output_path], encoder: encoder, has_stream: false}}
     end
 
     def handle_child_notification(
@@ -31,19 +37,14 @@ defmodule Membrane.LibAV.PipelineTest do
         get_child(:demuxer)
         |> via_out(Pad.ref(:output, stream.stream_index))
         |> child(:decoder, %Membrane.LibAV.Decoder{
-          stream: stream
-        })
-        |> child(:converter, %Membrane.FFmpeg.SWResample.Converter{
-          output_stream_format: %Membrane.RawAudio{
+          stream: stream,
+          output_format: %Membrane.RawAudio{
             channels: 1,
             sample_format: :s16le,
             sample_rate: 48_000
           }
         })
-        |> child(:encoder, %Membrane.AAC.FDK.Encoder{
-          aot: :mpeg4_he,
-          bitrate_mode: 0
-        })
+        |> child(:encoder, state.encoder)
         |> child(:sink, %Membrane.File.Sink{location: state.output_path})
 
       {[spec: spec], %{state | has_stream: true}}
@@ -67,4 +68,19 @@ defmodule Membrane.LibAV.PipelineTest do
     assert_end_of_stream(pid, :sink, :input, 100_000)
     :ok = Membrane.Pipeline.terminate(pid)
   end
+
+  @tag :tmp_dir
+  test "encodes with the libav encoder", %{tmp_dir: dir} do
+    output = Path.join([dir, "output.aac"])
+
+    pid =
+      Membrane.Testing.Pipeline.start_link_supervised!(
+        module: Pipeline,
+        custom_args: [output_path: output, encoder: %Membrane.LibAV.Encoder{codec: "aac"}]
+      )
+
+    assert_end_of_stream(pid, :sink, :input, 100_000)
+    :ok = Membrane.Pipeline.terminate(pid)
+    assert File.stat!(output).size > 0
+  end
 end
@@ -0,0 +1,36 @@
+defmodule Membrane.LibAV.Support.Demux do
+  @moduledoc false
+  # Drives the demuxer NIFs directly, without a pipeline.
+
+  alias Membrane.LibAV
+
+  def demux(path, opts \\ []) do
+    chunk_size = Keyword.get(opts, :chunk_size, 4096)
+    {:ok, ctx} =
+      LibAV.demuxer_alloc_context(
+        Keyword.get(opts, :probe_size, 2048),
+        Map.new(Keyword.take(opts, [:zero_copy]))
+      )
+
+    packets =
+      path
+      |> File.stream!([], chunk_size)
+      |> Enum.flat_map(fn chunk ->
+        :ok = LibAV.demuxer_add_data(ctx, chunk)
+        if LibAV.demuxer_is_ready(ctx), do: read_available(ctx, []), else: []
+      end)
+
+    :ok = LibAV.demuxer_add_data(ctx, nil)
+    {:ok, streams} = LibAV.demuxer_streams(ctx)
+
+    {streams, packets ++ read_available(ctx, [])}
+  end
+
+  defp read_available(ctx, acc) do
+    case LibAV.demuxer_read_packet(ctx) do
+      {:ok, packet} -> read_available(ctx, [packet | acc])
+      {:demand, _size} -> Enum.reverse(acc)
+      :eof -> Enum.reverse(acc)
+    end
+  end
+end